@@ -34,12 +34,19 @@
 
 #ifdef _KERNEL
 #include <types.h>
+#include <endian.h>
 #include <lib.h>
 #else
 #include <stdint.h>
 #include <string.h>
+#include <sys/endian.h>
 #endif
 
+/*
+ * Below this many bytes, setting up a word copy isn't worth it.
+ */
+#define MEMCPY_SHORT (4*sizeof(long))
+
 /*
  * C standard function - copy a block of memory.
  */
@@ -47,39 +54,79 @@
 void *
 memcpy(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	unsigned char *d = dst;
+	const unsigned char *s = src;
 
 	/*
 	 * memcpy does not support overlapping buffers, so always do it
 	 * forwards. (Don't change this without adjusting memmove.)
 	 *
-	 * For speedy copying, optimize the common case where both pointers
-	 * and the length are word-aligned, and copy word-at-a-time instead
-	 * of byte-at-a-time. Otherwise, copy by bytes.
-	 *
-	 * The alignment logic below should be portable. We rely on
-	 * the compiler to be reasonably intelligent about optimizing
-	 * the divides and modulos out. Fortunately, it is.
+	 * Short copies go byte by byte. Otherwise, copy bytes until the
+	 * destination is word-aligned and then move whole words. If the
+	 * source is then aligned as well the words go straight across,
+	 * four per iteration and then singly for the remainder. If not,
+	 * each destination word, one per iteration, is assembled from
+	 * the two aligned source words it straddles, so we still only
+	 * make word-sized loads; those never reach outside the aligned
+	 * words holding the source bytes and so can't fault where a
+	 * byte copy wouldn't. Any odd bytes at the end are done
+	 * separately.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	if (len >= MEMCPY_SHORT) {
+		while ((uintptr_t)d % sizeof(long) != 0) {
+			*d++ = *s++;
+			len--;
+		}
+
+		if ((uintptr_t)s % sizeof(long) == 0) {
+			long *dw = (long *)d;
+			const long *sw = (const long *)s;
 
-		long *d = dst;
-		const long *s = src;
+			while (len >= 4*sizeof(long)) {
+				dw[0] = sw[0];
+				dw[1] = sw[1];
+				dw[2] = sw[2];
+				dw[3] = sw[3];
+				dw += 4;
+				sw += 4;
+				len -= 4*sizeof(long);
+			}
+			while (len >= sizeof(long)) {
+				*dw++ = *sw++;
+				len -= sizeof(long);
+			}
+			d = (unsigned char *)dw;
+			s = (const unsigned char *)sw;
+		}
+		else {
+			unsigned off = (uintptr_t)s % sizeof(long);
+			unsigned lshift = off * 8;
+			unsigned rshift = sizeof(long) * 8 - lshift;
+			unsigned long *dw = (unsigned long *)d;
+			const unsigned long *sw;
+			unsigned long prev, next;
 
-		for (i=0; i<len/sizeof(long); i++) {
-			d[i] = s[i];
+			sw = (const unsigned long *)(s - off);
+			prev = *sw++;
+			while (len >= sizeof(long)) {
+				next = *sw++;
+#if _BYTE_ORDER == _BIG_ENDIAN
+				*dw++ = (prev << lshift) | (next >> rshift);
+#else
+				*dw++ = (prev >> lshift) | (next << rshift);
+#endif
+				prev = next;
+				len -= sizeof(long);
+			}
+			d = (unsigned char *)dw;
+			s = (const unsigned char *)sw - sizeof(long) + off;
 		}
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=0; i<len; i++) {
-			d[i] = s[i];
-		}
+	while (len > 0) {
+		*d++ = *s++;
+		len--;
 	}
 
 	return dst;
@@ -48,7 +48,8 @@
 void *
 memmove(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	char *d;
+	const char *s;
 
 	/*
 	 * If the buffers don't overlap, it doesn't matter what direction
@@ -75,42 +76,60 @@ memmove(void *dst, const void *src, size_t len)
          *                     |___|
 	 */
 
-	if ((uintptr_t)dst < (uintptr_t)src) {
+	if ((uintptr_t)dst < (uintptr_t)src ||
+	    (uintptr_t)dst >= (uintptr_t)src + len) {
 		/*
 		 * As author/maintainer of libc, take advantage of the
-		 * fact that we know memcpy copies forwards.
+		 * fact that we know memcpy copies forwards. (If the
+		 * destination is entirely above the source there's no
+		 * overlap at all, and memcpy's word copy handles every
+		 * alignment.)
 		 */
 		return memcpy(dst, src, len);
 	}
 
 	/*
-	 * Copy by words in the common case. Look in memcpy.c for more
-	 * information.
+	 * Copying backwards. Look in memcpy.c for how the word copy
+	 * works; here it's only used when source and destination are
+	 * aligned the same way, which covers page copies like those in
+	 * as_copy. Work from the top down.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	d = (char *)dst + len;
+	s = (const char *)src + len;
 
-		long *d = dst;
-		const long *s = src;
+	if (len >= 4*sizeof(long) &&
+	    (uintptr_t)d % sizeof(long) == (uintptr_t)s % sizeof(long)) {
+		long *dw;
+		const long *sw;
 
-		/*
-		 * The reason we copy index i-1 and test i>0 is that
-		 * i is unsigned -- so testing i>=0 doesn't work.
-		 */
+		while ((uintptr_t)d % sizeof(long) != 0) {
+			*--d = *--s;
+			len--;
+		}
 
-		for (i=len/sizeof(long); i>0; i--) {
-			d[i-1] = s[i-1];
+		dw = (long *)d;
+		sw = (const long *)s;
+		while (len >= 4*sizeof(long)) {
+			dw -= 4;
+			sw -= 4;
+			dw[3] = sw[3];
+			dw[2] = sw[2];
+			dw[1] = sw[1];
+			dw[0] = sw[0];
+			len -= 4*sizeof(long);
 		}
+		while (len >= sizeof(long)) {
+			*--dw = *--sw;
+			len -= sizeof(long);
+		}
+		d = (char *)dw;
+		s = (const char *)sw;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=len; i>0; i--) {
-			d[i-1] = s[i-1];
-		}
+	while (len > 0) {
+		*--d = *--s;
+		len--;
 	}
 
 	return dst;
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MIPS_ATOMIC_H_
+#define _MIPS_ATOMIC_H_
+
+#include <membar.h>
+
+/*
+ * Compare-and-swap using LL/SC; see spinlock_data_testandset in
+ * <machine/spinlock.h> for how those work. The only thing between
+ * the LL and the SC is the comparison branch.
+ *
+ * Y starts out as the new value; SC overwrites it with 1 on success
+ * or 0 on failure. If the comparison fails we skip the SC and X
+ * tells us so.
+ */
+ATOMIC_INLINE
+bool
+atomic_cas_ptr(void *volatile *p, void *oldval, void *newval)
+{
+	void *x;
+	void *y;
+
+	membar_any_any();
+	y = newval;
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set noreorder;"	/* we fill the delay slot ourselves */
+		"ll %0, 0(%2);"		/*   x = *p */
+		"bne %0, %3, 1f;"	/*   if (x != oldval) goto 1 */
+		" nop;"			/*   (delay slot) */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"1: .set pop"		/* restore assembler mode */
+		: "=&r" (x), "+r" (y) : "r" (p), "r" (oldval) : "memory");
+	if (x != oldval || y == NULL) {
+		return false;
+	}
+	membar_any_any();
+	return true;
+}
+
+ATOMIC_INLINE
+void *
+atomic_swap_ptr(void *volatile *p, void *newval)
+{
+	void *old;
+
+	do {
+		old = *p;
+	} while (!atomic_cas_ptr(p, old, newval));
+	return old;
+}
+
+#endif /* _MIPS_ATOMIC_H_ */
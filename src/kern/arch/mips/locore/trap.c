@@ -36,6 +36,7 @@
 #include <spl.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
@@ -195,6 +196,17 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+		/*
+		 * If another thread of this process has called _exit,
+		 * leave now instead of going back to user mode. Turn
+		 * interrupts back on first, as for any other trap.
+		 */
+		if (!iskern && curproc != NULL && curproc->p_exiting) {
+			spl = splhigh();
+			splx(spl);
+			uthread_leave(0);
+		}
 		goto done2;
 	}
 
@@ -37,6 +37,7 @@
 #include <current.h>
 #include <syscall.h>
 #include <kern/fcntl.h>
+#include <kern/wait.h>
 #include <copyinout.h>
 #include <vfs.h>
 #include <stat.h>
@@ -46,6 +47,9 @@
 #include <addrspace.h>
 #include <../arch/mips/include/trapframe.h>
 #include <limits.h>
+#include <kmem_cache.h>
+#include <pipe.h>
+#include <futex.h>
 
 
 /*
@@ -91,9 +95,50 @@
 //used for new child process
 struct childinfo {
 	struct trapframe* tf;
-	struct fdesc** fdtable;
+	struct fdesc* fdtable[OPEN_MAX];
 };
 
+/*
+ * Object caches for things every open or fork allocates.
+ */
+static
+int
+fdesc_ctor(void *obj)
+{
+	struct fdesc *fdesc = obj;
+
+	spinlock_init(&fdesc->fdcountlock);
+	return 0;
+}
+
+static
+void
+fdesc_dtor(void *obj)
+{
+	struct fdesc *fdesc = obj;
+
+	spinlock_cleanup(&fdesc->fdcountlock);
+}
+
+struct kmem_cache fdesc_cache =
+	KMEM_CACHE_INITIALIZER("fdesc", sizeof(struct fdesc),
+			       fdesc_ctor, fdesc_dtor);
+static struct kmem_cache trapframe_cache =
+	KMEM_CACHE_INITIALIZER("trapframe", sizeof(struct trapframe),
+			       NULL, NULL);
+static struct kmem_cache childinfo_cache =
+	KMEM_CACHE_INITIALIZER("childinfo", sizeof(struct childinfo),
+			       NULL, NULL);
+
+/*
+ * ARG_MAX-sized buffers for execv. The argument vector is copied in
+ * and laid out in one of these exactly as it will sit on the new
+ * user stack, so it goes out with a single copyout. At 64K each, only
+ * one is kept; kmalloc also drains it when memory runs short.
+ */
+static struct kmem_cache execargs_cache =
+	KMEM_CACHE_INITIALIZER_DEPTH("execargs", ARG_MAX, 1, NULL, NULL);
+
 void
 syscall(struct trapframe *tf)
 {
@@ -131,6 +176,11 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_nanosleep:
+		err = sys_nanosleep((userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+
 	    case SYS_open:
 			err = sys_open((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2, &retval);
 			
@@ -145,6 +195,29 @@ syscall(struct trapframe *tf)
 	    case SYS_close:
 			err = sys_close(tf->tf_a0);
 			break;
+	    case SYS_pipe:
+			err = sys_pipe((userptr_t)tf->tf_a0);
+			break;
+	    case SYS_dup2:
+			err = sys_dup2(tf->tf_a0, tf->tf_a1, &retval);
+			break;
+	    case SYS_ioctl:
+			err = sys_ioctl(tf->tf_a0, tf->tf_a1, (userptr_t)tf->tf_a2);
+			break;
+	    case SYS_poll:
+			err = sys_poll((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2, &retval);
+			break;
+	    case SYS_select:
+		{
+			//fifth argument is on the user stack
+			userptr_t tv;
+			err = copyin((const_userptr_t)(tf->tf_sp + 16), &tv, sizeof(tv));
+			if(err) break;
+			err = sys_select(tf->tf_a0, (userptr_t)tf->tf_a1,
+					 (userptr_t)tf->tf_a2, (userptr_t)tf->tf_a3,
+					 tv, &retval);
+			break;
+		}
 	    case SYS_getpid:
 			err = sys_getpid(&retval);
 			break;
@@ -152,18 +225,39 @@ syscall(struct trapframe *tf)
 			if(DEBUGP) kprintf("call fork\n");
 			err = sys_fork(tf, &retval);
 			break;
+	    case SYS_vfork:
+			err = sys_vfork(tf, &retval);
+			break;
 	    case SYS_execv:
-			err = sys_execv((userptr_t)tf->tf_a0, (char**)tf->tf_a1);
+			err = sys_execv((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
 			break;
 	    case SYS_waitpid:
-			err = sys_waitpid(tf->tf_a0, (int*) &tf->tf_a1, (int) tf->tf_a2, &retval);
+			err = sys_waitpid(tf->tf_a0, (userptr_t) tf->tf_a1, (int) tf->tf_a2, &retval);
 			break;
 	    case SYS_sbrk:
 			err = sys_sbrk(tf->tf_a0, &retval);
 			break;
+	    case SYS_sync:
+			err = sys_sync();
+			break;
 	    case SYS__exit:
 			sys__exit(tf->tf_a0);
 			break;
+	    case SYS___thread_create:
+			err = sys_thread_create(tf, (vaddr_t)tf->tf_a0,
+						(userptr_t)tf->tf_a1,
+						(userptr_t)tf->tf_a2, &retval);
+			break;
+	    case SYS_thread_exit:
+			sys_thread_exit(tf->tf_a0);
+			break;
+	    case SYS_thread_join:
+			err = sys_thread_join(tf->tf_a0, (userptr_t)tf->tf_a1);
+			break;
+	    case SYS_futex:
+			err = sys_futex((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+					&retval);
+			break;
 
 	    default:
 		if(DEBUGP) kprintf("Unknown syscall %d\n", callno);
@@ -196,6 +290,11 @@ syscall(struct trapframe *tf)
 	tf->tf_epc += 4;
 	//if(DEBUGP) kprintf("END OF SYSCALL\n");
 
+	//another thread called _exit; don't go back to user mode
+	if(curproc->p_exiting){
+		uthread_leave(0);
+	}
+
 	/* Make sure the syscall code didn't forget to lower spl */
 	KASSERT(curthread->t_curspl == 0);
 	/* ...or leak any spinlocks */
@@ -206,6 +305,94 @@ syscall(struct trapframe *tf)
 
 
 
+/*
+ * Get a reference to the open file in slot FD of the current
+ * process's table, or NULL if there isn't one. The caller may then
+ * use it without the table lock, even across a sleep, and must give
+ * it back with fdesc_release; a sibling thread closing FD meanwhile
+ * only drops the table's own reference.
+ *
+ * The count has its own spinlock rather than fdlock, which reads and
+ * writes on seekable files hold across I/O; waiting for that here,
+ * with p_fdlock held, would stall every table operation behind one
+ * slow read.
+ */
+struct fdesc* fdesc_get(int fd){
+	struct fdesc* fdesc;
+
+	if(fd < 0 || fd >= OPEN_MAX){
+		return NULL;
+	}
+	lock_acquire(curproc->p_fdlock);
+	fdesc = curproc->p_fdtable[fd];
+	if(fdesc != NULL){
+		spinlock_acquire(&fdesc->fdcountlock);
+		fdesc->refcount++;
+		spinlock_release(&fdesc->fdcountlock);
+	}
+	lock_release(curproc->p_fdlock);
+	return fdesc;
+}
+
+/*
+ * Drop a reference to FDESC, closing the file if it was the last.
+ */
+void fdesc_release(struct fdesc* fdesc){
+	bool last;
+
+	spinlock_acquire(&fdesc->fdcountlock);
+	KASSERT(fdesc->refcount > 0);
+	fdesc->refcount--;
+	last = (fdesc->refcount == 0);
+	spinlock_release(&fdesc->fdcountlock);
+
+	if(last){
+		vfs_close(fdesc->vn);
+		kfree(fdesc->fname);
+		lock_destroy(fdesc->fdlock);
+		kmem_cache_free(&fdesc_cache, fdesc);
+	}
+}
+
+/*
+ * Put FDESC, whose reference passes to the table, in the lowest free
+ * slot of the current process's table.
+ */
+static int fdesc_install(struct fdesc* fdesc, int* ret){
+	int fd;
+
+	lock_acquire(curproc->p_fdlock);
+	for(fd = 0; fd < OPEN_MAX; fd++){
+		if(curproc->p_fdtable[fd] == NULL){
+			curproc->p_fdtable[fd] = fdesc;
+			lock_release(curproc->p_fdlock);
+			*ret = fd;
+			return 0;
+		}
+	}
+	lock_release(curproc->p_fdlock);
+	return EMFILE;
+}
+
+/*
+ * Take slot FD out of the current process's table if it still holds
+ * FDESC, and drop the table's reference.
+ */
+static void fdesc_uninstall(int fd, struct fdesc* fdesc){
+	bool found;
+
+	lock_acquire(curproc->p_fdlock);
+	found = (curproc->p_fdtable[fd] == fdesc);
+	if(found){
+		curproc->p_fdtable[fd] = NULL;
+	}
+	lock_release(curproc->p_fdlock);
+
+	if(found){
+		fdesc_release(fdesc);
+	}
+}
+
 int sys_open(userptr_t filename, int flags, mode_t mode, int32_t* retval){
 	int fd, ret, flagmask;
 	size_t len;
@@ -235,60 +422,63 @@ int sys_open(userptr_t filename, int flags, mode_t mode, int32_t* retval){
 		return ENOMEM;
 	}
 
-	newfdesc = (struct fdesc*) kmalloc(sizeof(struct fdesc));
+	newfdesc = kmem_cache_alloc(&fdesc_cache);
 	if(newfdesc == NULL) {
 		kfree(name);
 		kfree(statbuf);
 		return ENOMEM;
 	}
 
-	//find file descriptor
-	for(fd = 0; fd < OPEN_MAX; fd++){
-		if((void*) curthread->t_fdtable[fd] == NULL) break;
-	}
-	curthread->t_fdtable[fd] = newfdesc;
-
 	//protect file name and open file
 	ret = copyinstr((const_userptr_t) filename, name, PATH_MAX, &len);
-	//if(DEBUGP) kprintf("Name before: %s, Name after: %s, len: %d\n", filename, name, len);
-	if(ret < 0){
+	if(ret){
 		kfree(name);
 		kfree(statbuf);
-		kfree(newfdesc);
-		return EIO;
+		kmem_cache_free(&fdesc_cache, newfdesc);
+		return ret;
 	}
 
 	ret = vfs_open(name, flags, mode, &vn);
 	if(ret){
 		kfree(name);
 		kfree(statbuf);
-		kfree(newfdesc);
+		kmem_cache_free(&fdesc_cache, newfdesc);
 		if(DEBUGP) kprintf("vfs_open failed\n");
 		return ret;
 	}
 
-	//set variables in file table
-	curthread->t_fdtable[fd]->fname = name;
-	curthread->t_fdtable[fd]->flags = flags;
-	curthread->t_fdtable[fd]->vn = vn;
-	curthread->t_fdtable[fd]->fdlock = lock_create(name);
-	curthread->t_fdtable[fd]->refcount = 1;
-
-	if(curthread->t_fdtable[fd]->vn == NULL){
-		if(DEBUGP) kprintf("vn is null in open after setting fdtable\n");
+	//fill in the file handle
+	newfdesc->fname = name;
+	newfdesc->flags = flags;
+	newfdesc->vn = vn;
+	newfdesc->fdlock = lock_create(name);
+	newfdesc->refcount = 1;
+	if(newfdesc->fdlock == NULL){
+		vfs_close(vn);
+		kfree(name);
+		kfree(statbuf);
+		kmem_cache_free(&fdesc_cache, newfdesc);
+		return ENOMEM;
 	}
 
 	//if append, set to file size
 	if((flags & O_APPEND) != 0){
 		//get vn statistics and set to current size
 		VOP_STAT(vn, statbuf);
-		curthread->t_fdtable[fd]->offset = statbuf->st_size;
+		newfdesc->offset = statbuf->st_size;
 	}else{
-		curthread->t_fdtable[fd]->offset = 0;
+		newfdesc->offset = 0;
 	}
 
 	kfree(statbuf);
-	
+
+	//only now make it visible to our other threads
+	ret = fdesc_install(newfdesc, &fd);
+	if(ret){
+		fdesc_release(newfdesc);
+		return ret;
+	}
+
 	*retval = fd;
 	if(DEBUGP) kprintf("retval: %d\n", *retval);
 	return 0;
@@ -296,46 +486,58 @@ int sys_open(userptr_t filename, int flags, mode_t mode, int32_t* retval){
 
 ssize_t sys_read(int fd, void* buf, size_t size, int32_t* retval){
 	int ret;
-	struct uio* read;
+	bool seekable;
+	struct fdesc* fdesc;
+	struct iovec iov;
+	struct uio ku;
+	struct uio* read = &ku;
 
 	//check valid arguments
-	if(curthread->t_fdtable[fd] == NULL || buf == NULL || size == 0){
+	if(buf == NULL || size == 0){
+		return EBADF;
+	}
+	fdesc = fdesc_get(fd);
+	if(fdesc == NULL){
 		return EBADF;
 	}
-	lock_acquire(curthread->t_fdtable[fd]->fdlock);
 
-	read = kmalloc(sizeof(struct uio));
+	//fdlock only guards the offset; don't hold it while a pipe or
+	//console read sleeps, or closing the other copy would block
+	seekable = VOP_ISSEEKABLE(fdesc->vn);
+	if(seekable) lock_acquire(fdesc->fdlock);
 
 	//set uio variables
+	read->uio_iov = &iov;
+	read->uio_iovcnt = 1;
 	read->uio_iov->iov_ubase = buf;
   	read->uio_iov->iov_len = size;
-  	read->uio_offset = curthread->t_fdtable[fd]->offset;
+  	read->uio_offset = fdesc->offset;
   	read->uio_resid = size;
   	read->uio_segflg = UIO_USERSPACE;
  	read->uio_rw = UIO_READ;
   	read->uio_space = curthread->t_proc->p_addrspace; //WE THINK?!?!
 
 	//read
-	ret = VOP_READ(curthread->t_fdtable[fd]->vn, read);
-	if(ret < 0){
-		kfree(read);
-		return ret;
+	ret = VOP_READ(fdesc->vn, read);
+	if(ret == 0){
+		//update offset and set return to how many bytes read
+		fdesc->offset = read->uio_offset;
+		*retval = size - read->uio_resid;
 	}
 
-	//update offset and set return to how many bytes read
-	curthread->t_fdtable[fd]->offset = read->uio_offset;
-
-	*retval = size - read->uio_resid;
-	kfree(read);
-	lock_release(curthread->t_fdtable[fd]->fdlock);
-
-	return 0;
+	if(seekable) lock_release(fdesc->fdlock);
+	fdesc_release(fdesc);
+	return ret;
 }
 
 int sys_write(int fd, void* buf, size_t size, int32_t* retval){
 
 	int ret;
-	struct uio* write;
+	bool seekable;
+	struct fdesc* fdesc;
+	struct iovec iov;
+	struct uio ku;
+	struct uio* write = &ku;
 	//if(DEBUGP) kprintf("SYS_WRITE: in sys_write\n");
 
 	//check valid arguments
@@ -343,82 +545,181 @@ int sys_write(int fd, void* buf, size_t size, int32_t* retval){
 		//kprintf("buff is null in write\n");
 		return EFAULT;
 	}
-	if(curthread->t_fdtable[fd] == NULL){
-		//kprintf("curthread->t_fdtable[fd] is null in write\n");
+	fdesc = fdesc_get(fd);
+	if(fdesc == NULL){
 		return EBADF;
 	}
-	//if(size == 0){
-	//	if(DEBUGP) kprintf("size is 0 in write\n");
-	//	return -1;
-	//}
-	//if(DEBUGP) kprintf("SYS_WRITE: get lock\n");
 	if(DEBUGP) kprintf("before lock_aqcuire\n");
-	lock_acquire(curthread->t_fdtable[fd]->fdlock);
+	seekable = VOP_ISSEEKABLE(fdesc->vn);
+	if(seekable) lock_acquire(fdesc->fdlock);
 
-	if(DEBUGP) kprintf("kmalloc write\n");
-	//if(DEBUGP) kprintf("SYS_WRITE: kmalloc for write\n");
-	write = kmalloc(sizeof(struct uio));
 	//set uio variables
-	//if(DEBUGP) kprintf("SYS_WRITE: set write variables\n");
-
-
-	if(DEBUGP) kprintf("malloc iov\n");
-	write->uio_iov = kmalloc(sizeof(struct iovec));
+	write->uio_iov = &iov;
+	write->uio_iovcnt = 1;
 
 	write->uio_iov->iov_ubase = (void*) buf;
   	write->uio_iov->iov_len = size;
-  	write->uio_offset = curthread->t_fdtable[fd]->offset;
+  	write->uio_offset = fdesc->offset;
   	write->uio_resid = size;
   	write->uio_segflg = UIO_USERSPACE;
  	write->uio_rw = UIO_WRITE;
   	write->uio_space = curthread->t_proc->p_addrspace; //WE THINK?!?!
 
-	//read
+	//write
 	if(DEBUGP) kprintf("VOP_Write\n");
-	ret = VOP_WRITE(curthread->t_fdtable[fd]->vn, write);
-	if(ret < 0){
-		kfree(write->uio_iov);
-		kfree(write);
+	ret = VOP_WRITE(fdesc->vn, write);
+	if(ret == 0){
+		//update offset and set return to how many bytes written
+		fdesc->offset = write->uio_offset;
+		*retval = size - write->uio_resid;
+	}
+
+	if(seekable) lock_release(fdesc->fdlock);
+	fdesc_release(fdesc);
+	return ret;
+}
+
+int sys_close(int fd){
+	struct fdesc* fdesc;
+
+	if(fd < 0 || fd >= OPEN_MAX){
+		return EBADF;
+	}
+
+	//take it out of the table
+	lock_acquire(curproc->p_fdlock);
+	fdesc = curproc->p_fdtable[fd];
+	curproc->p_fdtable[fd] = NULL;
+	lock_release(curproc->p_fdlock);
+	if(fdesc == NULL){
+		return EBADF;
+	}
+
+	//and drop the table's reference; threads still using it keep
+	//it open until they're done
+	fdesc_release(fdesc);
+	return 0;
+}
+
+/*
+ * Make a file handle for one end of a pipe.
+ */
+static struct fdesc* pipe_fdesc(struct vnode* vn, int flags){
+	struct fdesc* fdesc;
+
+	fdesc = kmem_cache_alloc(&fdesc_cache);
+	if(fdesc == NULL){
+		return NULL;
+	}
+	fdesc->fname = kstrdup("pipe");
+	fdesc->fdlock = lock_create("pipe");
+	if(fdesc->fname == NULL || fdesc->fdlock == NULL){
+		if(fdesc->fname != NULL) kfree(fdesc->fname);
+		if(fdesc->fdlock != NULL) lock_destroy(fdesc->fdlock);
+		kmem_cache_free(&fdesc_cache, fdesc);
+		return NULL;
+	}
+	fdesc->flags = flags;
+	fdesc->refcount = 1;
+	fdesc->offset = 0;
+	fdesc->vn = vn;
+	return fdesc;
+}
+
+int sys_pipe(userptr_t user_fds){
+	struct vnode* vns[2];
+	struct fdesc* ends[2];
+	int fds[2];
+	int i, fd, ret;
+
+	ret = pipe_create(&vns[0], &vns[1]);
+	if(ret){
 		return ret;
 	}
 
-	//update offset and set return to how many bytes read
-	curthread->t_fdtable[fd]->offset = write->uio_offset;
-	*retval = size - write->uio_resid;
-	kfree(write->uio_iov);
-	kfree(write);
-	lock_release(curthread->t_fdtable[fd]->fdlock);
+	ends[0] = pipe_fdesc(vns[0], O_RDONLY);
+	ends[1] = pipe_fdesc(vns[1], O_WRONLY);
+	if(ends[0] == NULL || ends[1] == NULL){
+		for(i = 0; i < 2; i++){
+			if(ends[i] != NULL){
+				fdesc_release(ends[i]);
+			}else{
+				vfs_close(vns[i]);
+			}
+		}
+		return ENOMEM;
+	}
 
+	//find two free descriptors and fill them at once
+	lock_acquire(curproc->p_fdlock);
+	i = 0;
+	for(fd = 0; fd < OPEN_MAX && i < 2; fd++){
+		if(curproc->p_fdtable[fd] == NULL) fds[i++] = fd;
+	}
+	if(i == 2){
+		curproc->p_fdtable[fds[0]] = ends[0];
+		curproc->p_fdtable[fds[1]] = ends[1];
+	}
+	lock_release(curproc->p_fdlock);
+	if(i < 2){
+		fdesc_release(ends[0]);
+		fdesc_release(ends[1]);
+		return EMFILE;
+	}
+
+	ret = copyout(fds, user_fds, sizeof(fds));
+	if(ret){
+		fdesc_uninstall(fds[0], ends[0]);
+		fdesc_uninstall(fds[1], ends[1]);
+		return ret;
+	}
 	return 0;
 }
 
-int sys_close(int fd){
-	if(curthread->t_fdtable[fd] == NULL){
+int sys_dup2(int oldfd, int newfd, int32_t* retval){
+	struct fdesc* fdesc;
+	struct fdesc* displaced = NULL;
+
+	if(oldfd < 0 || oldfd >= OPEN_MAX || newfd < 0 || newfd >= OPEN_MAX){
 		return EBADF;
 	}
 
-	//acquire lock
-	lock_acquire(curthread->t_fdtable[fd]->fdlock);
-
+	lock_acquire(curproc->p_fdlock);
+	fdesc = curproc->p_fdtable[oldfd];
+	if(fdesc == NULL){
+		lock_release(curproc->p_fdlock);
+		return EBADF;
+	}
+	if(oldfd != newfd){
+		spinlock_acquire(&fdesc->fdcountlock);
+		fdesc->refcount++;
+		spinlock_release(&fdesc->fdcountlock);
+		displaced = curproc->p_fdtable[newfd];
+		curproc->p_fdtable[newfd] = fdesc;
+	}
+	lock_release(curproc->p_fdlock);
 
-	//decrease reference counter
-	curthread->t_fdtable[fd]->refcount--;
-	
-	//if no more references, close fd
-	if(curthread->t_fdtable[fd]->refcount == 0){
-		vfs_close(curthread->t_fdtable[fd]->vn);
-		kfree(curthread->t_fdtable[fd]->fname);
-		lock_destroy(curthread->t_fdtable[fd]->fdlock);
-		kfree(curthread->t_fdtable[fd]);
-		if(DEBUGP) kprintf("freed fd \n");
-		curthread->t_fdtable[fd] = NULL;
-	}else{
-		lock_release(curthread->t_fdtable[fd]->fdlock);
+	if(displaced != NULL){
+		fdesc_release(displaced);
 	}
 
+	*retval = newfd;
 	return 0;
 }
 
+int sys_ioctl(int fd, int code, userptr_t data){
+	struct fdesc* fdesc;
+	int ret;
+
+	fdesc = fdesc_get(fd);
+	if(fdesc == NULL){
+		return EBADF;
+	}
+	ret = VOP_IOCTL(fdesc->vn, code, data);
+	fdesc_release(fdesc);
+	return ret;
+}
+
 
 /*
  * Enter user mode for a newly forked process.
@@ -445,270 +746,470 @@ void enter_forked_process(void* cinfo, unsigned long x){
 
 	if(DEBUGP) kprintf("copy fdtable\n");
 	for(i = 0; i < OPEN_MAX; i++){
-		curthread->t_fdtable[i] = info->fdtable[i];
-		if(curthread->t_fdtable[i] != NULL)
-			curthread->t_fdtable[i]->refcount++;
+		curproc->p_fdtable[i] = info->fdtable[i];
 	}
 
 	struct trapframe newtf;
 	memcpy(&newtf, info->tf, sizeof(struct trapframe));	
 
 	if(DEBUGP) kprintf("call mips_usermode\n");
-	mips_usermode(&newtf);
+	kmem_cache_free(&trapframe_cache, info->tf);
+	kmem_cache_free(&childinfo_cache, info);
 
-	kfree(info->tf);
-	kfree(info);
+	mips_usermode(&newtf);
 }
 
 
-pid_t sys_fork(struct trapframe *tf, int32_t* retval){
+/*
+ * Common part of fork and vfork. With VFORK the child borrows our
+ * address space instead of getting a copy; the caller must then wait
+ * for it with proc_vfork_wait before returning to user mode. The
+ * child's pid is returned in PID, since once it is running another
+ * of our threads could reap it and free the proc.
+ */
+static int fork_common(struct trapframe *tf, bool vfork, struct proc** ret,
+		       pid_t *pid){
 
 	struct childinfo* info;
 	struct trapframe* newtf;
 	struct addrspace* newas;
 	struct proc* newproc;
-	int i, j;
-
-	if(DEBUGP) kprintf("start sys_fork!!!!!!!!!!!!!!!!!: %d\n", sizeof(struct proc));
-	newproc = (struct proc*) kmalloc(sizeof(struct proc));
+	int j, err;
 
-	lock_acquire(proc_Lock);
+	//get a pid and hook the child onto our child list
+	err = proc_create_fork(&newproc);
+	if(err) {
+		return err;
+	}
 
-	if(DEBUGP) kprintf("num threads: %d\n", newproc->p_numthreads);
+	if(vfork) {
+		newproc->p_addrspace = proc_getas();
+		newproc->p_vfork = true;
+		newproc->p_vforkheld = true;
+	}
+	else {
+		err = as_copy(proc_getas(), &newas);
+		if(err) {
+			proc_destroy(newproc);
+			return err;
+		}
+		newproc->p_addrspace = newas;
+	}
 
 	//make copy of tf
-	if(DEBUGP) kprintf("make newtf\n");
-	newtf = (struct trapframe*) kmalloc(sizeof(struct trapframe));
-	if(DEBUGP) kprintf("memcpy newtf\n");
+	newtf = kmem_cache_alloc(&trapframe_cache);
+	if(newtf == NULL) {
+		err = ENOMEM;
+		goto fail;
+	}
 	memcpy(newtf, tf, sizeof(struct trapframe));
 
-	//make copy of as
-	if(DEBUGP) kprintf("call as_copy\n");
-	as_copy(curthread->t_proc->p_addrspace, &newas);
-	if(DEBUGP) kprintf("end as_copy\n");
-
-	//make new process
-	newproc->p_name = (char*) kmalloc(sizeof(char));
-	newproc->p_name[0] = '\0';
-
-	for(i = 1; i < __PID_MAX; i++){
-		if(proc_Array[i] == NULL) break;
+	//take the child's references now; the parent may close its
+	//copies before the child gets to run
+	info = kmem_cache_alloc(&childinfo_cache);
+	if(info == NULL) {
+		kmem_cache_free(&trapframe_cache, newtf);
+		err = ENOMEM;
+		goto fail;
 	}
-	if(i == __PID_MAX) {
-		return ENPROC;
+	info->tf = newtf;
+	lock_acquire(curproc->p_fdlock);
+	for(j = 0; j < OPEN_MAX; j++){
+		info->fdtable[j] = curproc->p_fdtable[j];
+		if(info->fdtable[j] != NULL){
+			spinlock_acquire(&info->fdtable[j]->fdcountlock);
+			info->fdtable[j]->refcount++;
+			spinlock_release(&info->fdtable[j]->fdcountlock);
+		}
+	}
+	lock_release(curproc->p_fdlock);
+
+	*pid = newproc->p_id;
+	err = thread_fork(vfork ? "vforkproc" : "childproc", newproc,
+			  enter_forked_process, info, 0);
+	if(err) {
+		for(j = 0; j < OPEN_MAX; j++){
+			if(info->fdtable[j] != NULL){
+				fdesc_release(info->fdtable[j]);
+			}
+		}
+		kmem_cache_free(&trapframe_cache, newtf);
+		kmem_cache_free(&childinfo_cache, info);
+		goto fail;
 	}
-	proc_Array[i] = newproc;
-	*retval = i;
-	newproc->p_id = i;
-	newproc->p_numthreads = 1;
-	newproc->p_addrspace = newas;
-	newproc->p_cwd = curthread->t_proc->p_cwd;
-
-	newproc->p_parent = curthread->t_proc->p_id;
 
+	*ret = newproc;
+	return 0;
 
-	newproc->p_parsem = kmalloc(sizeof(struct semaphore));
-	newproc->p_childsem = kmalloc(sizeof(struct semaphore));
+ fail:
+	if(vfork) {
+		//not ours to destroy
+		newproc->p_addrspace = NULL;
+	}
+	proc_destroy(newproc);
+	return err;
+}
 
-	newproc->p_parsem = sem_create("parent", 0);
-	newproc->p_childsem = sem_create("child", 0);
-	
-	memset(newproc->p_children, -1, __PID_MAX);
+pid_t sys_fork(struct trapframe *tf, int32_t* retval){
+	struct proc* newproc;
+	pid_t pid;
+	int err;
 
-	for(j = 0; j < __PID_MAX; j++){
-		if(curthread->t_proc->p_children[j] == -1){
-			curthread->t_proc->p_children[j] = newproc->p_id;
-			break;
-		}
+	err = fork_common(tf, false, &newproc, &pid);
+	if(err) {
+		return err;
 	}
+	*retval = pid;
+	return 0;
+}
 
-	if(j == __PID_MAX){
-		return ENPROC;
+/*
+ * vfork: like fork, but without copying the address space. The child
+ * runs on our memory and stack while we sleep, until it calls execv
+ * or _exit.
+ */
+pid_t sys_vfork(struct trapframe *tf, int32_t* retval){
+	struct proc* newproc;
+	pid_t pid;
+	int err;
+
+	err = fork_common(tf, true, &newproc, &pid);
+	if(err) {
+		return err;
 	}
+	proc_vfork_wait(newproc);
+	*retval = pid;
+	return 0;
+}
 
+pid_t sys_getpid(int32_t* retval){
+	*retval = curthread->t_proc->p_id;
+	return 0;
+}
 
-	
 
+/*
+ * Copy the user argv array ARGS into BUF. The strings are packed from
+ * the front of BUF and each one's offset is stored at the back, last
+ * argument lowest, until execv_layout puts them in their final place.
+ * Space is reserved as we go for the argv array and the offsets, so
+ * the layout step can never run out of room.
+ */
+static int execv_copyargs(userptr_t args, char* buf, int* argcret, size_t* usedret){
+	size_t* offsets = (size_t*) (buf + ARG_MAX);
+	userptr_t uarg;
+	size_t used, reserve, got;
+	int argc, ret;
+
+	used = 0;
+	for(argc = 0; ; argc++){
+		ret = copyin((const_userptr_t) ((vaddr_t) args + argc * sizeof(userptr_t)),
+			     &uarg, sizeof(uarg));
+		if(ret){
+			return ret;
+		}
+		if(uarg == NULL){
+			break;
+		}
 
-	info = (struct childinfo*) kmalloc(sizeof(struct childinfo));
-	info->tf = newtf;
-	info->fdtable = curthread->t_fdtable;
+		//argv slots for this argument plus the terminating NULL,
+		//and this argument's offset
+		reserve = sizeof(userptr_t) * (argc + 2) + sizeof(size_t) * (argc + 1);
+		if(used + reserve >= ARG_MAX){
+			return E2BIG;
+		}
+		ret = copyinstr((const_userptr_t) uarg, buf + used, ARG_MAX - used - reserve, &got);
+		if(ret){
+			return (ret == ENAMETOOLONG) ? E2BIG : ret;
+		}
+		offsets[-(argc + 1)] = used;
+		used += got;
+	}
 
-	lock_release(proc_Lock);
+	*argcret = argc;
+	*usedret = used;
+	return 0;
+}
 
-	if(DEBUGP) kprintf("call thread_fork\n");
-	thread_fork("childproc", newproc, enter_forked_process, info, 0);
-	
-	//kfree(newproc->p_name);
-	//kfree(newproc);
-	
+/*
+ * Turn the output of execv_copyargs into the image of the top of the
+ * new user stack: the argv array followed by the strings, padded to
+ * 8 bytes. The image will end at *STACKPTR; *STACKPTR is moved down
+ * to its start, which is also where argv lives. Returns the size.
+ */
+static size_t execv_layout(char* buf, int argc, size_t used, vaddr_t* stackptr){
+	size_t* offsets = (size_t*) (buf + ARG_MAX);
+	userptr_t* argv = (userptr_t*) buf;
+	size_t ptrsize, total;
+	vaddr_t base;
+	int i;
 
-	return 0;
+	ptrsize = sizeof(userptr_t) * (argc + 1);
+	total = ROUNDUP(ptrsize + used, 8);
+	base = *stackptr - total;
 
-}
+	memmove(buf + ptrsize, buf, used);
+	for(i = 0; i < argc; i++){
+		argv[i] = (userptr_t) (base + ptrsize + offsets[-(i + 1)]);
+	}
+	argv[argc] = NULL;
+	//only after the offsets are no longer needed
+	bzero(buf + ptrsize + used, total - ptrsize - used);
 
-pid_t sys_getpid(int32_t* retval){
-	*retval = curthread->t_proc->p_id;
-	return 0;
+	*stackptr = base;
+	return total;
 }
 
-
-int sys_execv(userptr_t prog, char** args){
+int sys_execv(userptr_t prog, userptr_t args){
 	char* progname;
-	char** progargs;
-	size_t size;
-	int ret, argc, i;
+	char* argbuf;
+	size_t size, used;
+	int ret, argc;
 	struct vnode *v;
-	vaddr_t startptr, stackptr;
-	userptr_t* argptr;
+	struct addrspace *oldas, *newas;
+	vaddr_t entrypoint, stackptr;
 
-	//struct addrspace *as;
-	//struct vnode *v;
-	//vaddr_t entrypoint, stackptr;
+	//there's no way yet to take the other threads down with us
+	if(curproc->p_nuthreads > 1){
+		return EBUSY;
+	}
 
-	//set program name
-	progname = (char*) kmalloc(sizeof(char) * PATH_MAX);
+	progname = kmalloc(PATH_MAX);
+	if(progname == NULL){
+		return ENOMEM;
+	}
 	ret = copyinstr((const_userptr_t) prog, progname, PATH_MAX, &size);
+	if(ret == 0 && size == 1){
+		ret = EINVAL;
+	}
 	if(ret){
 		kfree(progname);
-		return EFAULT;
+		return ret;
 	}
-	if(size == 1){
+
+	argbuf = kmem_cache_alloc(&execargs_cache);
+	if(argbuf == NULL){
 		kfree(progname);
-		return EINVAL;
+		return ENOMEM;
+	}
+	ret = execv_copyargs(args, argbuf, &argc, &used);
+	if(ret){
+		kfree(progname);
+		goto fail_args;
 	}
 
-	if(DEBUGP) kprintf("EXECV: name = %s\n", progname);
+	ret = vfs_open(progname, O_RDONLY, 0, &v);
+	kfree(progname);
+	if(ret){
+		goto fail_args;
+	}
 
-	for(argc = 0; (void*) args[argc] != NULL; argc++);
+	//load into a fresh address space and keep the old one until the
+	//new program is known to be good, so a failed exec returns to the
+	//caller intact
+	newas = as_create();
+	if(newas == NULL){
+		vfs_close(v);
+		ret = ENOMEM;
+		goto fail_args;
+	}
+	oldas = proc_setas(newas);
+	as_activate();
 
-	progargs = (char**) kmalloc(sizeof(char*) * argc);
-	for(i = 0; i < argc; i++){
-		progargs[i] = (char*) kmalloc(sizeof(char) * strlen(args[i]) + 1);
-		ret = copyinstr((const_userptr_t) args[i], progargs[i], sizeof(char) * strlen(args[i]) + 1, &size);
-		
-		if(DEBUGP) kprintf("EXECV: read args[%d] = %s\n", i, progargs[i]);
-		//TODO error check
-	}	
+	ret = load_elf(v, &entrypoint);
+	vfs_close(v);
+	if(ret){
+		goto fail_as;
+	}
 
-	if(curthread->t_proc->p_addrspace != NULL){
-		if(DEBUGP) kprintf("EXECV: destroy as\n");
-		as_destroy(curthread->t_proc->p_addrspace);
+	ret = as_define_stack(newas, &stackptr);
+	if(ret){
+		goto fail_as;
 	}
 
-	if(DEBUGP) kprintf("EXECV: vfs_open\n");
-	ret = vfs_open((char*) progname, O_RDONLY, 0, &v);
+	size = execv_layout(argbuf, argc, used, &stackptr);
+	ret = copyout(argbuf, (userptr_t) stackptr, size);
 	if(ret){
-		return ret;
+		goto fail_as;
 	}
 
-	//create and activate new as
-	if(DEBUGP) kprintf("EXECV: create as\n");
-	curthread->t_proc->p_addrspace = as_create();
-	if(DEBUGP) kprintf("EXECV: activate as\n");
-	as_activate();
-	
-	if(DEBUGP) kprintf("EXECV: load_elf\n");
-	ret = load_elf(v, &startptr);
-	
+	kmem_cache_free(&execargs_cache, argbuf);
+	//a vfork child hands its parent's address space back here
+	if(!proc_vfork_release() && oldas != NULL){
+		as_destroy(oldas);
+	}
 
-	vfs_close(v);
-	ret = as_define_stack(curthread->t_proc->p_addrspace, &stackptr);
+	enter_new_process(argc, (userptr_t) stackptr, NULL, stackptr, entrypoint);
 
+ fail_as:
+	proc_setas(oldas);
+	as_activate();
+	as_destroy(newas);
+ fail_args:
+	kmem_cache_free(&execargs_cache, argbuf);
+	return ret;
+}
 
-	if(DEBUGP) kprintf("EXECV: move stackptr\n");
-	stackptr -= sizeof(char*) * (argc + 1);
-	argptr = (userptr_t*) stackptr;
-	copyout(progargs, (userptr_t) argptr, sizeof(char*) * (argc + 1));
+pid_t sys_waitpid(pid_t pid, userptr_t status, int flags, int32_t* retval){
+	int err, code;
+	pid_t ret;
 
-	for(i = 0; i < argc; i++){
-		if(DEBUGP) kprintf("EXECV: set argptr[%d]\n", i);
-		stackptr -= sizeof(char) * (strlen(progargs[i]) + 1);
-		argptr[i] = (userptr_t) stackptr;
-		copyout(progargs[i], (userptr_t) argptr[i], sizeof(char) * (strlen(progargs[i]) + 1));
+	err = proc_wait(pid, flags, &code, &ret);
+	if(err) {
+		return err;
 	}
 
-	argptr[argc] = 0;
-	stackptr -= stackptr % 8;
-
-	if(DEBUGP) kprintf("EXECV: enter new process\n");
-	enter_new_process(argc, (userptr_t) argptr, NULL, stackptr, startptr);
+	//WNOHANG with nothing to reap leaves *status alone
+	if(status != NULL && ret != 0) {
+		err = copyout(&code, status, sizeof(int));
+		if(err) {
+			return err;
+		}
+	}
 
-	(void) progargs;
+	*retval = ret;
 	return 0;
 }
 
-pid_t sys_waitpid(pid_t pid, int *returncode, int flags, int32_t* retval){
-	(void) flags;
-	(void) pid;
-	(void) returncode;
-	(void) retval;
+/*
+ * Take the current thread out of its process and exit it. The last
+ * thread out closes the files and exits the process; until then the
+ * process is still running and its files stay open.
+ */
+void uthread_leave(int code){
+	int i;
 
-	if(proc_Array[pid] == NULL){
-		return -1;
-	}
-	if(DEBUGP) kprintf("WAITPID: waiting for parent\n");
-	P(proc_Array[pid]->p_childsem);
-	if(DEBUGP) kprintf("WAITPID: done waiting for parent\n");
-	*returncode = proc_Array[pid]->p_exitcode;
-	*retval = pid;
+	if(proc_thread_leave(code)){
+		//drop open files first so pipe readers see EOF
+		for(i = 0; i < OPEN_MAX; i++){
+			if(curproc->p_fdtable[i] != NULL) sys_close(i);
+		}
 
-	/*
-	if(proc_Array[pid] == NULL){
-		return -1;
+		//frees the address space and wakes the parent; we keep
+		//only the exit status until we are reaped. If nobody
+		//called _exit this is like exit(0).
+		proc_exit(_MKWAIT_EXIT(0));
 	}
 
-	V(proc_Array[pid]->p_waitsem);
-
-	*retval = pid;
-	*returncode = proc_Array[pid]->p_exitcode;
-	*/
-	return 0;
+	thread_exit();
 }
 
 void sys__exit(int code){
-	int i = 0;
-	curthread->t_proc->p_exitcode = code;
-	
-	V(curthread->t_proc->p_childsem);
+	//the other threads, if any, leave on their way back to user mode;
+	//proc_setexit interrupts the ones blocked in pipes, the console,
+	//poll or nanosleep, and we get the ones on futexes moving too
+	proc_setexit(_MKWAIT_EXIT(code));
+	if(curproc->p_nuthreads > 1){
+		futex_wakeall();
+	}
+	uthread_leave(0);
+}
 
-	P(curthread->t_proc->p_parsem);
+/*
+ * Start a new thread of the current process. It gets a copy of our
+ * registers (so $gp and friends are right) and begins at ENTRY with
+ * FUNC and ARG as its first two arguments, on a stack of its own.
+ */
+int sys_thread_create(struct trapframe *tf, vaddr_t entry, userptr_t func,
+		      userptr_t arg, int32_t* retval){
+	struct trapframe* newtf;
+	struct uthread* ut;
+	int tid, err;
 
-	proc_Array[curthread->t_proc->p_id] = NULL;
+	err = proc_thread_create(&ut);
+	if(err){
+		return err;
+	}
 
-	for(i = 0; curthread->t_proc->p_children[i] != -1; i++){
-		V(proc_Array[curthread->t_proc->p_children[i]]->p_parsem);	
+	newtf = kmem_cache_alloc(&trapframe_cache);
+	if(newtf == NULL){
+		proc_thread_abort(ut);
+		return ENOMEM;
+	}
+	memcpy(newtf, tf, sizeof(struct trapframe));
+	newtf->tf_epc = entry;
+	newtf->tf_a0 = (vaddr_t) func;
+	newtf->tf_a1 = (vaddr_t) arg;
+	newtf->tf_ra = 0;
+	//leave the 16-byte argument save area the calling convention expects
+	newtf->tf_sp = ut->ut_stack - 16;
+
+	//once it runs it can exit and be joined before we look again
+	tid = ut->ut_tid;
+
+	err = thread_fork("uthread", curproc, enter_uthread, newtf,
+			  (unsigned long) ut);
+	if(err){
+		kmem_cache_free(&trapframe_cache, newtf);
+		proc_thread_abort(ut);
+		return err;
 	}
 
-	kfree(curthread->t_proc->p_parsem);
-	kfree(curthread->t_proc->p_childsem);
-	kfree(curthread->t_proc->p_name);
-	spinlock_cleanup(&curthread->t_proc->p_lock);
-	as_destroy(curthread->t_proc->p_addrspace);
+	*retval = tid;
+	return 0;
+}
 
-	thread_exit();
+/*
+ * First thing a new user thread runs; see sys_thread_create.
+ */
+void enter_uthread(void* tfv, unsigned long utv){
+	struct trapframe tf;
 
-	kprintf("should not get here!!!!!!!\n");
+	curthread->t_uthread = (struct uthread*) utv;
 
-	while(1);
+	memcpy(&tf, tfv, sizeof(struct trapframe));
+	kmem_cache_free(&trapframe_cache, tfv);
 
+	mips_usermode(&tf);
+}
+
+void sys_thread_exit(int code){
+	uthread_leave(code);
+}
+
+int sys_thread_join(int tid, userptr_t code){
+	int err, val;
+
+	err = proc_thread_join(tid, &val);
+	if(err){
+		return err;
+	}
+	if(code != NULL){
+		return copyout(&val, code, sizeof(int));
+	}
+	return 0;
 }
 
 int sys_sbrk(int inc, int* retval) {
+		struct addrspace *as = curproc->p_addrspace;
+		int err = 0;
+
 		inc += 4 - (inc % 4);
-		if(curproc->p_addrspace->as_heapend + inc > curproc->p_addrspace->as_stackpbase) {
+
+		/* sibling threads share the break */
+		lock_acquire(as->as_lock);
+		if(as->as_heapend + inc > as->as_stackpbase) {
 			*retval = -1;
-			return ENOMEM;
+			err = ENOMEM;
 		}
-
-		if(curproc->p_addrspace->as_heapend + inc < curproc->p_addrspace->as_heapstart) {
+		else if(as->as_heapend + inc < as->as_heapstart) {
 			*retval = -1;
-			return EINVAL;
+			err = EINVAL;
 		}
+		else {
+			*retval = as->as_heapend;
+			as->as_heapend += inc;
+		}
+		lock_release(as->as_lock);
+		return err;
+}
 
-		*retval = curproc->p_addrspace->as_heapend;
-		curproc->p_addrspace->as_heapend += inc;
-		return 0;
+/*
+ * Metadata is normally written back by the syncer thread; sync()
+ * lets userland force it out now.
+ */
+int sys_sync(void) {
+		return vfs_sync();
 }
 
 
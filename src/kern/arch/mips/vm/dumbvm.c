@@ -391,6 +391,27 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * dumbvm's regions are fixed at load time, so there's nowhere to put
+ * extra thread stacks.
+ */
+int
+as_alloc_threadstack(struct addrspace *as, int *slot, vaddr_t *stackptr)
+{
+	(void)as;
+	(void)slot;
+	(void)stackptr;
+	return ENOSYS;
+}
+
+void
+as_free_threadstack(struct addrspace *as, int slot)
+{
+	(void)as;
+	(void)slot;
+	panic("dumbvm: as_free_threadstack\n");
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
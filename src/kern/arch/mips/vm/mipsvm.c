@@ -43,6 +43,7 @@
 #include <vfs.h>
 #include <kern/fcntl.h>
 #include <stat.h>
+#include <kmem_cache.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -64,6 +65,10 @@
 /* (this must be > 64K so argument blocks of size ARG_MAX will fit) */
 #define DUMBVM_STACKPAGES    18
 
+/* Thread stack slots sit directly below the main stack. */
+#define UTHREAD_SLOTSIZE     (UTHREAD_STACKPAGES * PAGE_SIZE)
+#define UTHREAD_STACKTOP     (USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE)
+
 
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 static struct lock* cm_lock;
@@ -279,15 +284,126 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	tlb_write(ehi, elo, ts->ts_placeholder);
 }
 
+/*
+ * Map FAULTADDRESS in AS through the page table, claiming a table
+ * slot and a frame if it has none yet; PADDR is the fixed-region
+ * frame to fall back on if the table is full (0 if there is none).
+ *
+ * Threads of the same process share AS and can fault on different
+ * cpus, so the caller holds as_lock across the lookup and insert,
+ * and cm_lock across the frame scans; otherwise two faults on the
+ * same page could both miss and claim separate slots and frames.
+ */
+static
+int
+vm_fault_map(struct addrspace *as, vaddr_t faultaddress, paddr_t paddr)
+{
+	uint32_t ehi, elo;
+	int i;
+
+	if(DEBUGP) kprintf("VM_FAULT: finding page table entry\n");
+	//see if the page is in the page table
+	for(i = 0; i < (int)PTABLESIZE; i++) {
+		if(as->ptable[i].va == faultaddress) {
+			if(DEBUGP) kprintf("VM_FAULT: vaddr in ptable\n");
+			//make sure the page is in the coremap
+			for(unsigned int j = 0; j < coremap->size; j++) {
+				if(coremap->entries[j].as == as && coremap->entries[j].va == faultaddress) {
+					if(DEBUGP) kprintf("VM_FAULT: found in coremap, adding to tlb\n");
+					ehi = faultaddress;
+					elo = as->ptable[i].pa | TLBLO_DIRTY | TLBLO_VALID;
+					tlb_random(ehi, elo);
+					return 0;
+				}
+			}
+			if(DEBUGP) kprintf("need to swap it back in\n");
+			//TODO: swap in page and update tlb
+			//make as dirty
+
+		}
+	}
+	/*if(DEBUGP)*/ if(DEBUGP) kprintf("VM_FAULT: finding new table entry\n");
+
+
+	//find a place to put the new page
+	for(i = 0; i < (int) PTABLESIZE; i++) {
+		if(!as->ptable[i].valid) {
+			if(DEBUGP) kprintf("VM_FAULT: found invalid entry: %d\n", i);
+			as->ptable[i].valid = 1;
+			as->ptable[i].va = faultaddress;
+
+			if(DEBUGP) kprintf("VM_FAULT: starting for\n");
+			//find an empty coremap entry
+			for(unsigned int j = 1; j < coremap->size; j++) {
+				if(coremap->entries[j].st == FREE) {
+					if(DEBUGP) kprintf("VM_FAULT: found free entry - j: %d\n", j);
+					coremap->entries[j].as = curproc->p_addrspace;
+					coremap->entries[j].st = DIRTY;
+					coremap->entries[j].va = faultaddress;
+					as->ptable[i].pa = coremap->entries[j].pa;
+
+					ehi = faultaddress;
+					elo = as->ptable[i].pa | TLBLO_DIRTY | TLBLO_VALID;
+					if(DEBUGP) kprintf("VM_FAULT: setting TLB - hi: %08x pa: %08x paddr: %08x\n", ehi, as->ptable[i].pa, paddr);
+					tlb_random(ehi, elo);
+					return 0;
+				}
+			}
+
+			//find a coremap entry for a different proc
+			for(unsigned int j = 0; j < coremap->size; j++) {
+				if(coremap->entries[j].as != as) {
+					//TODO: swap out this frame
+				
+
+					coremap->entries[j].as = curproc->p_addrspace;
+					coremap->entries[j].st = DIRTY;
+					coremap->entries[j].va = faultaddress;
+					as->ptable[i].pa = coremap->entries[j].pa;
+
+					ehi = faultaddress;
+					elo = as->ptable[i].pa | TLBLO_DIRTY | TLBLO_VALID;
+					tlb_random(ehi, elo);
+					return 0;
+				}
+			}
+		}
+	}
+
+
+	kprintf("VA_FAULT: page table ran out of entries\n");
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+
+        for (i=0; i<NUM_TLB; i++) {
+                tlb_read(&ehi, &elo, i);
+                if (elo & TLBLO_VALID) {
+                        continue;
+                }
+                ehi = faultaddress;
+                elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+                if(DEBUGP) kprintf("dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+                DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+                tlb_write(ehi, elo, i);
+                return 0;
+        }
+        kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
+        return EFAULT;
+
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+	vaddr_t tstackoff;
 	paddr_t paddr;
 	int i; 
 	uint32_t ehi, elo;
 	struct addrspace *as;
-	int spl;
+	int spl, result;
 
 	if(DEBUGP)kprintf("VM_FAULT: entered (PID = %d) fault address: %08x\n", curthread->t_proc->p_id, faultaddress);
 
@@ -370,6 +486,19 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 			if(DEBUGP) kprintf("VM_FAULT: stack\n");
 			paddr = (faultaddress - stackbase) + as->as_stackpbase;
 		}
+		else if (faultaddress < UTHREAD_STACKTOP &&
+			 faultaddress >= UTHREAD_STACKTOP -
+			 UTHREAD_MAXSTACKS * UTHREAD_SLOTSIZE) {
+			/* a thread stack: slot must be in use, guard page never */
+			tstackoff = UTHREAD_STACKTOP - faultaddress;
+			if ((as->as_tstacks &
+			     (1U << ((tstackoff - 1) / UTHREAD_SLOTSIZE))) == 0 ||
+			    tstackoff % UTHREAD_SLOTSIZE == PAGE_SIZE) {
+				return EFAULT;
+			}
+			/* only backed through the page table below */
+			paddr = 0;
+		}
 		else {
 			return EFAULT;
 		}
@@ -377,109 +506,33 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		/* make sure it's page-aligned */
 		KASSERT((paddr & PAGE_FRAME) == paddr);
 	}
+	lock_acquire(as->as_lock);
+	lock_acquire(cm_lock);
+
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
+	result = vm_fault_map(as, faultaddress, paddr);
+	splx(spl);
 
-	if(DEBUGP) kprintf("VM_FAULT: finding page table entry\n");
-	//see if the page is in the page table
-	for(i = 0; i < (int)PTABLESIZE; i++) {
-		if(as->ptable[i].va == faultaddress) {
-			if(DEBUGP) kprintf("VM_FAULT: vaddr in ptable\n");
-			//make sure the page is in the coremap
-			for(unsigned int j = 0; j < coremap->size; j++) {
-				if(coremap->entries[j].as == as && coremap->entries[j].va == faultaddress) {
-					if(DEBUGP) kprintf("VM_FAULT: found in coremap, adding to tlb\n");
-					ehi = faultaddress;
-					elo = as->ptable[i].pa | TLBLO_DIRTY | TLBLO_VALID;
-					tlb_random(ehi, elo);
-					splx(spl);
-					return 0;
-				}
-			}
-			if(DEBUGP) kprintf("need to swap it back in\n");
-			//TODO: swap in page and update tlb
-			//make as dirty
-
-		}
-	}
-	/*if(DEBUGP)*/ if(DEBUGP) kprintf("VM_FAULT: finding new table entry\n");
-
-
-	//find a place to put the new page
-	for(i = 0; i < (int) PTABLESIZE; i++) {
-		if(!as->ptable[i].valid) {
-			if(DEBUGP) kprintf("VM_FAULT: found invalid entry: %d\n", i);
-			as->ptable[i].valid = 1;
-			as->ptable[i].va = faultaddress;
-
-			if(DEBUGP) kprintf("VM_FAULT: starting for\n");
-			//find an empty coremap entry
-			for(unsigned int j = 1; j < coremap->size; j++) {
-				if(coremap->entries[j].st == FREE) {
-					if(DEBUGP) kprintf("VM_FAULT: found free entry - j: %d\n", j);
-					coremap->entries[j].as = curproc->p_addrspace;
-					coremap->entries[j].st = DIRTY;
-					coremap->entries[j].va = faultaddress;
-					as->ptable[i].pa = coremap->entries[j].pa;
-
-					ehi = faultaddress;
-					elo = as->ptable[i].pa | TLBLO_DIRTY | TLBLO_VALID;
-					if(DEBUGP) kprintf("VM_FAULT: setting TLB - hi: %08x pa: %08x paddr: %08x\n", ehi, as->ptable[i].pa, paddr);
-					tlb_random(ehi, elo);
-					splx(spl);
-					return 0;
-				}
-			}
-
-			//find a coremap entry for a different proc
-			for(unsigned int j = 0; j < coremap->size; j++) {
-				if(coremap->entries[j].as != as) {
-					//TODO: swap out this frame
-				
-
-					coremap->entries[j].as = curproc->p_addrspace;
-					coremap->entries[j].st = DIRTY;
-					coremap->entries[j].va = faultaddress;
-					as->ptable[i].pa = coremap->entries[j].pa;
-
-					ehi = faultaddress;
-					elo = as->ptable[i].pa | TLBLO_DIRTY | TLBLO_VALID;
-					tlb_random(ehi, elo);
-					splx(spl);
-					return 0;
-				}
-			}
-		}
-	}
-
-
-	kprintf("VA_FAULT: page table ran out of entries\n");
-
-
-        for (i=0; i<NUM_TLB; i++) {
-                tlb_read(&ehi, &elo, i);
-                if (elo & TLBLO_VALID) {
-                        continue;
-                }
-                ehi = faultaddress;
-                elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-                if(DEBUGP) kprintf("dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-                DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-                tlb_write(ehi, elo, i);
-                splx(spl);
-                return 0;
-        }
-        kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-        splx(spl);
-        return EFAULT;
-
+	lock_release(cm_lock);
+	lock_release(as->as_lock);
+	return result;
 }
 
+/*
+ * Address spaces carry the whole page table inline, which makes them
+ * one of the larger things fork allocates. That also makes them big
+ * enough that the cache only keeps one.
+ */
+static struct kmem_cache as_cache =
+	KMEM_CACHE_INITIALIZER("addrspace", sizeof(struct addrspace),
+			       NULL, NULL);
+
 struct addrspace *
 as_create(void)
 {
 	if(DEBUGP) kprintf("AS_CREATE: starting\n");
-	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	struct addrspace *as = kmem_cache_alloc(&as_cache);
 	if (as==NULL) {
 		kprintf("AS_CREATE: as==NULL\n"); 
 		return NULL;
@@ -493,6 +546,13 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	as->as_tstacks = 0;
+
+	as->as_lock = lock_create("as_lock");
+	if (as->as_lock == NULL) {
+		kmem_cache_free(&as_cache, as);
+		return NULL;
+	}
 
 	for(unsigned int i = 0; i < PTABLESIZE; i++) {
 		as->ptable[i].va = 0xDEADBEEF;
@@ -530,7 +590,8 @@ as_destroy(struct addrspace *as)
 	if(DEBUGP) kprintf("AS_DESTROY: starting\n");
 	
 	dumbvm_can_sleep();
-	kfree(as);
+	lock_destroy(as->as_lock);
+	kmem_cache_free(&as_cache, as);
 }
 
 void
@@ -669,6 +730,32 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_alloc_threadstack(struct addrspace *as, int *slot, vaddr_t *stackptr)
+{
+	int i;
+
+	for (i = 0; i < UTHREAD_MAXSTACKS; i++) {
+		if ((as->as_tstacks & (1U << i)) == 0) {
+			as->as_tstacks |= 1U << i;
+			*slot = i;
+			/* start below the slot's guard page */
+			*stackptr = UTHREAD_STACKTOP - i * UTHREAD_SLOTSIZE
+				- PAGE_SIZE;
+			return 0;
+		}
+	}
+	return EAGAIN;
+}
+
+void
+as_free_threadstack(struct addrspace *as, int slot)
+{
+	KASSERT(slot >= 0 && slot < UTHREAD_MAXSTACKS);
+	KASSERT(as->as_tstacks & (1U << slot));
+	as->as_tstacks &= ~(1U << slot);
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -689,6 +776,8 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	new->as_npages1 = old->as_npages1;
 	new->as_vbase2 = old->as_vbase2;
 	new->as_npages2 = old->as_npages2;
+	/* the forking thread may be running on one of these */
+	new->as_tstacks = old->as_tstacks;
 
 	/* (Mis)use as_prepare_load to allocate some physical memory. */
 	//kprintf("DUMBVM: as_prepare_load(new);\n");
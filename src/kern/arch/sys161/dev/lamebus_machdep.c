@@ -52,6 +52,10 @@
  */
 #define CPU_FREQUENCY 25000000 /* 25 MHz */
 
+/* Cycles per hardclock, and the most hardclocks the timer can span. */
+#define TIMER_PERIOD	(CPU_FREQUENCY / HZ)
+#define TIMER_MAXTICKS	(0xffffffffU / TIMER_PERIOD)
+
 /*
  * Access to the on-chip timer.
  *
@@ -75,6 +79,38 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Read and write c0_count ($9). On System/161 the count goes back to
+ * zero when it reaches c0_compare, so it's the number of cycles since
+ * the last timer interrupt.
+ */
+static
+uint32_t
+mips_timer_getcount(void)
+{
+	uint32_t count;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
+static
+void
+mips_timer_setcount(uint32_t count)
+{
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mtc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		:: "r" (count));
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -115,9 +151,10 @@ mainbus_bootstrap(void)
 	/*
 	 * Configure the MIPS on-chip timer to interrupt HZ times a second.
 	 */
-	mips_timer_set(CPU_FREQUENCY / HZ);
+	mips_timer_set(TIMER_PERIOD);
 }
 
+
 /*
  * Start all secondary CPUs.
  */
@@ -305,7 +342,12 @@ mainbus_interrupt(struct trapframe *tf)
 	}
 	if (cause & MIPS_TIMER_BIT) {
 		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
+		mips_timer_set(TIMER_PERIOD);
+		/* account for any hardclocks skipped while idle */
+		if (curcpu->c_idleticks > 1) {
+			hardclock_skipped(curcpu->c_idleticks - 1);
+		}
+		curcpu->c_idleticks = 0;
 		/* and call hardclock */
 		hardclock();
 		seen = true;
@@ -332,3 +374,77 @@ mainbus_interrupt(struct trapframe *tf)
 		}
 	}
 }
+
+/*
+ * Check if the timer interrupt is asserted, from c0_cause ($13).
+ */
+static
+bool
+mips_timer_pending(void)
+{
+	uint32_t cause;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $13;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (cause));
+	return (cause & MIPS_TIMER_BIT) != 0;
+}
+
+/*
+ * Idle with the periodic timer stopped. See <mainbus.h>.
+ *
+ * Rather than stopping the timer we stretch it: c0_compare is set to
+ * TICKS periods, so if nothing else happens the timer interrupt comes
+ * exactly when the next timeout is due, still on a hardclock
+ * boundary. c_idleticks tells the interrupt handler how many
+ * hardclocks that interrupt stands for. If something else wakes us
+ * first, work out from c0_count how many whole periods went by, wind
+ * the count back to the same point in the current period, and put
+ * c0_compare back.
+ *
+ * Called with interrupts off, from the idle loop.
+ */
+unsigned
+mainbus_idle(unsigned ticks)
+{
+	uint32_t count;
+	unsigned skipped;
+
+	if (ticks == 0 || ticks > TIMER_MAXTICKS) {
+		ticks = TIMER_MAXTICKS;
+	}
+	if (ticks == 1) {
+		/* The next hardclock is wanted anyway. */
+		cpu_idle();
+		return 0;
+	}
+
+	curcpu->c_idleticks = ticks;
+	mips_timer_set(ticks * TIMER_PERIOD);
+
+	cpu_idle();
+
+	if (curcpu->c_idleticks == 0) {
+		/* The timer went off; mainbus_interrupt dealt with it. */
+		return 0;
+	}
+	curcpu->c_idleticks = 0;
+
+	count = mips_timer_getcount();
+	skipped = count / TIMER_PERIOD;
+	if (mips_timer_pending()) {
+		/*
+		 * It went off since we came out of cpu_idle, and the
+		 * count started again from zero; setting c0_compare
+		 * below cancels the interrupt, so count it here.
+		 */
+		skipped += ticks;
+	}
+	mips_timer_setcount(count % TIMER_PERIOD);
+	mips_timer_set(TIMER_PERIOD);
+	return skipped;
+}
+
@@ -55,6 +55,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -109,19 +110,109 @@ flush_delay_buf(void)
 
 //////////////////////////////////////////////////
 
+/*
+ * Output ring.
+ *
+ * Characters printed with interrupts on go into cs_txbuf, and the
+ * device's write-done interrupt (con_start) sends the next one, so a
+ * writer only waits if the ring is full. Otherwise it's like the
+ * input buffer: the ring is empty when cs_txhead == cs_txtail, and
+ * one slot is wasted to tell full from empty.
+ *
+ * Writers that find the ring full sleep on cs_txwchan until it has
+ * drained to CON_TX_WAKE free slots, so they aren't woken for every
+ * character.
+ */
+#define CON_TX_NEXT(i)	(((i) + 1) % CONSOLE_OUTPUT_BUFFER_SIZE)
+#define CON_TX_WAKE	(CONSOLE_OUTPUT_BUFFER_SIZE / 4)
+
+static
+unsigned
+con_txspace(struct con_softc *cs)
+{
+	return (cs->cs_txtail + CONSOLE_OUTPUT_BUFFER_SIZE - cs->cs_txhead - 1)
+		% CONSOLE_OUTPUT_BUFFER_SIZE;
+}
+
+/*
+ * If the device is free and there's something to send, send it.
+ */
+static
+void
+con_txstart(struct con_softc *cs)
+{
+	int ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_txlock));
+
+	if (cs->cs_txbusy || cs->cs_txhead == cs->cs_txtail) {
+		return;
+	}
+	ch = cs->cs_txbuf[cs->cs_txtail];
+	cs->cs_txtail = CON_TX_NEXT(cs->cs_txtail);
+	cs->cs_txbusy = true;
+	cs->cs_send(cs->cs_devdata, ch);
+}
+
+//////////////////////////////////////////////////
+
 /*
  * Print a character, using polling instead of interrupts to wait for
  * I/O completion.
+ *
+ * Anything still in the output ring goes out first so output stays
+ * in order. (There may also be a character in flight; the device's
+ * sendpolled copes with that.) Nobody is woken up here: if anyone is
+ * waiting for space, the ring was full, so a write-done interrupt is
+ * still coming and con_start will do it.
+ *
+ * If we already hold cs_txlock, we got here from a panic in the
+ * middle of the ring code; skip the ring rather than deadlock.
  */
 static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	if (spinlock_do_i_hold(&cs->cs_txlock)) {
+		cs->cs_sendpolled(cs->cs_devdata, ch);
+		return;
+	}
+
+	spinlock_acquire(&cs->cs_txlock);
+	while (cs->cs_txhead != cs->cs_txtail) {
+		cs->cs_sendpolled(cs->cs_devdata,
+				  cs->cs_txbuf[cs->cs_txtail]);
+		cs->cs_txtail = CON_TX_NEXT(cs->cs_txtail);
+	}
 	cs->cs_sendpolled(cs->cs_devdata, ch);
+	spinlock_release(&cs->cs_txlock);
 }
 
 //////////////////////////////////////////////////
 
+/*
+ * Print LEN characters, using interrupts to wait for I/O completion.
+ * Returns as soon as they're all in the output ring.
+ */
+static
+void
+putbuf_intr(struct con_softc *cs, const char *buf, size_t len)
+{
+	size_t i;
+
+	spinlock_acquire(&cs->cs_txlock);
+	for (i=0; i<len; i++) {
+		while (con_txspace(cs) == 0) {
+			con_txstart(cs);
+			wchan_sleep(cs->cs_txwchan, &cs->cs_txlock);
+		}
+		cs->cs_txbuf[cs->cs_txhead] = buf[i];
+		cs->cs_txhead = CON_TX_NEXT(cs->cs_txhead);
+	}
+	con_txstart(cs);
+	spinlock_release(&cs->cs_txlock);
+}
+
 /*
  * Print a character, using interrupts to wait for I/O completion.
  */
@@ -129,26 +220,38 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	char c = ch;
+
+	putbuf_intr(cs, &c, 1);
 }
 
 /*
- * Read a character, using interrupts to wait for I/O completion.
+ * Take the next character from the input buffer. Call after a
+ * successful P on cs_rsem.
  */
 static
 int
-getch_intr(struct con_softc *cs)
+con_takechar(struct con_softc *cs)
 {
 	unsigned char ret;
 
-	P(cs->cs_rsem);
 	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
 	cs->cs_gotchars_tail =
 		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
 	return ret;
 }
 
+/*
+ * Read a character, using interrupts to wait for I/O completion.
+ */
+static
+int
+getch_intr(struct con_softc *cs)
+{
+	P(cs->cs_rsem);
+	return con_takechar(cs);
+}
+
 /*
  * Called from underlying device when a read-ready interrupt occurs.
  *
@@ -174,6 +277,7 @@ con_input(void *vcs, int ch)
 	cs->cs_gotchars_head = nexthead;
 
 	V(cs->cs_rsem);
+	pollq_wakeup(&cs->cs_rpq);
 }
 
 /*
@@ -184,7 +288,14 @@ con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_txlock);
+	cs->cs_txbusy = false;
+	con_txstart(cs);
+	if (con_txspace(cs) >= CON_TX_WAKE &&
+	    !wchan_isempty(cs->cs_txwchan, &cs->cs_txlock)) {
+		wchan_wakeall(cs->cs_txwchan, &cs->cs_txlock);
+	}
+	spinlock_release(&cs->cs_txlock);
 }
 
 //////////////////////////////////////////////////
@@ -240,6 +351,12 @@ con_eachopen(struct device *dev, int openflags)
 	return 0;
 }
 
+/*
+ * Console writes are copied in this many bytes at a time, and put in
+ * the output ring in one go.
+ */
+#define CON_WRITE_CHUNK 64
+
 static
 int
 con_io(struct device *dev, struct uio *uio)
@@ -247,8 +364,10 @@ con_io(struct device *dev, struct uio *uio)
 	int result;
 	char ch;
 	struct lock *lk;
-
-	(void)dev;  // unused
+	struct con_softc *cs = dev->d_data;
+	char inbuf[CON_WRITE_CHUNK];
+	char outbuf[2*CON_WRITE_CHUNK];
+	size_t len, outlen, i;
 
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
@@ -262,7 +381,13 @@ con_io(struct device *dev, struct uio *uio)
 
 	while (uio->uio_resid > 0) {
 		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
+			/* like getch, but let an exiting process go */
+			result = P_intr(cs->cs_rsem);
+			if (result) {
+				lock_release(lk);
+				return result;
+			}
+			ch = con_takechar(cs);
 			if (ch=='\r') {
 				ch = '\n';
 			}
@@ -276,15 +401,23 @@ con_io(struct device *dev, struct uio *uio)
 			}
 		}
 		else {
-			result = uiomove(&ch, 1, uio);
+			len = uio->uio_resid;
+			if (len > sizeof(inbuf)) {
+				len = sizeof(inbuf);
+			}
+			result = uiomove(inbuf, len, uio);
 			if (result) {
 				lock_release(lk);
 				return result;
 			}
-			if (ch=='\n') {
-				putch('\r');
+			outlen = 0;
+			for (i=0; i<len; i++) {
+				if (inbuf[i]=='\n') {
+					outbuf[outlen++] = '\r';
+				}
+				outbuf[outlen++] = inbuf[i];
 			}
-			putch(ch);
+			putbuf_intr(cs, outbuf, outlen);
 		}
 	}
 	lock_release(lk);
@@ -302,10 +435,31 @@ con_ioctl(struct device *dev, int op, userptr_t data)
 	return EINVAL;
 }
 
+/*
+ * Input is ready when there are characters buffered. Output goes
+ * through the transmit ring and only ever blocks briefly, so treat
+ * it as always ready.
+ */
+static
+int
+con_poll(struct device *dev, int events, struct pollent *pe)
+{
+	struct con_softc *cs = dev->d_data;
+	int revents = 0;
+
+	pollq_record(&cs->cs_rpq, pe);
+	if (cs->cs_gotchars_head != cs->cs_gotchars_tail) {
+		revents |= POLLIN | POLLRDNORM;
+	}
+	revents |= POLLOUT;
+	return revents & events;
+}
+
 static const struct device_ops console_devops = {
 	.devop_eachopen = con_eachopen,
 	.devop_io = con_io,
 	.devop_ioctl = con_ioctl,
+	.devop_poll = con_poll,
 };
 
 static
@@ -343,7 +497,8 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct semaphore *rsem;
+	struct wchan *txwchan;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -363,29 +518,35 @@ config_con(struct con_softc *cs, int unit)
 	if (rsem == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
+	txwchan = wchan_create("console write");
+	if (txwchan == NULL) {
 		sem_destroy(rsem);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(txwchan);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(txwchan);
 		return ENOMEM;
 	}
 
 	cs->cs_rsem = rsem;
-	cs->cs_wsem = wsem;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	pollq_init(&cs->cs_rpq);
+
+	spinlock_init(&cs->cs_txlock);
+	cs->cs_txwchan = txwchan;
+	cs->cs_txhead = 0;
+	cs->cs_txtail = 0;
+	cs->cs_txbusy = false;
 
 	the_console = cs;
 	con_userlock_read = rlk;
@@ -30,6 +30,9 @@
 #ifndef _GENERIC_CONSOLE_H_
 #define _GENERIC_CONSOLE_H_
 
+#include <spinlock.h>
+#include <poll.h>
+
 /*
  * Device data for the hardware-independent system console.
  *
@@ -38,6 +41,7 @@
  */
 
 #define CONSOLE_INPUT_BUFFER_SIZE 32
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
 
 struct con_softc {
 	/* initialized by attach routine */
@@ -47,10 +51,18 @@ struct con_softc {
 
 	/* initialized by config routine */
 	struct semaphore *cs_rsem;
-	struct semaphore *cs_wsem;
 	unsigned char cs_gotchars[CONSOLE_INPUT_BUFFER_SIZE];
 	unsigned cs_gotchars_head;	/* next slot to put a char in */
 	unsigned cs_gotchars_tail;	/* next slot to take a char out */
+	struct pollq cs_rpq;		/* poll()ers waiting for input */
+
+	/* output ring, protected by cs_txlock */
+	struct spinlock cs_txlock;
+	struct wchan *cs_txwchan;	/* writers waiting for space */
+	unsigned char cs_txbuf[CONSOLE_OUTPUT_BUFFER_SIZE];
+	unsigned cs_txhead;		/* next slot to put a char in */
+	unsigned cs_txtail;		/* next slot to send from */
+	bool cs_txbusy;			/* device is sending a char */
 };
 
 /*
@@ -33,6 +33,7 @@
 #include <array.h>
 #include <fs.h>
 #include <vnode.h>
+#include <poll.h>
 
 #ifndef SEMFS_INLINE
 #define SEMFS_INLINE INLINE
@@ -54,6 +55,7 @@
 struct semfs_sem {
 	struct lock *sems_lock;			/* Lock to protect count */
 	struct cv *sems_cv;			/* CV to wait */
+	struct pollq sems_pollq;		/* poll()ers waiting for P */
 	unsigned sems_count;			/* Semaphore count */
 	bool sems_hasvnode;			/* The vnode exists */
 	bool sems_linked;			/* In the directory */
@@ -151,6 +151,7 @@ semfs_wakeup(struct semfs_sem *sem, unsigned newcount)
 	else {
 		cv_broadcast(sem->sems_cv, sem->sems_lock);
 	}
+	pollq_wakeup(&sem->sems_pollq);
 }
 
 /*
@@ -255,6 +256,30 @@ semfs_write(struct vnode *vn, struct uio *uio)
 	return 0;
 }
 
+/*
+ * Poll. Readable when P wouldn't block; V never blocks.
+ */
+static
+int
+semfs_poll(struct vnode *vn, int events, struct pollent *pe)
+{
+	struct semfs_vnode *semv = vn->vn_data;
+	struct semfs_sem *sem;
+	int revents;
+
+	sem = semfs_getsem(semv);
+
+	lock_acquire(sem->sems_lock);
+	pollq_record(&sem->sems_pollq, pe);
+	revents = POLLOUT;
+	if (sem->sems_count > 0) {
+		revents |= POLLIN | POLLRDNORM;
+	}
+	lock_release(sem->sems_lock);
+
+	return revents & events;
+}
+
 /*
  * Truncate. Set the count to the specified value.
  *
@@ -666,6 +691,7 @@ static const struct vnode_ops semfs_dirops = {
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
 	.vop_namefile = semfs_namefile,
+	.vop_poll = vnode_poll_ready,
 
 	.vop_creat = semfs_creat,
 	.vop_symlink = vopfail_symlink_nosys,
@@ -699,6 +725,7 @@ static const struct vnode_ops semfs_semops = {
 	.vop_mmap = vopfail_mmap_perm,
 	.vop_truncate = semfs_truncate,
 	.vop_namefile = vopfail_uio_notdir,
+	.vop_poll = semfs_poll,
 
 	.vop_creat = vopfail_creat_notdir,
 	.vop_symlink = vopfail_symlink_notdir,
@@ -51,6 +51,23 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
 }
 
+/*
+ * Note that the freemap block holding the bit for DISKBLOCK needs to
+ * be written back. Only the freemap blocks marked here get written by
+ * the next sync.
+ */
+static
+void
+sfs_freemap_dirty(struct sfs_fs *sfs, daddr_t diskblock)
+{
+	unsigned fmblock = diskblock / SFS_BITSPERBLOCK;
+
+	if (!bitmap_isset(sfs->sfs_freemapdirtyblocks, fmblock)) {
+		bitmap_mark(sfs->sfs_freemapdirtyblocks, fmblock);
+	}
+	sfs->sfs_freemapdirty = true;
+}
+
 /*
  * Allocate a block.
  */
@@ -63,7 +80,7 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 	if (result) {
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs_freemap_dirty(sfs, *diskblock);
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
@@ -85,7 +102,10 @@ void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs_freemap_dirty(sfs, diskblock);
+
+	/* Don't let a pending metadata image land on the next owner */
+	sfs_jforget(sfs, diskblock);
 }
 
 /*
@@ -39,32 +39,146 @@
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/* Maximum indirection level (triple indirect) */
+#define SFS_MAXLEVEL 3
+
+/*
+ * Figure out which indirect tree in the inode maps FILEBLOCK, which
+ * must be past the direct blocks.
+ *
+ * Hands back a pointer to the inode field naming the top of the tree,
+ * the indirection level of that block, the number of file blocks each
+ * of its entries covers, and FILEBLOCK's offset from the start of the
+ * tree. Fails with EFBIG if the block is past the largest file the
+ * volume supports.
+ */
+static
+int
+sfs_bmap_tree(struct sfs_vnode *sv, uint32_t fileblock,
+	      uint32_t **topp, int *levelp, uint32_t *rangep, uint32_t *offp)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t range;
+
+	KASSERT(fileblock >= SFS_NDIRECT);
+	fileblock -= SFS_NDIRECT;
+
+	/* Single indirect: each entry is one data block */
+	range = 1;
+	if (fileblock < SFS_DBPERIDB) {
+		*topp = &sv->sv_i.sfi_indirect;
+		*levelp = 1;
+		*rangep = range;
+		*offp = fileblock;
+		return 0;
+	}
+	fileblock -= SFS_DBPERIDB;
+
+	/* Larger files need the volume to have been made with them */
+	if ((sfs->sfs_sb.sb_features & SFS_FEATURE_BIGFILES) == 0) {
+		return EFBIG;
+	}
+
+	range *= SFS_DBPERIDB;
+	if (fileblock < range * SFS_DBPERIDB) {
+		*topp = &sv->sv_i.sfi_dindirect;
+		*levelp = 2;
+		*rangep = range;
+		*offp = fileblock;
+		return 0;
+	}
+	fileblock -= range * SFS_DBPERIDB;
+
+	range *= SFS_DBPERIDB;
+	if (fileblock < range * SFS_DBPERIDB) {
+		*topp = &sv->sv_i.sfi_tindirect;
+		*levelp = 3;
+		*rangep = range;
+		*offp = fileblock;
+		return 0;
+	}
+
+	return EFBIG;
+}
+
+/*
+ * Look up (and if DOALLOC is set, allocate) entry IDOFF in the
+ * indirect block cached in the vnode.
+ */
+static
+int
+sfs_bmap_cached(struct sfs_vnode *sv, uint32_t idoff, bool doalloc,
+		daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block;
+	int result;
+
+	KASSERT(sv->sv_idblock != 0);
+	KASSERT(idoff < SFS_DBPERIDB);
+
+	block = sv->sv_idbuf[idoff];
+
+	/* If there's no block there, allocate one */
+	if (block==0 && doalloc) {
+		result = sfs_balloc(sfs, &block);
+		if (result) {
+			return result;
+		}
+
+		/* Remember the block we allocated */
+		sv->sv_idbuf[idoff] = block;
+
+		/* The indirect block is now dirty; write it back */
+		result = sfs_jwrite(sfs, sv->sv_idblock, sv->sv_idbuf);
+		if (result) {
+			sv->sv_idbuf[idoff] = 0;
+			sfs_bfree(sfs, block);
+			return result;
+		}
+	}
+
+	/* Hand back the result and return. */
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: %s: Data block %u (offset %u in indirect block "
+		      "%u of file %u) marked free\n", sfs->sfs_sb.sb_volname,
+		      block, idoff, sv->sv_idblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
+ *
+ * Blocks past the direct blocks are found through a tree of indirect
+ * blocks up to three levels deep. The bottom-level indirect block of
+ * the last lookup is kept in the vnode, so mapping any block it
+ * covers costs one cached lookup and no disk I/O.
  */
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 daddr_t *diskblock)
 {
 	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
+	 * I/O buffer for walking the upper levels of the indirect
+	 * tree. The bottom level goes into the vnode's cache.
 	 */
 	static uint32_t idbuf[SFS_DBPERIDB];
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t block;
-	daddr_t idblock;
-	uint32_t idnum, idoff;
+	daddr_t parent;
+	uint32_t *entry;
+	uint32_t range, off, idx, base;
+	int level;
 	int result;
 
 	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(sizeof(sv->sv_idbuf)==SFS_BLOCKSIZE);
 
 	/* Since we're using a static buffer, we'd better be locked. */
 	KASSERT(vfs_biglock_do_i_hold());
@@ -105,95 +219,185 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * If the indirect block covering this file block is the one
+	 * we already have in hand, we're done.
 	 */
+	if (sv->sv_idblock != 0 && fileblock >= sv->sv_idbase &&
+	    fileblock - sv->sv_idbase < SFS_DBPERIDB) {
+		return sfs_bmap_cached(sv, fileblock - sv->sv_idbase,
+				       doalloc, diskblock);
+	}
 
-	fileblock -= SFS_NDIRECT;
+	result = sfs_bmap_tree(sv, fileblock, &entry, &level, &range, &off);
+	if (result) {
+		return result;
+	}
 
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+	/* First file block mapped by the bottom-level indirect block */
+	base = fileblock - (off % SFS_DBPERIDB);
 
 	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * Walk down the tree. ENTRY points at the slot (in the inode,
+	 * or in idbuf) naming the next block down; PARENT is the disk
+	 * block idbuf was loaded from, or 0 for the inode.
 	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
-	}
+	parent = 0;
+	while (1) {
+		block = *entry;
+
+		if (block==0 && !doalloc) {
+			/*
+			 * Nothing allocated here, and we weren't asked
+			 * to allocate anything; everything below reads
+			 * as zeros.
+			 */
+			*diskblock = 0;
+			return 0;
+		}
+		else if (block==0) {
+			/* Allocate a (zeroed) indirect block */
+			result = sfs_balloc(sfs, &block);
+			if (result) {
+				return result;
+			}
+			*entry = block;
+
+			/* Record it in whichever block points to it */
+			if (parent == 0) {
+				sv->sv_dirty = true;
+			}
+			else {
+				result = sfs_jwrite(sfs, parent, idbuf);
+				if (result) {
+					*entry = 0;
+					sfs_bfree(sfs, block);
+					return result;
+				}
+			}
+		}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+		if (level == 1) {
+			break;
+		}
 
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
-	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
+		/* Load the next level and pick the entry we want */
+		result = sfs_readblock(sfs, block, idbuf, sizeof(idbuf));
 		if (result) {
 			return result;
 		}
+		idx = off / range;
+		off %= range;
+		range /= SFS_DBPERIDB;
+		level--;
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		entry = &idbuf[idx];
+		parent = block;
+	}
 
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+	/* Bottom level: load it into the vnode's cache */
+	KASSERT(range == 1);
+	result = sfs_readblock(sfs, block, sv->sv_idbuf,
+			       sizeof(sv->sv_idbuf));
+	if (result) {
+		sv->sv_idblock = 0;
+		return result;
+	}
+	sv->sv_idblock = block;
+	sv->sv_idbase = base;
+
+	return sfs_bmap_cached(sv, off, doalloc, diskblock);
+}
+
+/*
+ * Discard the blocks in the indirect block named by *ENTRY that lie
+ * at or past file block BLOCKLEN. BASEBLOCK is the first file block
+ * the indirect block maps and LEVEL its indirection level. If the
+ * indirect block ends up empty it is freed as well, and *ENTRY is
+ * cleared; *CHANGEDP is set if *ENTRY changes.
+ */
+static
+int
+sfs_itrunc_indirect(struct sfs_fs *sfs, uint32_t *entry, int level,
+		    uint32_t baseblock, uint32_t blocklen, bool *changedp)
+{
+	/*
+	 * I/O buffers, one per indirection level. The recursion never
+	 * has more than one block of each level loaded at once.
+	 */
+	static uint32_t idbufs[SFS_MAXLEVEL][SFS_DBPERIDB];
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+	uint32_t *idbuf;
+	uint32_t range, j;
+	daddr_t idblock;
+	bool hasnonzero, iddirty, subchanged;
+	int i, result;
+
+	KASSERT(level >= 1 && level <= SFS_MAXLEVEL);
+	KASSERT(sizeof(idbufs[0])==SFS_BLOCKSIZE);
+
+	idblock = *entry;
+	if (idblock == 0) {
+		return 0;
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+
+	/* Number of file blocks covered by each entry */
+	range = 1;
+	for (i=1; i<level; i++) {
+		range *= SFS_DBPERIDB;
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/* Nothing in here is past the proposed EOF */
+	if (blocklen >= baseblock + range * SFS_DBPERIDB) {
+		return 0;
+	}
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
-		}
+	idbuf = idbufs[level-1];
+	result = sfs_readblock(sfs, idblock, idbuf, SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (level > 1) {
+			/* Recurse into the lower-level indirect block */
+			subchanged = false;
+			result = sfs_itrunc_indirect(sfs, &idbuf[j], level-1,
+						     baseblock + j*range,
+						     blocklen, &subchanged);
+			if (result) {
+				return result;
+			}
+			if (subchanged) {
+				iddirty = true;
+			}
+		}
+		else if (blocklen <= baseblock+j && idbuf[j] != 0) {
+			/* Discard any blocks that are past the new EOF */
+			sfs_bfree(sfs, idbuf[j]);
+			idbuf[j] = 0;
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idbuf[j]!=0) {
+			hasnonzero = true;
+		}
+	}
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_bfree(sfs, idblock);
+		*entry = 0;
+		*changedp = true;
+	}
+	else if (iddirty) {
+		/* The indirect block is dirty; write it back */
+		result = sfs_jwrite(sfs, idblock, idbuf);
 		if (result) {
 			return result;
 		}
 	}
-
-	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: %s: Data block %u (block %u of file %u) "
-		      "marked free\n", sfs->sfs_sb.sb_volname,
-		      block, fileblock, sv->sv_ino);
-	}
-	*diskblock = block;
 	return 0;
 }
 
@@ -203,30 +407,27 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 int
 sfs_itrunc(struct sfs_vnode *sv, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	uint32_t i;
+	daddr_t block;
+	uint32_t baseblock;
+	bool changed;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
 
 	vfs_biglock_acquire();
 
+	/* The cached indirect block may be about to change or go away */
+	sv->sv_idblock = 0;
+
+	/* Drop the cached data block if it's being freed */
+	if (sv->sv_dblock != 0 && sv->sv_dfileblock >= blocklen) {
+		sfs_dbuf_invalidate(sv);
+	}
+
 	/*
 	 * Go through the direct blocks. Discard any that are
 	 * past the limit we're truncating to.
@@ -240,55 +441,27 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/* Then each of the indirect trees, in file order */
+	changed = false;
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+	result = sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_indirect, 1,
+				     baseblock, blocklen, &changed);
+	if (result == 0) {
+		baseblock += SFS_DBPERIDB;
+		result = sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_dindirect, 2,
+					     baseblock, blocklen, &changed);
+	}
+	if (result == 0) {
+		baseblock += SFS_DBPERIDB * SFS_DBPERIDB;
+		result = sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_tindirect, 3,
+					     baseblock, blocklen, &changed);
+	}
+	if (changed) {
+		sv->sv_dirty = true;
+	}
+	if (result) {
+		vfs_biglock_release();
+		return result;
 	}
 
 	/* Set the file size */
@@ -300,4 +473,3 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	vfs_biglock_release();
 	return 0;
 }
-
@@ -52,8 +52,9 @@
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reads always load the whole bitmap. Writes only touch the sectors
+ * marked in sfs_freemapdirtyblocks by sfs_balloc/sfs_bfree, in
+ * ascending order, and clear those marks as they go.
  *
  * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
  * sectors of bits, one bit for each sector on the filesystem. The
@@ -92,9 +93,15 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 			result = sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
 					       SFS_BLOCKSIZE);
 		}
+		else if (bitmap_isset(sfs->sfs_freemapdirtyblocks, j)) {
+			result = sfs_jwrite(sfs, SFS_FREEMAP_START+j, ptr);
+			if (result == 0) {
+				bitmap_unmark(sfs->sfs_freemapdirtyblocks, j);
+			}
+		}
 		else {
-			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
-						SFS_BLOCKSIZE);
+			/* Unchanged since the last write; skip it */
+			result = 0;
 		}
 
 		/* If we failed, stop. */
@@ -107,20 +114,73 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 
 /*
  * Sync routine for the vnode table.
+ *
+ * Only inodes that are actually dirty are written, and they are
+ * written in inode (that is, disk block) order so the whole batch goes
+ * out in one sweep across the disk.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
+	struct sfs_vnode **dirty, *sv;
+	unsigned i, j, num, ndirty;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
 	num = vnodearray_num(sfs->sfs_vnodes);
+	if (num == 0) {
+		return 0;
+	}
+
+	dirty = kmalloc(num * sizeof(*dirty));
+	if (dirty == NULL) {
+		/* Out of memory; fall back to syncing in table order. */
+		for (i=0; i<num; i++) {
+			struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
+			result = VOP_FSYNC(v);
+			if (result) {
+				return result;
+			}
+		}
+		return 0;
+	}
+
+	/*
+	 * Collect the dirty ones, insertion-sorting by inode number.
+	 * File data still sitting in partial-block buffers goes out
+	 * first, so no inode is committed pointing at stale data.
+	 */
+	ndirty = 0;
 	for (i=0; i<num; i++) {
 		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		sv = v->vn_data;
+		result = sfs_dbuf_flush(sv);
+		if (result) {
+			kfree(dirty);
+			return result;
+		}
+		if (!sv->sv_dirty) {
+			continue;
+		}
+		for (j = ndirty; j > 0 && dirty[j-1]->sv_ino > sv->sv_ino; j--) {
+			dirty[j] = dirty[j-1];
+		}
+		dirty[j] = sv;
+		ndirty++;
 	}
-	return 0;
+
+	result = 0;
+	for (i=0; i<ndirty; i++) {
+		result = sfs_sync_inode(dirty[i]);
+		if (result) {
+			break;
+		}
+	}
+
+	kfree(dirty);
+	return result;
 }
 
 /*
@@ -208,6 +268,18 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
+	/*
+	 * If the free block map needs to be written, write it. This
+	 * goes first: the freemap lives in the low-numbered blocks,
+	 * and blocks should be marked in use on disk before any inode
+	 * that points at them is.
+	 */
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* If any vnodes need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
@@ -215,8 +287,11 @@ sfs_sync(struct fs *fs)
 		return result;
 	}
 
-	/* If the free block map needs to be written, write it. */
-	result = sfs_sync_freemap(sfs);
+	/*
+	 * Everything dirty is now in the journal transaction (if there
+	 * is a journal); commit it as one unit.
+	 */
+	result = sfs_jcommit(sfs, true);
 	if (result) {
 		vfs_biglock_release();
 		return result;
@@ -262,6 +337,10 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
+	if (sfs->sfs_freemapdirtyblocks != NULL) {
+		bitmap_destroy(sfs->sfs_freemapdirtyblocks);
+	}
+	sfs_junmount(sfs);
 	vnodearray_destroy(sfs->sfs_vnodes);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
@@ -289,6 +368,7 @@ sfs_unmount(struct fs *fs)
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_jnum == 0);
 
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
@@ -328,6 +408,9 @@ sfs_fs_create(void)
 	COMPILE_ASSERT(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	COMPILE_ASSERT(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(sizeof(struct sfs_jdesc)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
@@ -359,6 +442,16 @@ sfs_fs_create(void)
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemapdirtyblocks = NULL;
+
+	/* journal (none until sfs_jmount) */
+	sfs->sfs_jmax = 0;
+	sfs->sfs_jnum = 0;
+	sfs->sfs_jseq = 0;
+	sfs->sfs_jclean = true;
+	sfs->sfs_jblocks = NULL;
+	sfs->sfs_jdata = NULL;
+	sfs->sfs_jiov = NULL;
 
 	return sfs;
 
@@ -440,6 +533,15 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return EINVAL;
 	}
 
+	if ((sfs->sfs_sb.sb_features & ~SFS_FEATURE_ALL) != 0) {
+		kprintf("sfs: Unsupported feature flags 0x%x in superblock\n",
+			sfs->sfs_sb.sb_features & ~SFS_FEATURE_ALL);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		vfs_biglock_release();
+		return EINVAL;
+	}
+
 	if (sfs->sfs_sb.sb_nblocks > dev->d_blocks) {
 		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
 			sfs->sfs_sb.sb_nblocks, dev->d_blocks);
@@ -448,6 +550,15 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	/* Replay the journal, if any, before reading other metadata */
+	result = sfs_jmount(sfs);
+	if (result) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
@@ -456,6 +567,13 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		vfs_biglock_release();
 		return ENOMEM;
 	}
+	sfs->sfs_freemapdirtyblocks = bitmap_create(SFS_FS_FREEMAPBLOCKS(sfs));
+	if (sfs->sfs_freemapdirtyblocks == NULL) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
 		sfs->sfs_device = NULL;
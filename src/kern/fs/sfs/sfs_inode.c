@@ -50,8 +50,7 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	int result;
 
 	if (sv->sv_dirty) {
-		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
-					sizeof(sv->sv_i));
+		result = sfs_jwrite(sfs, sv->sv_ino, &sv->sv_i);
 		if (result) {
 			return result;
 		}
@@ -102,7 +101,12 @@ sfs_reclaim(struct vnode *v)
 		}
 	}
 
-	/* Sync the inode to disk */
+	/* Write back any buffered file data, then the inode */
+	result = sfs_dbuf_flush(sv);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
 	result = sfs_sync_inode(sv);
 	if (result) {
 		vfs_biglock_release();
@@ -205,6 +209,13 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No indirect or data block cached yet */
+	sv->sv_idblock = 0;
+	sv->sv_idbase = 0;
+	sv->sv_dblock = 0;
+	sv->sv_dfileblock = 0;
+	sv->sv_ddirty = false;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out by sfs_balloc and
@@ -49,7 +49,8 @@
  * Note: sfs_readblock is used to read the superblock
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
- * except sfs_device.
+ * except sfs_device and the (then empty) journal
+ * transaction, which sfs_fs_create sets up.
  */
 
 /*
@@ -112,6 +113,11 @@ sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
+	/* Metadata not yet committed is newer than what's on disk */
+	if (sfs_jread(sfs, block, data)) {
+		return 0;
+	}
+
 	SFSUIO(&iov, &ku, data, block, UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
@@ -131,15 +137,78 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	return sfs_rwblock(sfs, &ku);
 }
 
+/*
+ * Write NIOV consecutive blocks starting at BLOCK, gathered from the
+ * buffers in IOV (each one block long), as a single device request.
+ */
+int
+sfs_writeblocks(struct sfs_fs *sfs, daddr_t block, struct iovec *iov,
+		unsigned niov)
+{
+	struct uio ku;
+	unsigned i;
+
+	for (i=0; i<niov; i++) {
+		KASSERT(iov[i].iov_len == SFS_BLOCKSIZE);
+	}
+
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = niov;
+	ku.uio_offset = ((off_t)block) * SFS_BLOCKSIZE;
+	ku.uio_resid = niov * SFS_BLOCKSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_WRITE;
+	ku.uio_space = NULL;
+	return sfs_rwblock(sfs, &ku);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
 
 /*
- * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * Write back the vnode's cached partial block, if it's dirty.
+ */
+int
+sfs_dbuf_flush(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sv->sv_ddirty) {
+		KASSERT(sv->sv_dblock != 0);
+		result = sfs_writeblock(sfs, sv->sv_dblock, sv->sv_dbuf,
+					sizeof(sv->sv_dbuf));
+		if (result) {
+			return result;
+		}
+		sv->sv_ddirty = false;
+	}
+	return 0;
+}
+
+/*
+ * Forget the vnode's cached partial block without writing it. Only
+ * for when the block is going away.
+ */
+void
+sfs_dbuf_invalidate(struct sfs_vnode *sv)
+{
+	sv->sv_dblock = 0;
+	sv->sv_ddirty = false;
+}
+
+/*
+ * Do I/O to a block of a file that doesn't cover the whole block.
+ *
+ * This goes through the vnode's cached data block (sv_dbuf), reading
+ * the block in only if it isn't already there. Writes just dirty the
+ * cached copy; it's written back when a write fills it to the end,
+ * when a different block is needed, or when the file is synced. So
+ * a run of small appends costs one read and one write per block
+ * rather than one of each per call.
  *
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
@@ -150,14 +219,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
+	/* Static; protected by the big lock, like sv_dbuf itself */
+	static char writebuf[SFS_BLOCKSIZE];
 
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t diskblock;
@@ -169,7 +232,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
+	/* The cached block is per-vnode, but the big lock covers it */
 	KASSERT(vfs_biglock_do_i_hold());
 
 	/* Compute the block offset of this block in the file */
@@ -184,34 +247,50 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		return uiomovezeros(len, uio);
 	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
+
+	if (sv->sv_dblock != diskblock) {
+		/* Switch blocks: push out the old one, load the new one */
+		result = sfs_dbuf_flush(sv);
+		if (result) {
+			return result;
+		}
+		sv->sv_dblock = 0;
+		result = sfs_readblock(sfs, diskblock, sv->sv_dbuf,
+				       sizeof(sv->sv_dbuf));
 		if (result) {
 			return result;
 		}
+		sv->sv_dblock = diskblock;
+		sv->sv_dfileblock = fileblock;
 	}
 
 	/*
 	 * Now perform the requested operation into/out of the buffer.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
-	if (result) {
-		return result;
+	if (uio->uio_rw == UIO_READ) {
+		return uiomove(sv->sv_dbuf+skipstart, len, uio);
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Writes go through a scratch copy, so that if uiomove faults
+	 * partway the cached block doesn't end up holding half of a
+	 * write that failed.
 	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
+	result = uiomove(writebuf, len, uio);
+	if (result) {
+		return result;
+	}
+	memcpy(sv->sv_dbuf+skipstart, writebuf, len);
+	sv->sv_ddirty = true;
+
+	/* Filled to the end; it won't be appended to again soon */
+	if (skipstart + len == SFS_BLOCKSIZE) {
+		result = sfs_dbuf_flush(sv);
 		if (result) {
 			return result;
 		}
@@ -257,6 +336,21 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
+	/*
+	 * If this block is the one cached for partial I/O, write back
+	 * any changes before reading, and drop the copy before writing
+	 * so it doesn't go stale.
+	 */
+	if (diskblock == sv->sv_dblock) {
+		result = sfs_dbuf_flush(sv);
+		if (result) {
+			return result;
+		}
+		if (uio->uio_rw == UIO_WRITE) {
+			sfs_dbuf_invalidate(sv);
+		}
+	}
+
 	/*
 	 * Do the I/O directly to the uio region. Save the uio_offset,
 	 * and substitute one that makes sense to the device.
@@ -460,9 +554,8 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		/* Update the selected region */
 		memcpy(metaiobuf + blockoffset, data, len);
 
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
+		/* Write the block back (through the journal) */
+		result = sfs_jwrite(sfs, diskblock, metaiobuf);
 		if (result) {
 			return result;
 		}
@@ -0,0 +1,491 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ *
+ * Metadata block writes (inodes, directory blocks, indirect blocks,
+ * freemap blocks) don't go to disk directly. They are collected in an
+ * in-memory transaction; writing the same block again just updates
+ * the copy there. At sync time (or when the transaction fills up) the
+ * whole transaction is committed: the descriptor and all the block
+ * images go to the journal area in one sequential write, then the
+ * commit block, and only then are the blocks copied to their home
+ * locations. Finally the journal header is updated to say the
+ * transaction has been applied.
+ *
+ * If we crash before the commit block is written, the transaction
+ * never happened; if after, mount replays it. Either way the on-disk
+ * metadata is what it was at some sync, so when the header says so,
+ * sfsck need only look at the journal instead of the whole volume.
+ * A transaction committed because it filled up mid-sync is marked
+ * incomplete; after one of those sfsck still does a full check.
+ *
+ * User data blocks are not journaled. A block being freed is dropped
+ * from the open transaction so a stale metadata image can't land on
+ * top of file data once the block is reused.
+ *
+ * Everything here runs under the VFS big lock, which also covers the
+ * static buffers.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Scratch copies of the on-disk journal records */
+static struct sfs_jheader jheader;
+static struct sfs_jdesc jdesc;
+static struct sfs_jcommit jcommit;
+
+/* Block number of each part of the journal */
+#define JHEADER_BLOCK(sfs)   ((sfs)->sfs_sb.sb_journalstart)
+#define JDESC_BLOCK(sfs)     ((sfs)->sfs_sb.sb_journalstart + 1)
+#define JIMAGE_BLOCK(sfs, i) ((sfs)->sfs_sb.sb_journalstart + 2 + (i))
+
+/*
+ * Checksum over logged block images (see <kern/sfs.h>).
+ */
+static
+uint32_t
+sfs_jchecksum(uint32_t sum, const void *data)
+{
+	const uint32_t *words = data;
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE/sizeof(uint32_t); i++) {
+		sum = ((sum << 1) | (sum >> 31)) + words[i];
+	}
+	return sum;
+}
+
+/*
+ * Find BLOCK in the open transaction. Returns its slot, or -1.
+ */
+static
+int
+sfs_jfind(struct sfs_fs *sfs, daddr_t block)
+{
+	unsigned i;
+
+	for (i=0; i<sfs->sfs_jnum; i++) {
+		if (sfs->sfs_jblocks[i] == block) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Write the journal header.
+ */
+static
+int
+sfs_jwriteheader(struct sfs_fs *sfs, uint32_t seq, bool clean)
+{
+	bzero(&jheader, sizeof(jheader));
+	jheader.jh_magic = SFS_JMAGIC_HEADER;
+	jheader.jh_seq = seq;
+	jheader.jh_clean = clean ? 1 : 0;
+	return sfs_writeblock(sfs, JHEADER_BLOCK(sfs), &jheader,
+			      sizeof(jheader));
+}
+
+/*
+ * If BLOCK has a newer copy in the open transaction, copy it to DATA
+ * and return true.
+ */
+bool
+sfs_jread(struct sfs_fs *sfs, daddr_t block, void *data)
+{
+	int slot;
+
+	slot = sfs_jfind(sfs, block);
+	if (slot < 0) {
+		return false;
+	}
+	memcpy(data, sfs->sfs_jdata[slot], SFS_BLOCKSIZE);
+	return true;
+}
+
+/*
+ * Write a metadata block. Without a journal this is just
+ * sfs_writeblock.
+ */
+int
+sfs_jwrite(struct sfs_fs *sfs, daddr_t block, const void *data)
+{
+	int slot;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs->sfs_jmax == 0) {
+		return sfs_writeblock(sfs, block, (void *)data, SFS_BLOCKSIZE);
+	}
+
+	slot = sfs_jfind(sfs, block);
+	if (slot < 0) {
+		if (sfs->sfs_jnum == sfs->sfs_jmax) {
+			result = sfs_jcommit(sfs, false);
+			if (result) {
+				return result;
+			}
+		}
+		slot = sfs->sfs_jnum++;
+		sfs->sfs_jblocks[slot] = block;
+	}
+	memcpy(sfs->sfs_jdata[slot], data, SFS_BLOCKSIZE);
+	return 0;
+}
+
+/*
+ * BLOCK is being freed; drop any pending image of it.
+ */
+void
+sfs_jforget(struct sfs_fs *sfs, daddr_t block)
+{
+	int slot;
+	unsigned last;
+	char *tmp;
+
+	slot = sfs_jfind(sfs, block);
+	if (slot < 0) {
+		return;
+	}
+
+	/* Move the last entry into the hole, keeping its buffer around */
+	last = sfs->sfs_jnum - 1;
+	tmp = sfs->sfs_jdata[slot];
+	sfs->sfs_jblocks[slot] = sfs->sfs_jblocks[last];
+	sfs->sfs_jdata[slot] = sfs->sfs_jdata[last];
+	sfs->sfs_jdata[last] = tmp;
+	sfs->sfs_jnum--;
+}
+
+/*
+ * Commit the open transaction and apply it. COMPLETE says whether
+ * the caller is at a sync point (all dirty metadata is in the
+ * transaction) or just making room.
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs, bool complete)
+{
+	unsigned i, j, n;
+	uint32_t sum;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs->sfs_jmax == 0) {
+		return 0;
+	}
+
+	n = sfs->sfs_jnum;
+	if (n == 0) {
+		/* Nothing to do, except maybe record that we're whole again */
+		if (complete && !sfs->sfs_jclean) {
+			result = sfs_jwriteheader(sfs, sfs->sfs_jseq - 1, true);
+			if (result) {
+				return result;
+			}
+			sfs->sfs_jclean = true;
+		}
+		return 0;
+	}
+
+	/*
+	 * Sort by home location so the checkpoint pass below sweeps
+	 * across the disk once.
+	 */
+	for (i=1; i<n; i++) {
+		daddr_t block = sfs->sfs_jblocks[i];
+		char *data = sfs->sfs_jdata[i];
+
+		for (j=i; j>0 && sfs->sfs_jblocks[j-1] > block; j--) {
+			sfs->sfs_jblocks[j] = sfs->sfs_jblocks[j-1];
+			sfs->sfs_jdata[j] = sfs->sfs_jdata[j-1];
+		}
+		sfs->sfs_jblocks[j] = block;
+		sfs->sfs_jdata[j] = data;
+	}
+
+	/* Descriptor plus block images, in one request */
+	bzero(&jdesc, sizeof(jdesc));
+	jdesc.jd_magic = SFS_JMAGIC_DESC;
+	jdesc.jd_seq = sfs->sfs_jseq;
+	jdesc.jd_nblocks = n;
+	sum = 0;
+	sfs->sfs_jiov[0].iov_kbase = &jdesc;
+	sfs->sfs_jiov[0].iov_len = SFS_BLOCKSIZE;
+	for (i=0; i<n; i++) {
+		jdesc.jd_blocks[i] = sfs->sfs_jblocks[i];
+		sum = sfs_jchecksum(sum, sfs->sfs_jdata[i]);
+		sfs->sfs_jiov[i+1].iov_kbase = sfs->sfs_jdata[i];
+		sfs->sfs_jiov[i+1].iov_len = SFS_BLOCKSIZE;
+	}
+	result = sfs_writeblocks(sfs, JDESC_BLOCK(sfs), sfs->sfs_jiov, n+1);
+	if (result) {
+		return result;
+	}
+
+	/* The commit block makes it real */
+	bzero(&jcommit, sizeof(jcommit));
+	jcommit.jc_magic = SFS_JMAGIC_COMMIT;
+	jcommit.jc_seq = sfs->sfs_jseq;
+	jcommit.jc_checksum = sum;
+	jcommit.jc_complete = complete ? 1 : 0;
+	result = sfs_writeblock(sfs, JIMAGE_BLOCK(sfs, n), &jcommit,
+				sizeof(jcommit));
+	if (result) {
+		return result;
+	}
+
+	/* Checkpoint: copy everything home */
+	for (i=0; i<n; i++) {
+		result = sfs_writeblock(sfs, sfs->sfs_jblocks[i],
+					sfs->sfs_jdata[i], SFS_BLOCKSIZE);
+		if (result) {
+			return result;
+		}
+	}
+
+	/* Mark it applied so it isn't replayed over later data */
+	result = sfs_jwriteheader(sfs, sfs->sfs_jseq, complete);
+	if (result) {
+		return result;
+	}
+
+	sfs->sfs_jclean = complete;
+	sfs->sfs_jseq++;
+	sfs->sfs_jnum = 0;
+	return 0;
+}
+
+/*
+ * Replay the transaction in the journal, if there's a committed one
+ * that hasn't been applied yet. Uses the (empty) transaction buffers
+ * as scratch space.
+ */
+static
+int
+sfs_jreplay(struct sfs_fs *sfs)
+{
+	uint32_t seq, n, i, sum;
+	int result;
+
+	seq = jheader.jh_seq + 1;
+
+	result = sfs_readblock(sfs, JDESC_BLOCK(sfs), &jdesc, sizeof(jdesc));
+	if (result) {
+		return result;
+	}
+	if (jdesc.jd_magic != SFS_JMAGIC_DESC || jdesc.jd_seq != seq) {
+		/* Nothing new */
+		return 0;
+	}
+	n = jdesc.jd_nblocks;
+	if (n == 0 || n > sfs->sfs_jmax) {
+		kprintf("sfs: %s: journal transaction %u has bad length %u; "
+			"ignored\n", sfs->sfs_sb.sb_volname, seq, n);
+		return 0;
+	}
+	for (i=0; i<n; i++) {
+		daddr_t block = jdesc.jd_blocks[i];
+
+		if (block == SFS_SUPER_BLOCK || block >= sfs->sfs_sb.sb_nblocks ||
+		    (block >= JHEADER_BLOCK(sfs) &&
+		     block < JHEADER_BLOCK(sfs) + sfs->sfs_sb.sb_journalblocks)) {
+			kprintf("sfs: %s: journal transaction %u logs bad "
+				"block %u; ignored\n", sfs->sfs_sb.sb_volname,
+				seq, block);
+			return 0;
+		}
+	}
+
+	result = sfs_readblock(sfs, JIMAGE_BLOCK(sfs, n), &jcommit,
+			       sizeof(jcommit));
+	if (result) {
+		return result;
+	}
+	if (jcommit.jc_magic != SFS_JMAGIC_COMMIT || jcommit.jc_seq != seq) {
+		/* Crashed before the commit; the transaction never happened */
+		return 0;
+	}
+
+	sum = 0;
+	for (i=0; i<n; i++) {
+		result = sfs_readblock(sfs, JIMAGE_BLOCK(sfs, i),
+				       sfs->sfs_jdata[i], SFS_BLOCKSIZE);
+		if (result) {
+			return result;
+		}
+		sum = sfs_jchecksum(sum, sfs->sfs_jdata[i]);
+	}
+	if (sum != jcommit.jc_checksum) {
+		kprintf("sfs: %s: journal transaction %u has bad checksum; "
+			"ignored\n", sfs->sfs_sb.sb_volname, seq);
+		return 0;
+	}
+
+	for (i=0; i<n; i++) {
+		result = sfs_writeblock(sfs, jdesc.jd_blocks[i],
+					sfs->sfs_jdata[i], SFS_BLOCKSIZE);
+		if (result) {
+			return result;
+		}
+	}
+
+	result = sfs_jwriteheader(sfs, seq, jcommit.jc_complete != 0);
+	if (result) {
+		return result;
+	}
+	jheader.jh_seq = seq;
+	jheader.jh_clean = jcommit.jc_complete;
+
+	kprintf("sfs: %s: replayed journal transaction %u (%u blocks)\n",
+		sfs->sfs_sb.sb_volname, seq, n);
+	return 0;
+}
+
+/*
+ * Set up the journal at mount time and replay it if needed. This
+ * must happen before anything else reads metadata.
+ */
+int
+sfs_jmount(struct sfs_fs *sfs)
+{
+	uint32_t start, nblocks;
+	unsigned i;
+	int result;
+
+	KASSERT(sfs->sfs_jmax == 0);
+
+	if ((sfs->sfs_sb.sb_features & SFS_FEATURE_JOURNAL) == 0) {
+		return 0;
+	}
+
+	start = sfs->sfs_sb.sb_journalstart;
+	nblocks = sfs->sfs_sb.sb_journalblocks;
+	if (nblocks < SFS_JOURNAL_MIN || start <= SFS_SUPER_BLOCK ||
+	    start >= sfs->sfs_sb.sb_nblocks ||
+	    nblocks > sfs->sfs_sb.sb_nblocks - start) {
+		kprintf("sfs: %s: bad journal location %u+%u\n",
+			sfs->sfs_sb.sb_volname, start, nblocks);
+		return EINVAL;
+	}
+
+	/* Room for the header, descriptor, and commit block */
+	sfs->sfs_jmax = nblocks - 3;
+	if (sfs->sfs_jmax > SFS_JMAXBLOCKS) {
+		sfs->sfs_jmax = SFS_JMAXBLOCKS;
+	}
+
+	sfs->sfs_jdata = kmalloc(sfs->sfs_jmax * sizeof(char *));
+	if (sfs->sfs_jdata == NULL) {
+		sfs->sfs_jmax = 0;
+		return ENOMEM;
+	}
+	for (i=0; i<sfs->sfs_jmax; i++) {
+		sfs->sfs_jdata[i] = NULL;
+	}
+	sfs->sfs_jblocks = kmalloc(sfs->sfs_jmax * sizeof(daddr_t));
+	sfs->sfs_jiov = kmalloc((sfs->sfs_jmax + 1) * sizeof(struct iovec));
+	if (sfs->sfs_jblocks == NULL || sfs->sfs_jiov == NULL) {
+		sfs_junmount(sfs);
+		return ENOMEM;
+	}
+	for (i=0; i<sfs->sfs_jmax; i++) {
+		sfs->sfs_jdata[i] = kmalloc(SFS_BLOCKSIZE);
+		if (sfs->sfs_jdata[i] == NULL) {
+			sfs_junmount(sfs);
+			return ENOMEM;
+		}
+	}
+
+	result = sfs_readblock(sfs, JHEADER_BLOCK(sfs), &jheader,
+			       sizeof(jheader));
+	if (result) {
+		sfs_junmount(sfs);
+		return result;
+	}
+	if (jheader.jh_magic != SFS_JMAGIC_HEADER) {
+		kprintf("sfs: %s: bad journal header magic 0x%x\n",
+			sfs->sfs_sb.sb_volname, jheader.jh_magic);
+		sfs_junmount(sfs);
+		return EINVAL;
+	}
+
+	result = sfs_jreplay(sfs);
+	if (result) {
+		sfs_junmount(sfs);
+		return result;
+	}
+
+	sfs->sfs_jseq = jheader.jh_seq + 1;
+	sfs->sfs_jclean = jheader.jh_clean != 0;
+	sfs->sfs_jnum = 0;
+	return 0;
+}
+
+/*
+ * Release the journal buffers. The transaction must already have
+ * been committed (or never have been used).
+ */
+void
+sfs_junmount(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	KASSERT(sfs->sfs_jnum == 0);
+
+	if (sfs->sfs_jdata != NULL) {
+		for (i=0; i<sfs->sfs_jmax; i++) {
+			if (sfs->sfs_jdata[i] != NULL) {
+				kfree(sfs->sfs_jdata[i]);
+			}
+		}
+		kfree(sfs->sfs_jdata);
+		sfs->sfs_jdata = NULL;
+	}
+	if (sfs->sfs_jblocks != NULL) {
+		kfree(sfs->sfs_jblocks);
+		sfs->sfs_jblocks = NULL;
+	}
+	if (sfs->sfs_jiov != NULL) {
+		kfree(sfs->sfs_jiov);
+		sfs->sfs_jiov = NULL;
+	}
+	sfs->sfs_jmax = 0;
+}
@@ -225,7 +225,15 @@ sfs_fsync(struct vnode *v)
 	int result;
 
 	vfs_biglock_acquire();
-	result = sfs_sync_inode(sv);
+	result = sfs_dbuf_flush(sv);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	if (result == 0) {
+		/* Make it durable, not just queued in the journal */
+		struct sfs_fs *sfs = v->vn_fs->fs_data;
+		result = sfs_jcommit(sfs, false);
+	}
 	vfs_biglock_release();
 
 	return result;
@@ -602,6 +610,7 @@ const struct vnode_ops sfs_fileops = {
 	.vop_mmap = sfs_mmap,
 	.vop_truncate = sfs_truncate,
 	.vop_namefile = vopfail_uio_notdir,
+	.vop_poll = vnode_poll_ready,
 
 	.vop_creat = vopfail_creat_notdir,
 	.vop_symlink = vopfail_symlink_notdir,
@@ -636,6 +645,7 @@ const struct vnode_ops sfs_dirops = {
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
 	.vop_namefile = sfs_namefile,
+	.vop_poll = vnode_poll_ready,
 
 	.vop_creat = sfs_creat,
 	.vop_symlink = vopfail_symlink_nosys,
@@ -62,6 +62,14 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_journal.c */
+int sfs_jmount(struct sfs_fs *sfs);
+void sfs_junmount(struct sfs_fs *sfs);
+bool sfs_jread(struct sfs_fs *sfs, daddr_t block, void *data);
+int sfs_jwrite(struct sfs_fs *sfs, daddr_t block, const void *data);
+void sfs_jforget(struct sfs_fs *sfs, daddr_t block);
+int sfs_jcommit(struct sfs_fs *sfs, bool complete);
+
 /* Functions in sfs_inode.c */
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
@@ -73,6 +81,10 @@ int sfs_getroot(struct fs *fs, struct vnode **ret);
 /* Functions in sfs_io.c */
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
+int sfs_writeblocks(struct sfs_fs *sfs, daddr_t block, struct iovec *iov,
+		unsigned niov);
+int sfs_dbuf_flush(struct sfs_vnode *sv);
+void sfs_dbuf_invalidate(struct sfs_vnode *sv);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
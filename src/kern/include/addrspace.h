@@ -39,6 +39,7 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
 
 
 /*
@@ -55,6 +56,15 @@ struct page_table_entry {
 };
 
 #define PTABLESIZE 4096
+
+/*
+ * Stacks for additional user threads are fixed-size slots carved out
+ * below the main stack, one per thread. The top page of each slot is
+ * left unmapped as a guard against overflowing the stack above it.
+ */
+#define UTHREAD_STACKPAGES 16
+#define UTHREAD_MAXSTACKS  32
+
 struct addrspace {
 #if OPT_DUMBVM
         vaddr_t as_vbase1;
@@ -75,6 +85,8 @@ struct addrspace {
         paddr_t as_heapstart;
         paddr_t as_heapend;
         paddr_t as_stackpbase;
+        uint32_t as_tstacks;		/* bitmap of thread stack slots in use */
+        struct lock *as_lock;		/* page table and heap break */
 
 		int* pages;
 		struct page_table_entry ptable[PTABLESIZE];
@@ -119,6 +131,14 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_alloc_threadstack - claim a stack slot for a new user thread.
+ *                Hands back the slot number and the initial stack
+ *                pointer. The caller serializes the threads of the
+ *                process (proc_Lock).
+ *
+ *    as_free_threadstack - give a slot back. Its pages stay mapped
+ *                and are reused by the next thread to get the slot.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -137,6 +157,9 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_alloc_threadstack(struct addrspace *as, int *slot,
+                                       vaddr_t *stackptr);
+void              as_free_threadstack(struct addrspace *as, int slot);
 
 
 /*
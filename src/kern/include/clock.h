@@ -48,6 +48,16 @@
 void hardclock_bootstrap(void);
 void hardclock(void);
 
+/*
+ * An idle cpu stops its periodic hardclock and sleeps until the next
+ * timeout is due (or something else wakes it). clock_idle() is used
+ * in place of cpu_idle() to do that; hardclock_skipped() is called by
+ * the machine-dependent code to account for the hardclocks that were
+ * skipped.
+ */
+void clock_idle(void);
+void hardclock_skipped(unsigned ticks);
+
 /*
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
@@ -79,5 +89,17 @@ void timespec_sub(const struct timespec *t1,
  */
 void clocksleep(int seconds);
 
+/*
+ * clocksleep_ticks() is the same, but for a number of hardclocks,
+ * for sleeps shorter than a second.
+ */
+void clocksleep_ticks(unsigned ticks);
+
+/*
+ * clocksleep_ticks_intr() is clocksleep_ticks, but returns EINTR
+ * early if the process is exiting (see wchan_sleep_intr).
+ */
+int clocksleep_ticks_intr(unsigned ticks);
+
 
 #endif /* _CLOCK_H_ */
@@ -33,9 +33,18 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <timeout.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * Number of run queue priority levels. Level 0 is the highest. The
+ * round-robin scheduler only uses level 0; the MLFQ scheduler (options
+ * mlfq) uses them all. See schedule() in thread.c.
+ */
+#define CPU_NRUNQUEUES 4
+
+
 /*
  * Per-cpu structure
  *
@@ -59,7 +68,10 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadcache; /* Recycled threads, with stacks */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_idleticks;		/* Hardclocks the timer is stopped
+					   for while idle, or 0 */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
 	/*
@@ -67,9 +79,27 @@ struct cpu {
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[CPU_NRUNQUEUES]; /* Run queues */
+	unsigned c_runqueue_count;	/* Threads on all of them (may be
+					   read unlocked, as a hint) */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Accessed by other cpus, without locking.
+	 *
+	 * Threads woken up by other cpus are pushed on c_inbox with
+	 * atomic_cas_ptr, linked through t_inboxnext, and moved to
+	 * the run queue by this cpu at its next schedule point. This
+	 * lets a waker avoid taking the run queue lock.
+	 */
+	struct thread *volatile c_inbox;
+
+	/*
+	 * Accessed by other cpus.
+	 * Protected by its own lock.
+	 */
+	struct timerwheel c_timerwheel;	/* Pending timeouts */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -34,6 +34,6 @@
  * ioctl operation codes
  */
 
-/* (none yet) */
+#define FIONBIO	1	/* set non-blocking I/O; arg is int *, 0 clears */
 
 #endif /* _KERN_IOCTL_H_*/
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_POLL_H_
+#define _KERN_POLL_H_
+
+/*
+ * Definitions for poll() and select().
+ */
+
+#include <kern/limits.h>
+
+
+/* One descriptor to poll(). */
+struct pollfd {
+	int fd;			/* descriptor, or negative to skip */
+	short events;		/* what to wait for */
+	short revents;		/* what happened */
+};
+
+/* Event bits for events and revents. */
+#define POLLIN       0x0001	/* data to read */
+#define POLLPRI      0x0002	/* urgent data to read (never set) */
+#define POLLOUT      0x0004	/* room to write */
+#define POLLRDNORM   0x0040	/* same as POLLIN */
+#define POLLWRNORM   POLLOUT	/* same as POLLOUT */
+
+/* These are only ever returned in revents. */
+#define POLLERR      0x0008	/* error, e.g. pipe with no readers */
+#define POLLHUP      0x0010	/* hung up, e.g. pipe with no writers */
+#define POLLNVAL     0x0020	/* fd isn't open */
+
+/* Descriptor sets for select(). */
+#define FD_SETSIZE   __OPEN_MAX
+#define __NFDBITS    32
+
+typedef struct {
+	__u32 fds_bits[(FD_SETSIZE + __NFDBITS - 1) / __NFDBITS];
+} fd_set;
+
+#define FD_SET(fd, s)   ((s)->fds_bits[(fd)/__NFDBITS] |= \
+			 (1U << ((fd) % __NFDBITS)))
+#define FD_CLR(fd, s)   ((s)->fds_bits[(fd)/__NFDBITS] &= \
+			 ~(1U << ((fd) % __NFDBITS)))
+#define FD_ISSET(fd, s) (((s)->fds_bits[(fd)/__NFDBITS] & \
+			  (1U << ((fd) % __NFDBITS))) != 0)
+#define FD_ZERO(s)      do { \
+		unsigned __i; \
+		for (__i = 0; __i < sizeof((s)->fds_bits) / \
+			     sizeof((s)->fds_bits[0]); __i++) { \
+			(s)->fds_bits[__i] = 0; \
+		} \
+	} while (0)
+
+
+#endif /* _KERN_POLL_H_ */
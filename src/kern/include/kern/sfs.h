@@ -41,8 +41,8 @@
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
@@ -62,6 +62,33 @@
 /* Size of free block bitmap (in blocks) */
 #define SFS_FREEMAPBLOCKS(nblocks)  (SFS_FREEMAPBITS(nblocks)/SFS_BITSPERBLOCK)
 
+/*
+ * Feature flags for sb_features. A volume without SFS_FEATURE_BIGFILES
+ * never uses the 2x/3x indirect blocks, so files are limited to
+ * SFS_NDIRECT + SFS_DBPERIDB blocks and older tools can still read it.
+ */
+#define SFS_FEATURE_BIGFILES  0x00000001  /* 2x/3x indirect blocks allowed */
+#define SFS_FEATURE_JOURNAL   0x00000002  /* metadata journal present */
+#define SFS_FEATURE_ALL       (SFS_FEATURE_BIGFILES|SFS_FEATURE_JOURNAL)
+
+/*
+ * Metadata journal. With SFS_FEATURE_JOURNAL, sb_journalblocks blocks
+ * starting at sb_journalstart hold a header block followed by space
+ * for one transaction: a descriptor block, the new contents of each
+ * metadata block it covers, and a commit block. A transaction is only
+ * valid if its commit block is present and the checksum matches; it
+ * is then replayed by copying each block to its home location.
+ *
+ * The checksum starts at 0 and, for each 32-bit word of each block
+ * image in order, rotates left one bit and adds the word.
+ */
+#define SFS_JOURNAL_BLOCKS  64            /* default journal size (mksfs) */
+#define SFS_JOURNAL_MIN     4             /* smallest usable journal */
+#define SFS_JMAXBLOCKS      125           /* most blocks in a transaction */
+#define SFS_JMAGIC_HEADER   0x4a484452    /* "JHDR" */
+#define SFS_JMAGIC_DESC     0x4a445343    /* "JDSC" */
+#define SFS_JMAGIC_COMMIT   0x4a434d54    /* "JCMT" */
+
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
@@ -74,7 +101,10 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_features;			/* SFS_FEATURE_* flags */
+	uint32_t sb_journalstart;		/* First block of journal */
+	uint32_t sb_journalblocks;		/* Number of journal blocks */
+	uint32_t reserved[115];			/* unused, set to 0 */
 };
 
 /*
@@ -86,7 +116,40 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_waste[128-5-SFS_NDIRECT];	/* unused space, set to 0 */
+};
+
+/*
+ * On-disk journal header (first journal block)
+ */
+struct sfs_jheader {
+	uint32_t jh_magic;			/* SFS_JMAGIC_HEADER */
+	uint32_t jh_seq;			/* Last transaction applied */
+	uint32_t jh_clean;			/* 1 if it ended at a sync */
+	uint32_t reserved[125];			/* unused, set to 0 */
+};
+
+/*
+ * On-disk journal descriptor (second journal block)
+ */
+struct sfs_jdesc {
+	uint32_t jd_magic;			/* SFS_JMAGIC_DESC */
+	uint32_t jd_seq;			/* Transaction number */
+	uint32_t jd_nblocks;			/* Number of blocks logged */
+	uint32_t jd_blocks[SFS_JMAXBLOCKS];	/* Home location of each */
+};
+
+/*
+ * On-disk journal commit record (after the logged blocks)
+ */
+struct sfs_jcommit {
+	uint32_t jc_magic;			/* SFS_JMAGIC_COMMIT */
+	uint32_t jc_seq;			/* Must match jd_seq */
+	uint32_t jc_checksum;			/* Checksum of logged blocks */
+	uint32_t jc_complete;			/* 1 if written at a sync */
+	uint32_t reserved[124];			/* unused, set to 0 */
 };
 
 /*
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A kmem_cache hands out objects of one fixed size and type. Freed
+ * objects are kept (up to the cache's depth) instead of being
+ * returned to kmalloc, still in their constructed state: the
+ * constructor runs only when an object is first made and the
+ * destructor only when it's finally given back to kmalloc. So things
+ * like an embedded spinlock and wchan are set up once and survive any
+ * number of alloc/free cycles. Users must hand objects back in that
+ * same constructed state.
+ *
+ * Caches are defined statically with KMEM_CACHE_INITIALIZER and need
+ * no setup call, so they work from the very start of boot:
+ *
+ *    static struct kmem_cache foo_cache =
+ *       KMEM_CACHE_INITIALIZER("foo", sizeof(struct foo), foo_ctor, foo_dtor);
+ *
+ * The constructor returns 0 or an error code; either function may be
+ * NULL.
+ *
+ * The depth is picked from the object size so that no cache holds
+ * much more than KMEM_CACHE_BYTES of free objects: small objects get
+ * up to KMEM_CACHE_DEPTH, and anything of KMEM_CACHE_BYTES or more
+ * (an addrspace, say) keeps just one. Use KMEM_CACHE_INITIALIZER_DEPTH
+ * to choose the depth yourself.
+ */
+
+#include <spinlock.h>
+
+#define KMEM_CACHE_DEPTH 32		/* most objects any cache keeps */
+#define KMEM_CACHE_BYTES 16384		/* free bytes a cache aims to keep */
+
+#define KMEM_CACHE_DEPTHFOR(size) \
+	((size) >= KMEM_CACHE_BYTES ? 1 : \
+	 KMEM_CACHE_BYTES / (size) > KMEM_CACHE_DEPTH ? KMEM_CACHE_DEPTH : \
+	 KMEM_CACHE_BYTES / (size))
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	unsigned kc_depth;		/* max cached objects */
+
+	struct spinlock kc_lock;	/* protects the rest */
+	unsigned kc_nfree;		/* number of cached objects */
+	void *kc_free[KMEM_CACHE_DEPTH]; /* the cached objects */
+	struct kmem_cache *kc_next;	/* list of all caches */
+	bool kc_listed;			/* true if on that list */
+
+	/* statistics */
+	unsigned kc_allocs;		/* calls to kmem_cache_alloc */
+	unsigned kc_hits;		/* ...satisfied from the cache */
+	unsigned kc_frees;		/* calls to kmem_cache_free */
+	unsigned kc_destroyed;		/* objects given back to kmalloc */
+	unsigned kc_inuse;		/* objects currently allocated */
+	unsigned kc_peak;		/* max of kc_inuse */
+};
+
+#define KMEM_CACHE_INITIALIZER_DEPTH(name, size, depth, ctor, dtor) \
+	{ (name), (size), (ctor), (dtor), (depth), SPINLOCK_INITIALIZER, 0, \
+	  { NULL }, NULL, false, 0, 0, 0, 0, 0, 0 }
+#define KMEM_CACHE_INITIALIZER(name, size, ctor, dtor) \
+	KMEM_CACHE_INITIALIZER_DEPTH(name, size, KMEM_CACHE_DEPTHFOR(size), \
+				     ctor, dtor)
+
+/*
+ * Operations:
+ *    kmem_cache_alloc - Get an object. Returns NULL if out of memory
+ *                       (or if the constructor fails).
+ *    kmem_cache_free  - Give back an object from kmem_cache_alloc.
+ *    kmem_cache_reclaim - Give every cached free object back to
+ *                       kmalloc. Returns how many were freed. kmalloc
+ *                       calls this when it runs out of pages.
+ *    kmem_cache_printstats - Print statistics for all caches that
+ *                       have been used.
+ */
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+unsigned kmem_cache_reclaim(void);
+void kmem_cache_printstats(void);
+
+
+#endif /* _KMEM_CACHE_H_ */
@@ -55,6 +55,14 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Idle the current cpu (as with cpu_idle) with the periodic clock
+ * stopped, for at most TICKS hardclocks (0 means no limit), and set
+ * the clock going again afterwards. Returns the number of whole
+ * hardclocks that went by without being delivered.
+ */
+unsigned mainbus_idle(unsigned ticks);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _POLL_H_
+#define _POLL_H_
+
+/*
+ * Kernel side of poll() and select().
+ *
+ * Each pollable object (a pipe end, the console, a semaphore) has a
+ * struct pollq. When poll() decides it has to wait, it hands VOP_POLL
+ * a struct pollent for each descriptor, and the object puts it on its
+ * pollq with pollq_record before looking at its own state. Whenever
+ * the object's state changes in a way that could make a poller ready,
+ * it calls pollq_wakeup afterwards, which wakes every poll() with an
+ * entry on the queue. Recording first and waking after the change
+ * means no wakeup can be lost in between, without the object having
+ * to hold any lock of its own across VOP_POLL.
+ *
+ * Entries stay on their queues until the poll() call removes them
+ * with pollent_remove; being woken only means "look again".
+ */
+
+#include <kern/poll.h>
+#include <spinlock.h>
+
+struct wchan;
+
+/* Per-object wait queue. */
+struct pollq {
+	struct spinlock pq_lock;
+	struct pollent *pq_first;
+};
+
+/* State of one poll() call. */
+struct pollctx {
+	struct spinlock pc_lock;
+	struct wchan *pc_wchan;		/* where the caller sleeps */
+	bool pc_fired;			/* a pollq we're on was woken */
+	bool pc_timedout;		/* the timeout went off */
+};
+
+/* One descriptor's entry on its object's pollq. */
+struct pollent {
+	struct pollctx *pe_ctx;
+	struct pollq *pe_q;		/* NULL if not recorded */
+	struct pollent *pe_next;
+	struct pollent **pe_prevp;
+};
+
+void pollq_init(struct pollq *pq);
+void pollq_cleanup(struct pollq *pq);
+void pollq_record(struct pollq *pq, struct pollent *pe);
+void pollq_wakeup(struct pollq *pq);
+
+void pollent_init(struct pollent *pe, struct pollctx *ctx);
+void pollent_remove(struct pollent *pe);
+
+#endif /* _POLL_H_ */
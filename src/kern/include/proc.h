@@ -43,6 +43,8 @@
 struct addrspace;
 struct thread;
 struct vnode;
+struct fdesc;
+struct kmem_cache;
 
 /*
  * Process structure.
@@ -66,13 +68,39 @@ struct vnode;
 struct proc {
 	char *p_name;			/* Name of this process */
 	pid_t p_id;
-	int p_exitcode;
 
-	pid_t p_parent;
-	pid_t p_children[__PID_MAX];
-
-	struct semaphore* p_parsem;
-	struct semaphore* p_childsem;
+	/*
+	 * Parent/child links and exit state, all protected by
+	 * proc_Lock. Once p_exited is set the process is a zombie:
+	 * it has no threads, address space, or files left, and is
+	 * only waiting for its parent to collect p_exitcode. A
+	 * process whose parent is gone (p_parent == NULL) is freed
+	 * as soon as it exits.
+	 */
+	int p_exitcode;			/* encoded wait status */
+	bool p_exited;			/* zombie, waiting to be reaped */
+	struct proc *p_parent;		/* NULL if orphaned */
+	struct proc *p_children;	/* first child */
+	struct proc *p_sibling;		/* next child of p_parent */
+	struct cv *p_waitcv;		/* signalled when a child or thread exits */
+	bool p_vfork;			/* borrowing p_parent's address space */
+	bool p_vforkheld;		/* parent still in proc_vfork_wait */
+
+	/*
+	 * User threads, also under proc_Lock. p_nuthreads counts the
+	 * threads that have not yet left; the last one to leave tears
+	 * the process down, so the address space and file table live
+	 * exactly as long as some thread might use them. Once
+	 * p_exiting is set (by _exit) the other threads leave at their
+	 * next return to user mode. Waits in join, waitpid, futexes,
+	 * pipes, console reads, poll and nanosleep are cut short with
+	 * EINTR to get them there; other sleeps, such as disk I/O or
+	 * lock waits, finish normally first.
+	 */
+	unsigned p_nuthreads;		/* live user threads */
+	bool p_exiting;			/* _exit called; p_exitcode is final */
+	int p_nexttid;			/* next thread id to hand out */
+	struct uthread *p_uthreads;	/* created threads not yet joined */
 
 	struct spinlock p_lock;		/* Lock for this structure */
 	unsigned p_numthreads;		/* Number of threads in this process */
@@ -82,22 +110,77 @@ struct proc {
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
-	int x[100];
+
+	/*
+	 * Open files, shared by all threads of the process. The slots
+	 * are protected by p_fdlock. A system call using a file takes
+	 * its own reference with fdesc_get, so a sibling closing the
+	 * descriptor meanwhile only drops the table's reference.
+	 */
+	struct lock *p_fdlock;
+	struct fdesc *p_fdtable[OPEN_MAX];
 	/* add more material here as needed */
 };
 
+/*
+ * Record of a user thread made with thread_create, kept until it is
+ * joined or the process goes away. Protected by proc_Lock.
+ */
+struct uthread {
+	int ut_tid;			/* thread id */
+	int ut_stackslot;		/* see as_alloc_threadstack */
+	bool ut_exited;			/* has left; ut_code is valid */
+	bool ut_joined;			/* some thread is joining it */
+	int ut_code;			/* value passed to thread_exit */
+	vaddr_t ut_stack;		/* initial stack pointer */
+	struct uthread *ut_next;	/* p_uthreads list */
+};
+
 /* This is the process structure for the kernel and for kernel-only threads. */
 extern struct proc *kproc;
 
+/* Object cache for struct proc (see <kmem_cache.h>). */
+extern struct kmem_cache proc_cache;
+
 /* Call once during system startup to allocate data structures. */
 void proc_bootstrap(void);
 
 /* Create a fresh process for use by runprogram(). */
 struct proc *proc_create_runprogram(const char *name);
 
+/* Create a child of the current process for fork(). */
+int proc_create_fork(struct proc **ret);
+
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
+/* Mark the current process exited with wait status STATUS and detach curthread. */
+void proc_exit(int status);
+
+/* Give a vfork child's borrowed address space back; true if it had one. */
+bool proc_vfork_release(void);
+
+/* Sleep until vfork child CHILD has exec'd or exited. */
+void proc_vfork_wait(struct proc *child);
+
+/* Set up a record and stack slot for a new thread of the current process. */
+int proc_thread_create(struct uthread **ret);
+
+/* Undo proc_thread_create if the thread could not be started. */
+void proc_thread_abort(struct uthread *ut);
+
+/* Remove curthread from its process; true if it was the last thread. */
+bool proc_thread_leave(int code);
+
+/* Wait for thread TID of the current process to exit. */
+int proc_thread_join(int tid, int *code);
+
+/* Start exiting the current process with wait status STATUS. */
+void proc_setexit(int status);
+
+/* Wait for a child of the current process to exit and reap it. */
+int proc_wait(pid_t pid, int options, int *status, pid_t *ret);
+
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
 
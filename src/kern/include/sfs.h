@@ -42,6 +42,8 @@
 #include <fs.h>
 #include <vnode.h>
 
+struct iovec;
+
 /*
  * Get on-disk structures and constants that are made available to
  * userland for the benefit of mksfs, dumpsfs, etc.
@@ -56,6 +58,27 @@ struct sfs_vnode {
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+
+	/*
+	 * Copy of the most recently used indirect block that maps data
+	 * blocks directly, so sequential access past the direct blocks
+	 * doesn't go back to disk (or up the 2x/3x tree) every time.
+	 * sv_idblock is 0 when nothing is cached.
+	 */
+	daddr_t sv_idblock;             /* disk block of cached indirect */
+	uint32_t sv_idbase;             /* first file block it maps */
+	uint32_t sv_idbuf[SFS_DBPERIDB]; /* its contents */
+
+	/*
+	 * Write-back copy of the data block last touched by a partial
+	 * (sub-block) read or write. Small writes land here and go to
+	 * disk once the block fills, another block is touched, or the
+	 * file is synced. sv_dblock is 0 when nothing is cached.
+	 */
+	daddr_t sv_dblock;              /* disk block of cached data */
+	uint32_t sv_dfileblock;         /* which file block it is */
+	bool sv_ddirty;                 /* true if sv_dbuf modified */
+	char sv_dbuf[SFS_BLOCKSIZE];    /* its contents */
 };
 
 /*
@@ -69,6 +92,16 @@ struct sfs_fs {
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_freemapdirtyblocks; /* which freemap blocks */
+
+	/* Metadata journal (sfs_journal.c); sfs_jmax is 0 if none */
+	unsigned sfs_jmax;              /* most blocks per transaction */
+	unsigned sfs_jnum;              /* blocks in open transaction */
+	uint32_t sfs_jseq;              /* number of open transaction */
+	bool sfs_jclean;                /* last one applied ended at a sync */
+	daddr_t *sfs_jblocks;           /* home location of each block */
+	char **sfs_jdata;               /* new contents of each block */
+	struct iovec *sfs_jiov;         /* for writing a commit in one go */
 };
 
 /*
@@ -64,6 +64,9 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/* P, but give up with EINTR if our process is exiting. */
+int P_intr(struct semaphore *);
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -71,6 +74,11 @@ void V(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
+ * The lock is adaptive: a thread that finds it held spins for a while
+ * if the holder is running on another cpu, since it will probably let
+ * go soon, and only sleeps if the holder is not running or the spin
+ * runs out.
+ *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
  */
@@ -78,10 +86,12 @@ struct lock {
         char *lk_name;
 	struct wchan *lock_wchan;
 	struct spinlock lock_lock;
-        volatile unsigned lock_count;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
-	volatile struct cpu* lock_holder;
+	struct thread *volatile lock_holder;	/* NULL if free */
+
+	/* Contention statistics, protected by lock_lock */
+	unsigned lock_acquires;		/* Total acquisitions */
+	unsigned lock_contended;	/* ...that found the lock held */
+	unsigned lock_sleeps;		/* Times a waiter went to sleep */
 };
 
 struct lock *lock_create(const char *name);
@@ -142,21 +152,49 @@ void cv_destroy(struct cv *);
  */
 void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
+
+/*
+ * cv_wait, but give up with EINTR if our process is exiting (see
+ * wchan_sleep_intr). The lock is reacquired either way.
+ */
+int cv_wait_intr(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers, or one writer. Readers and writers sleep on
+ * separate wait channels. New readers wait while a writer is waiting,
+ * so writers don't starve. When a writer releases the lock it hands
+ * it to all waiting readers as a batch if there are any, and
+ * otherwise wakes one writer. The last reader out wakes one writer.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * (should be) made internally.
+ */
 struct rwlock {
-    char *rwlk_name;
-	struct wchan *rwlock_wchan;
-	struct spinlock rwlock_lock;
-    volatile unsigned reader_count;
-	volatile struct cpu* reader_holders[1000];
-	volatile struct cpu* writer_holder;
-    volatile bool writer_in;
-    volatile int writer_waiting;
+	char *rwlk_name;
+	struct wchan *rwlock_rwchan;		/* readers wait here */
+	struct wchan *rwlock_wwchan;		/* writers wait here */
+	struct spinlock rwlock_lock;		/* protects everything */
+	unsigned rwlock_readers;		/* readers holding it */
+	struct thread *rwlock_writer;		/* writer holding it */
+	unsigned rwlock_rwaiting;		/* readers asleep */
+	unsigned rwlock_rgen;			/* bumped to admit them */
+	unsigned rwlock_wwaiting;		/* writers asleep */
 };
 
 struct rwlock* rwlock_create(const char *name);
 void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire - Get the lock in MODE, which is READ or WRITE.
+ *    rwlock_release - Release the lock, which must be held in MODE.
+ *    rwlock_do_i_hold - Return true if the current thread holds the lock
+ *                   for writing, or if anyone holds it for reading.
+ *                   (Readers are not tracked individually.)
+ */
 void rwlock_acquire(struct rwlock *, int mode);
 void rwlock_release(struct rwlock *, int mode);
 bool rwlock_do_i_hold(struct rwlock *);
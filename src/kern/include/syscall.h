@@ -33,6 +33,7 @@
 
 #include <cdefs.h> /* for __DEAD */
 struct trapframe; /* from <machine/trapframe.h> */
+struct kmem_cache; /* from <kmem_cache.h> */
 
 /*
  * The system call dispatcher.
@@ -47,21 +48,44 @@ void syscall(struct trapframe *tf);
 /* Helper for fork(). You write this. */
 void enter_forked_process(void* tf, unsigned long x);
 
+/* Start routine for a new user thread (thread_create). */
+void enter_uthread(void* tf, unsigned long ut);
+
+/* Take curthread out of its process and exit it. Does not return. */
+__DEAD void uthread_leave(int code);
+
 /* Enter user mode. Does not return. */
 __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 		       vaddr_t stackptr, vaddr_t entrypoint);
 
+/* Object cache for struct fdesc (see <kmem_cache.h>). */
+extern struct kmem_cache fdesc_cache;
+
+/* Take and drop a reference to an open file of the current process. */
+struct fdesc *fdesc_get(int fd);
+void fdesc_release(struct fdesc *fdesc);
+
 //system call functions for assignment 2
 int sys_open(userptr_t filename, int flags, mode_t mode, int32_t* retval);
 ssize_t sys_read(int fd, void* buf, size_t size, int32_t* retval);
 int sys_write(int fd, void* buf, size_t size, int32_t* retval);
 int sys_close(int fd);
+int sys_pipe(userptr_t user_fds);
+int sys_dup2(int oldfd, int newfd, int32_t* retval);
+int sys_ioctl(int fd, int code, userptr_t data);
 __DEAD void sys__exit(int code);
-int sys_execv(userptr_t prog, char** args);
+int sys_thread_create(struct trapframe *tf, vaddr_t entry, userptr_t func,
+		      userptr_t arg, int32_t* retval);
+__DEAD void sys_thread_exit(int code);
+int sys_thread_join(int tid, userptr_t code);
+int sys_futex(userptr_t uaddr, int op, int val, int32_t *retval);
+int sys_execv(userptr_t prog, userptr_t args);
 pid_t sys_fork(struct trapframe *tf, int32_t* retval);
+pid_t sys_vfork(struct trapframe *tf, int32_t* retval);
 pid_t sys_getpid(int32_t* retval);
-pid_t sys_waitpid(pid_t pid, int *returncode, int flags, int32_t* retval);
+pid_t sys_waitpid(pid_t pid, userptr_t status, int flags, int32_t* retval);
 int sys_sbrk(int inc, int* retval);
+int sys_sync(void);
 
 /*
  * Prototypes for IN-KERNEL entry points for system call implementations.
@@ -69,5 +93,10 @@ int sys_sbrk(int inc, int* retval);
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(userptr_t user_req, userptr_t user_rem);
+int sys_poll(userptr_t user_fds, unsigned nfds, int timeout_ms,
+	     int32_t *retval);
+int sys_select(int nfds, userptr_t user_rd, userptr_t user_wr, userptr_t user_ex,
+	       userptr_t user_tv, int32_t *retval);
 
 #endif /* _SYSCALL_H_ */
@@ -45,6 +45,7 @@
 #include <limits.h>
 
 struct cpu;
+struct uthread;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -59,6 +60,9 @@ struct cpu;
 /* Macro to test if two addresses are on the same kernel stack */
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
+/* Names up to this long are stored in the thread itself. */
+#define THREAD_NAME_INLINE 16
+
 /* States a thread can be in. */
 typedef enum {
 	S_RUN,		/* running */
@@ -73,6 +77,7 @@ struct fdesc {
 	char* fname;
 	int flags;
 	int refcount;
+	struct spinlock fdcountlock;	/* Lock for refcount */
 	off_t offset;
 	struct vnode* vn;
 	struct lock* fdlock;
@@ -90,7 +95,8 @@ struct thread {
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
 	threadstate_t t_state;		/* State this thread is in */
 
-	struct fdesc* t_fdtable[OPEN_MAX];
+	struct uthread *t_uthread;	/* user thread record; NULL for a
+					   process's first thread */
 	struct cv* t_cv;
 
 	/*
@@ -99,10 +105,25 @@ struct thread {
 	struct thread_machdep t_machdep; /* Any machine-dependent goo */
 	struct threadlistnode t_listnode; /* Link for run/sleep/zombie lists */
 	void *t_stack;			/* Kernel-level stack */
+	char t_namebuf[THREAD_NAME_INLINE]; /* t_name, if short enough */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 
+	/* Scheduling; protected by t_cpu's run queue lock */
+	unsigned t_priority;		/* Run queue level (0 is highest) */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	unsigned t_lastrun;		/* c_hardclocks when last switched out */
+	struct thread *t_inboxnext;	/* Link on t_cpu's c_inbox */
+
+	/* Interruptible sleep; protected by intr_lock in thread.c */
+	struct wchan *t_intrwc;		/* channel we're sleeping on */
+	struct spinlock *t_intrlk;	/* ...and its spinlock */
+	struct thread *t_intrnext;	/* next interruptible sleeper */
+	bool t_intrbusy;		/* interrupter is using t_intrwc */
+	bool t_intrseen;		/* interrupter has dealt with us */
+	bool t_intrwoken;		/* interrupter took us off t_intrwc */
+
 
 	/*
 	 * Interrupt state fields.
@@ -160,6 +181,13 @@ void thread_shutdown(void);
  * general safe to refer to it as the new thread may exit and
  * disappear at any time without notice.
  */
+/*
+ * Wake every thread of PROC that is sleeping in wchan_sleep_intr, and
+ * make any later wchan_sleep_intr by them fail at once. Those threads
+ * return EINTR. Call after setting p_exiting.
+ */
+void thread_interrupt(struct proc *proc);
+
 int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
@@ -178,15 +206,15 @@ __DEAD void thread_exit(void);
 void thread_yield(void);
 
 /*
- * Reshuffle the run queue. Called from the timer interrupt.
+ * Charge a clock tick to the current thread and yield if its time
+ * slice is used up. Called from the timer interrupt.
  */
-void schedule(void);
+void thread_tick(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Reshuffle the run queue. Called from the timer interrupt.
  */
-void thread_consider_migration(void);
+void schedule(void);
 
 
 #endif /* _THREAD_H_ */
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TIMEOUT_H_
+#define _TIMEOUT_H_
+
+/*
+ * Timeouts: calling a function a given number of hardclocks from now.
+ *
+ * The caller provides the struct timeout, so arming one never
+ * allocates memory and may be done from an interrupt handler. Set it
+ * up once with timeout_init, then:
+ *
+ *    timeout(to, ticks)   arranges for TO's function to be called, in
+ *                         interrupt context from hardclock, once TICKS
+ *                         full hardclock periods have passed (at most
+ *                         TIMEOUT_MAXTICKS). That is the TICKS+1'th
+ *                         hardclock from now, since the first may come
+ *                         at once. TO must not be pending.
+ *
+ *    untimeout(to)        cancels TO. Returns true if it was pending,
+ *                         false if it has already fired or is firing
+ *                         right now.
+ *
+ * A timeout fires on the cpu that armed it. Once its function has
+ * been called, TO is no longer pending and may be armed again (from
+ * the function itself, if desired).
+ */
+
+#include <spinlock.h>
+
+struct cpu;
+
+struct timeout {
+	struct timeout *to_next;	/* link on wheel slot */
+	struct timeout **to_prevp;	/* what points to us */
+	void (*to_func)(void *);	/* function to call */
+	void *to_arg;			/* argument to pass it */
+	unsigned to_expires;		/* tick to fire on */
+	struct cpu *volatile to_cpu;	/* wheel we're on, or NULL */
+};
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *arg);
+void timeout(struct timeout *to, unsigned ticks);
+bool untimeout(struct timeout *to);
+
+/*
+ * The per-cpu timer wheel. This is the usual hierarchical scheme:
+ * the root wheel has a slot for each of the next TW_ROOTSLOTS ticks,
+ * and above it are TW_LEVELS wheels of TW_SLOTS slots, each slot
+ * spanning a whole turn of the wheel below. Each time the root wheel
+ * comes round, the next slot up is emptied and its timeouts
+ * redistributed ("cascaded") into the wheels below. So arming and
+ * cancelling are constant time, and each tick only has to look at
+ * the timeouts that are actually due.
+ *
+ * tw_now is the next tick to be processed; ticks are numbered like
+ * the cpu's c_hardclocks. tw_firing holds the timeouts of the tick
+ * being processed that haven't been called yet.
+ */
+#define TW_ROOTBITS	8
+#define TW_BITS		6
+#define TW_LEVELS	3
+#define TW_ROOTSLOTS	(1U << TW_ROOTBITS)
+#define TW_SLOTS	(1U << TW_BITS)
+
+#define TIMEOUT_MAXTICKS ((1U << (TW_ROOTBITS + TW_LEVELS*TW_BITS)) - 1)
+
+struct timerwheel {
+	struct spinlock tw_lock;
+	unsigned tw_now;
+	struct timeout *tw_firing;
+	struct timeout *tw_root[TW_ROOTSLOTS];
+	struct timeout *tw_level[TW_LEVELS][TW_SLOTS];
+};
+
+/* Called from cpu_create. */
+void timerwheel_init(struct timerwheel *tw);
+
+/* Called from hardclock, after c_hardclocks is incremented. */
+void timerwheel_tick(void);
+
+/*
+ * Number of hardclocks until the current cpu's wheel next has work
+ * to do, or 0 if it's empty. Used for idling without a clock.
+ */
+unsigned timerwheel_nextdue(void);
+
+#endif /* _TIMEOUT_H_ */
@@ -33,6 +33,7 @@
 #include <spinlock.h>
 struct uio;
 struct stat;
+struct pollent;
 
 
 /*
@@ -132,6 +133,14 @@ struct vnode {
  *                      uio. Need not work on objects that are not
  *                      directories.
  *
+ *    vop_poll        - Return which of the POLLIN/POLLOUT bits in EVENTS
+ *                      would not block right now, plus POLLHUP or
+ *                      POLLERR if those apply. If the pollent is not
+ *                      NULL, first record it on the object's pollq
+ *                      (see <poll.h>) so a later change wakes the
+ *                      caller. Objects that never block can use
+ *                      vnode_poll_ready.
+ *
  *****************************************
  *
  *    vop_creat       - Create a regular file named NAME in the passed
@@ -196,6 +205,7 @@ struct vnode_ops {
 	int (*vop_mmap)(struct vnode *file /* add stuff */);
 	int (*vop_truncate)(struct vnode *file, off_t len);
 	int (*vop_namefile)(struct vnode *file, struct uio *uio);
+	int (*vop_poll)(struct vnode *object, int events, struct pollent *pe);
 
 
 	int (*vop_creat)(struct vnode *dir,
@@ -240,6 +250,7 @@ struct vnode_ops {
 #define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
 #define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
+#define VOP_POLL(vn, events, pe)        (__VOP(vn, poll)(vn, events, pe))
 
 #define VOP_CREAT(vn,nm,excl,mode,res)  (__VOP(vn, creat)(vn,nm,excl,mode,res))
 #define VOP_SYMLINK(vn, name, content)  (__VOP(vn, symlink)(vn, name, content))
@@ -279,6 +290,11 @@ int vnode_init(struct vnode *, const struct vnode_ops *ops,
  */
 void vnode_cleanup(struct vnode *);
 
+/*
+ * vop_poll for objects that are always ready for I/O.
+ */
+int vnode_poll_ready(struct vnode *vn, int events, struct pollent *pe);
+
 /*
  * Common stubs for vnode functions that just fail, in various ways.
  */
@@ -45,6 +45,12 @@ struct wchan; /* Opaque */
  */
 struct wchan *wchan_create(const char *name);
 
+/*
+ * Change the symbolic name of a wait channel. Same rules as for
+ * wchan_create.
+ */
+void wchan_setname(struct wchan *wc, const char *name);
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  */
@@ -66,6 +72,14 @@ bool wchan_isempty(struct wchan *wc, struct spinlock *lk);
  */
 void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Like wchan_sleep, but give up with EINTR if the thread's process is
+ * exiting (see thread_interrupt). Returns 0 after a normal wakeup.
+ * The associated lock is relocked either way. Callers must recheck
+ * whatever they were waiting for, as usual.
+ */
+int wchan_sleep_intr(struct wchan *wc, struct spinlock *lk);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The associated spinlock should be locked.
@@ -76,5 +90,16 @@ void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeone(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeall(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Move one thread, or all threads, sleeping on wait channel FROM over
+ * to wait channel TO without waking them. They'll be woken by whoever
+ * wakes TO instead. Both associated spinlocks should be locked.
+ * Returns the number of threads moved.
+ */
+unsigned wchan_requeueone(struct wchan *from, struct spinlock *fromlk,
+			  struct wchan *to, struct spinlock *tolk);
+unsigned wchan_requeueall(struct wchan *from, struct spinlock *fromlk,
+			  struct wchan *to, struct spinlock *tolk);
+
 
 #endif /* _WCHAN_H_ */
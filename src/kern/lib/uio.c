@@ -33,6 +33,7 @@
 #include <proc.h>
 #include <current.h>
 #include <copyinout.h>
+#include <vm.h>
 
 /*
  * See uio.h for a description.
@@ -121,8 +122,12 @@ uiomove(void *ptr, size_t n, struct uio *uio)
 int
 uiomovezeros(size_t n, struct uio *uio)
 {
-	/* static, so initialized as zero */
-	static char zeros[16];
+	/*
+	 * static, so initialized as zero. A page at a time, so that
+	 * zero-filling a hole in a file is a few large copies rather
+	 * than a uiomove call (and a copyout setjmp) per 16 bytes.
+	 */
+	static char zeros[PAGE_SIZE];
 	size_t amt;
 	int result;
 
@@ -46,6 +46,7 @@
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
+#include <futex.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
@@ -118,6 +119,7 @@ boot(void)
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	futex_bootstrap();
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -139,6 +141,9 @@ boot(void)
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
 
+	/* Periodic write-back of dirty filesystem metadata */
+	vfs_syncer_start();
+
 	kheap_nextgeneration();
 
 	/*
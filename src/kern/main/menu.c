@@ -33,6 +33,7 @@
 #include <kern/unistd.h>
 #include <limits.h>
 #include <lib.h>
+#include <kmem_cache.h>
 #include <uio.h>
 #include <clock.h>
 #include <thread.h>
@@ -90,7 +91,8 @@ cmd_progthread(void *ptr, unsigned long nargs)
 	if (result) {
 		kprintf("Running program %s failed: %s\n", args[0],
 			strerror(result));
-		return;
+		/* Exit properly so the menu's wait returns. */
+		sys__exit(1);
 	}
 
 	/* NOTREACHED: runprogram only returns on error. */
@@ -99,28 +101,24 @@ cmd_progthread(void *ptr, unsigned long nargs)
 /*
  * Common code for cmd_prog and cmd_shell.
  *
- * Note that this does not wait for the subprogram to finish, but
- * returns immediately to the menu. This is usually not what you want,
- * so you should have it call your system-calls-assignment waitpid
- * code after forking.
- *
- * Also note that because the subprogram's thread uses the "args"
- * array and strings, until you do this a race condition exists
- * between that code and the menu input code.
+ * The new process is a child of the kernel process, and we wait for
+ * it like any other parent before returning to the menu. This also
+ * keeps the "args" array alive while the subprogram's thread uses it.
  */
 static
 int
 common_prog(int nargs, char **args)
 {
 	struct proc *proc;
-	int result;
-	int32_t retval;
+	pid_t pid;
+	int result, status;
 
 	/* Create a process for the new program to run in. */
 	proc = proc_create_runprogram(args[0] /* name */);
 	if (proc == NULL) {
 		return ENOMEM;
 	}
+	pid = proc->p_id;
 
 	result = thread_fork(args[0] /* thread name */,
 			proc /* new process */,
@@ -130,18 +128,10 @@ common_prog(int nargs, char **args)
 		kprintf("thread_fork failed: %s\n", strerror(result));
 		proc_destroy(proc);
 		return result;
-	} else {
-
-		/*
-		 * The new process will be destroyed when the program exits...
-		 * once you write the code for handling that.
-		 */
-
-		//wait for the child to end before returning to the menu
-		sys_waitpid(proc->p_id, &result, 0, &retval);
 	}
-	
-	return 0;
+
+	/* Wait for the program to finish; this also reaps it. */
+	return proc_wait(pid, 0, &status, &pid);
 }
 
 /*
@@ -374,6 +364,7 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_cache_printstats();
 
 	return 0;
 }
@@ -49,12 +49,28 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <proc_array.h>
+#include <kmem_cache.h>
+#include <limits.h>
+#include <kern/errno.h>
+#include <kern/wait.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * Cache of proc structures; fork and exit go through here.
+ */
+struct kmem_cache proc_cache =
+	KMEM_CACHE_INITIALIZER("proc", sizeof(struct proc), NULL, NULL);
+
+/*
+ * Where the next pid search starts, so pids are not reused right
+ * away. Protected by proc_Lock.
+ */
+static pid_t proc_nextpid = PID_MIN;
+
 /*
  * Create a proc structure.
  */
@@ -63,17 +79,46 @@ struct proc *
 proc_create(const char *name)
 {
 	struct proc *proc;
+	int i;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
+		return NULL;
+	}
+
+
+	proc->p_waitcv = cv_create(name);
+	if (proc->p_waitcv == NULL) {
+		kfree(proc->p_name);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
+	proc->p_fdlock = lock_create(name);
+	if (proc->p_fdlock == NULL) {
+		cv_destroy(proc->p_waitcv);
+		kfree(proc->p_name);
+		kmem_cache_free(&proc_cache, proc);
+		return NULL;
+	}
+
+	proc->p_id = 0;
+	proc->p_exitcode = 0;
+	proc->p_exited = false;
+	proc->p_parent = NULL;
+	proc->p_children = NULL;
+	proc->p_sibling = NULL;
+	proc->p_vfork = false;
+	proc->p_vforkheld = false;
 
+	proc->p_nuthreads = 1;
+	proc->p_exiting = false;
+	proc->p_nexttid = 1;
+	proc->p_uthreads = NULL;
 
 	proc->p_numthreads = 0;
 
@@ -86,19 +131,81 @@ proc_create(const char *name)
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
+	for (i = 0; i < OPEN_MAX; i++) {
+		proc->p_fdtable[i] = NULL;
+	}
 
 	return proc;
 }
 
+/*
+ * Give PROC a pid and make it a child of PARENT. Call with
+ * proc_Lock held.
+ */
+static
+int
+proc_register(struct proc *proc, struct proc *parent)
+{
+	pid_t pid;
+
+	KASSERT(lock_do_i_hold(proc_Lock));
+
+	pid = proc_nextpid;
+	while (proc_Array[pid] != NULL) {
+		pid = (pid + 1 < PID_MAX) ? pid + 1 : PID_MIN;
+		if (pid == proc_nextpid) {
+			return ENPROC;
+		}
+	}
+	proc_nextpid = (pid + 1 < PID_MAX) ? pid + 1 : PID_MIN;
+
+	proc->p_id = pid;
+	proc_Array[pid] = proc;
+
+	proc->p_parent = parent;
+	proc->p_sibling = parent->p_children;
+	parent->p_children = proc;
+	return 0;
+}
+
+/*
+ * Take PROC off its parent's child list and out of the process
+ * table. Call with proc_Lock held.
+ */
+static
+void
+proc_unlink(struct proc *proc)
+{
+	struct proc **pp;
+
+	KASSERT(lock_do_i_hold(proc_Lock));
+
+	if (proc->p_parent != NULL) {
+		pp = &proc->p_parent->p_children;
+		while (*pp != proc) {
+			KASSERT(*pp != NULL);
+			pp = &(*pp)->p_sibling;
+		}
+		*pp = proc->p_sibling;
+		proc->p_parent = NULL;
+		proc->p_sibling = NULL;
+	}
+	KASSERT(proc_Array[proc->p_id] == proc);
+	proc_Array[proc->p_id] = NULL;
+	proc->p_id = 0;
+}
+
 /*
  * Destroy a proc structure.
  *
- * Note: nothing currently calls this. Your wait/exit code will
- * probably want to do so.
+ * This is called when a zombie is reaped, when an orphan exits, and
+ * to clean up after a failed fork.
  */
 void
 proc_destroy(struct proc *proc)
 {
+	struct uthread *ut;
+
 	/*
 	 * You probably want to destroy and null out much of the
 	 * process (particularly the address space) at exit time if
@@ -109,6 +216,13 @@ proc_destroy(struct proc *proc)
 
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
+	KASSERT(proc->p_children == NULL);
+
+	if (proc->p_id != 0) {
+		lock_acquire(proc_Lock);
+		proc_unlink(proc);
+		lock_release(proc_Lock);
+	}
 
 	/*
 	 * We don't take p_lock in here because we must have the only
@@ -173,8 +287,17 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc->p_numthreads == 0);
 	spinlock_cleanup(&proc->p_lock);
 
+	/* threads nobody joined */
+	while (proc->p_uthreads != NULL) {
+		ut = proc->p_uthreads;
+		proc->p_uthreads = ut->ut_next;
+		kfree(ut);
+	}
+
+	lock_destroy(proc->p_fdlock);
+	cv_destroy(proc->p_waitcv);
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(&proc_cache, proc);
 }
 
 /*
@@ -190,20 +313,20 @@ proc_bootstrap(void)
 }
 
 /*
- * Create a fresh proc for use by runprogram.
- *
- * It will have no address space and will inherit the current
- * process's (that is, the kernel menu's) current directory.
+ * Create a child of the current process, with a pid of its own. It
+ * will have no address space and will inherit the current process's
+ * current directory.
  */
-struct proc *
-proc_create_runprogram(const char *name)
+static
+int
+proc_create_child(const char *name, struct proc **ret)
 {
 	struct proc *newproc;
+	int result;
 
 	newproc = proc_create(name);
 	if (newproc == NULL) {
-		kprintf("newproc == NULL\n");
-		return NULL;
+		return ENOMEM;
 	}
 
 	/* VM fields */
@@ -224,9 +347,434 @@ proc_create_runprogram(const char *name)
 	}
 	spinlock_release(&curproc->p_lock);
 
+	lock_acquire(proc_Lock);
+	result = proc_register(newproc, curproc);
+	lock_release(proc_Lock);
+	if (result) {
+		proc_destroy(newproc);
+		return result;
+	}
+
+	*ret = newproc;
+	return 0;
+}
+
+/*
+ * Create a fresh proc for use by runprogram. It is a child of the
+ * menu, which waits for it like any other parent.
+ */
+struct proc *
+proc_create_runprogram(const char *name)
+{
+	struct proc *newproc;
+
+	if (proc_create_child(name, &newproc)) {
+		return NULL;
+	}
 	return newproc;
 }
 
+/*
+ * Create the child process for fork. The caller fills in the
+ * address space.
+ */
+int
+proc_create_fork(struct proc **ret)
+{
+	return proc_create_child(curproc->p_name, ret);
+}
+
+/*
+ * Called by the last thread of the current process on its way out.
+ *
+ * Everything the process holds is released here rather than when it
+ * is reaped, so a zombie costs only its proc structure. The thread
+ * detaches itself before the parent is woken; after that the parent
+ * may free the proc at any moment. Children are orphaned, and any
+ * of them that have already exited are freed now since nobody is
+ * left to wait for them.
+ */
+void
+proc_exit(int status)
+{
+	struct proc *proc = curproc;
+	struct proc *child, *next;
+	struct addrspace *as;
+	bool orphan;
+
+	KASSERT(proc != NULL);
+	KASSERT(proc != kproc);
+
+	as = proc_setas(NULL);
+	as_deactivate();
+	if (!proc_vfork_release() && as != NULL) {
+		as_destroy(as);
+	}
+
+	if (proc->p_cwd) {
+		VOP_DECREF(proc->p_cwd);
+		proc->p_cwd = NULL;
+	}
+
+	proc_remthread(curthread);
+
+	lock_acquire(proc_Lock);
+
+	for (child = proc->p_children; child != NULL; child = next) {
+		next = child->p_sibling;
+		child->p_parent = NULL;
+		child->p_sibling = NULL;
+		if (child->p_exited) {
+			proc_unlink(child);
+			proc_destroy(child);
+		}
+	}
+	proc->p_children = NULL;
+
+	if (!proc->p_exiting) {
+		proc->p_exitcode = status;
+	}
+	proc->p_exited = true;
+
+	orphan = (proc->p_parent == NULL);
+	if (orphan) {
+		proc_unlink(proc);
+	}
+	else {
+		cv_broadcast(proc->p_parent->p_waitcv, proc_Lock);
+	}
+
+	lock_release(proc_Lock);
+
+	if (orphan) {
+		proc_destroy(proc);
+	}
+}
+
+/*
+ * A vfork child runs in its parent's address space while the parent
+ * sleeps in proc_vfork_wait. When the child execs or exits it calls
+ * this to hand the address space back and wake the parent. Returns
+ * true if the current process was borrowing, in which case the
+ * caller must not destroy its old address space.
+ */
+bool
+proc_vfork_release(void)
+{
+	struct proc *proc = curproc;
+	bool borrowed;
+
+	lock_acquire(proc_Lock);
+	borrowed = proc->p_vfork;
+	if (borrowed) {
+		proc->p_vfork = false;
+		KASSERT(proc->p_parent != NULL);
+		cv_broadcast(proc->p_parent->p_waitcv, proc_Lock);
+	}
+	lock_release(proc_Lock);
+
+	return borrowed;
+}
+
+/*
+ * Sleep until vfork child CHILD is done with our address space. The
+ * child may exit as soon as it lets go, and another of our threads
+ * could be in waitpid, so p_vforkheld keeps proc_wait from reaping it
+ * until we're done looking at it. CHILD must not be used after this
+ * returns.
+ */
+void
+proc_vfork_wait(struct proc *child)
+{
+	lock_acquire(proc_Lock);
+	KASSERT(child->p_parent == curproc);
+	KASSERT(child->p_vforkheld);
+	while (child->p_vfork) {
+		cv_wait(curproc->p_waitcv, proc_Lock);
+	}
+	child->p_vforkheld = false;
+	if (child->p_exited) {
+		/* let any waitpid that skipped it have another look */
+		cv_broadcast(curproc->p_waitcv, proc_Lock);
+	}
+	lock_release(proc_Lock);
+}
+
+/*
+ * Make the record and claim a stack for a new user thread of the
+ * current process. It counts as live from here on, so the process
+ * can't finish exiting before it has started and left again.
+ */
+int
+proc_thread_create(struct uthread **ret)
+{
+	struct proc *proc = curproc;
+	struct uthread *ut;
+	int result;
+
+	ut = kmalloc(sizeof(*ut));
+	if (ut == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(proc_Lock);
+	if (proc->p_exiting) {
+		lock_release(proc_Lock);
+		kfree(ut);
+		return EINTR;
+	}
+	result = as_alloc_threadstack(proc->p_addrspace, &ut->ut_stackslot,
+				      &ut->ut_stack);
+	if (result) {
+		lock_release(proc_Lock);
+		kfree(ut);
+		return result;
+	}
+	ut->ut_tid = proc->p_nexttid++;
+	ut->ut_exited = false;
+	ut->ut_joined = false;
+	ut->ut_code = 0;
+	ut->ut_next = proc->p_uthreads;
+	proc->p_uthreads = ut;
+	proc->p_nuthreads++;
+	lock_release(proc_Lock);
+
+	*ret = ut;
+	return 0;
+}
+
+/*
+ * Unlink UT from the current process's list. Call with proc_Lock
+ * held.
+ */
+static
+void
+proc_thread_unlink(struct proc *proc, struct uthread *ut)
+{
+	struct uthread **pp;
+
+	for (pp = &proc->p_uthreads; *pp != ut; pp = &(*pp)->ut_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = ut->ut_next;
+}
+
+/*
+ * The thread for UT could not be started; forget it. If some thread
+ * has already guessed its tid and is joining it, it's left for that
+ * thread to collect and free instead.
+ */
+void
+proc_thread_abort(struct uthread *ut)
+{
+	struct proc *proc = curproc;
+	bool joined;
+
+	lock_acquire(proc_Lock);
+	as_free_threadstack(proc->p_addrspace, ut->ut_stackslot);
+	KASSERT(proc->p_nuthreads > 1);
+	proc->p_nuthreads--;
+	joined = ut->ut_joined;
+	if (joined) {
+		ut->ut_exited = true;
+		cv_broadcast(proc->p_waitcv, proc_Lock);
+	}
+	else {
+		proc_thread_unlink(proc, ut);
+	}
+	lock_release(proc_Lock);
+
+	if (!joined) {
+		kfree(ut);
+	}
+}
+
+/*
+ * Take curthread out of its process, leaving CODE for thread_join.
+ *
+ * If it is the last thread it stays attached, and the caller must go
+ * on to exit the whole process; we return true. Otherwise it is
+ * detached before proc_Lock is dropped, so whoever is last can't tear
+ * the process down while we still point at it, and we return false;
+ * the caller should just thread_exit.
+ */
+bool
+proc_thread_leave(int code)
+{
+	struct proc *proc = curproc;
+	struct uthread *ut = curthread->t_uthread;
+
+	lock_acquire(proc_Lock);
+
+	if (ut != NULL) {
+		/* the user stack is no longer in use */
+		as_free_threadstack(proc->p_addrspace, ut->ut_stackslot);
+		ut->ut_exited = true;
+		ut->ut_code = code;
+		curthread->t_uthread = NULL;
+	}
+
+	KASSERT(proc->p_nuthreads > 0);
+	if (proc->p_nuthreads == 1) {
+		lock_release(proc_Lock);
+		return true;
+	}
+	proc->p_nuthreads--;
+	proc_remthread(curthread);
+	cv_broadcast(proc->p_waitcv, proc_Lock);
+
+	lock_release(proc_Lock);
+	return false;
+}
+
+/*
+ * Wait for thread TID of the current process to leave and collect
+ * its exit value. Each thread can be joined once: the joiner claims
+ * the record with ut_joined, and anyone else trying to join it gets
+ * EINVAL. Only the claimant unlinks and frees it, so it stays valid
+ * across our cv_waits.
+ */
+int
+proc_thread_join(int tid, int *code)
+{
+	struct proc *proc = curproc;
+	struct uthread *ut;
+
+	lock_acquire(proc_Lock);
+
+	for (ut = proc->p_uthreads; ut != NULL; ut = ut->ut_next) {
+		if (ut->ut_tid == tid) {
+			break;
+		}
+	}
+	if (ut == NULL) {
+		lock_release(proc_Lock);
+		return ESRCH;
+	}
+	if (ut == curthread->t_uthread || ut->ut_joined) {
+		lock_release(proc_Lock);
+		return EINVAL;
+	}
+	ut->ut_joined = true;
+
+	while (!ut->ut_exited) {
+		if (proc->p_exiting) {
+			/* give it up; it'll be freed with the process */
+			ut->ut_joined = false;
+			lock_release(proc_Lock);
+			return EINTR;
+		}
+		cv_wait(proc->p_waitcv, proc_Lock);
+	}
+
+	*code = ut->ut_code;
+	proc_thread_unlink(proc, ut);
+	lock_release(proc_Lock);
+
+	kfree(ut);
+	return 0;
+}
+
+/*
+ * Called by _exit. The first caller's status wins; the other threads
+ * see p_exiting and leave, and the last one out exits the process.
+ */
+void
+proc_setexit(int status)
+{
+	struct proc *proc = curproc;
+
+	lock_acquire(proc_Lock);
+	if (!proc->p_exiting) {
+		proc->p_exiting = true;
+		proc->p_exitcode = status;
+	}
+	/* get joiners and waiters moving */
+	cv_broadcast(proc->p_waitcv, proc_Lock);
+	lock_release(proc_Lock);
+
+	/* and anyone blocked in a pipe, the console, poll or nanosleep */
+	thread_interrupt(proc);
+}
+
+/*
+ * A zombie child can be reaped once no vfork parent thread is still
+ * looking at it.
+ */
+#define PROC_REAPABLE(p) ((p)->p_exited && !(p)->p_vforkheld)
+
+/*
+ * Wait for a child of the current process to exit, then reap it.
+ * PID may be WAIT_ANY. With WNOHANG, *RET is set to 0 instead of
+ * sleeping if no child has exited yet.
+ */
+int
+proc_wait(pid_t pid, int options, int *status, pid_t *ret)
+{
+	struct proc *proc = curproc;
+	struct proc *child;
+
+	if (options & ~WNOHANG) {
+		return EINVAL;
+	}
+	if (pid != WAIT_ANY && (pid < PID_MIN || pid >= PID_MAX)) {
+		return (pid <= 0) ? EINVAL : ESRCH;
+	}
+
+	lock_acquire(proc_Lock);
+	for (;;) {
+		if (pid == WAIT_ANY) {
+			if (proc->p_children == NULL) {
+				lock_release(proc_Lock);
+				return ECHILD;
+			}
+			child = proc->p_children;
+			while (child != NULL && !PROC_REAPABLE(child)) {
+				child = child->p_sibling;
+			}
+		}
+		else {
+			child = proc_Array[pid];
+			if (child == NULL) {
+				lock_release(proc_Lock);
+				return ESRCH;
+			}
+			if (child->p_parent != proc) {
+				lock_release(proc_Lock);
+				return ECHILD;
+			}
+			if (!PROC_REAPABLE(child)) {
+				child = NULL;
+			}
+		}
+
+		if (child != NULL) {
+			break;
+		}
+		if (options & WNOHANG) {
+			lock_release(proc_Lock);
+			*ret = 0;
+			return 0;
+		}
+		if (proc->p_exiting) {
+			/* another thread called _exit; go and leave */
+			lock_release(proc_Lock);
+			return EINTR;
+		}
+		cv_wait(proc->p_waitcv, proc_Lock);
+	}
+
+	*ret = child->p_id;
+	if (status != NULL) {
+		*status = child->p_exitcode;
+	}
+	proc_unlink(child);
+	lock_release(proc_Lock);
+
+	proc_destroy(child);
+	return 0;
+}
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * futex(): sleep on, and wake sleepers on, a word of user memory.
+ *
+ * Sleepers are kept in a hash table keyed by (address space, user
+ * address). Each bucket has a lock and a cv; the lock is held while
+ * the user word is checked, so a wake can't slip in between the check
+ * and the sleep. A wake marks the sleepers it picks and broadcasts
+ * the bucket's cv; the rest go back to sleep.
+ *
+ * The word is only ever read here. Whatever protocol the user code
+ * keeps in it (see the mutex and condvar in libc) is its own affair.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/futex.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <futex.h>
+#include <syscall.h>
+
+#define FUTEX_HASHSIZE	64
+
+struct futex_waiter {
+	struct addrspace *fw_as;
+	vaddr_t fw_addr;
+	bool fw_woken;
+	struct futex_waiter *fw_next;
+};
+
+struct futex_bucket {
+	struct lock *fb_lock;
+	struct cv *fb_cv;
+	struct futex_waiter *fb_waiters;
+};
+
+static struct futex_bucket futex_table[FUTEX_HASHSIZE];
+
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i = 0; i < FUTEX_HASHSIZE; i++) {
+		futex_table[i].fb_lock = lock_create("futex");
+		futex_table[i].fb_cv = cv_create("futex");
+		if (futex_table[i].fb_lock == NULL ||
+		    futex_table[i].fb_cv == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+		futex_table[i].fb_waiters = NULL;
+	}
+}
+
+static
+struct futex_bucket *
+futex_bucket(struct addrspace *as, vaddr_t addr)
+{
+	unsigned h;
+
+	h = ((uintptr_t)as >> 4) ^ (addr >> 2);
+	h ^= h >> 12;
+	return &futex_table[h % FUTEX_HASHSIZE];
+}
+
+/*
+ * Take W off B's list, if it's still there.
+ */
+static
+void
+futex_unlink(struct futex_bucket *b, struct futex_waiter *w)
+{
+	struct futex_waiter **pp;
+
+	for (pp = &b->fb_waiters; *pp != NULL; pp = &(*pp)->fw_next) {
+		if (*pp == w) {
+			*pp = w->fw_next;
+			return;
+		}
+	}
+}
+
+static
+int
+futex_wait(struct addrspace *as, userptr_t uaddr, int val)
+{
+	struct futex_bucket *b;
+	struct futex_waiter w;
+	int cur, result;
+
+	b = futex_bucket(as, (vaddr_t)uaddr);
+
+	lock_acquire(b->fb_lock);
+
+	result = copyin((const_userptr_t)uaddr, &cur, sizeof(cur));
+	if (result) {
+		lock_release(b->fb_lock);
+		return result;
+	}
+	if (cur != val) {
+		/* it already changed; the caller should look again */
+		lock_release(b->fb_lock);
+		return EAGAIN;
+	}
+
+	w.fw_as = as;
+	w.fw_addr = (vaddr_t)uaddr;
+	w.fw_woken = false;
+	w.fw_next = b->fb_waiters;
+	b->fb_waiters = &w;
+
+	while (!w.fw_woken) {
+		if (curproc->p_exiting) {
+			futex_unlink(b, &w);
+			lock_release(b->fb_lock);
+			return EINTR;
+		}
+		cv_wait(b->fb_cv, b->fb_lock);
+	}
+
+	lock_release(b->fb_lock);
+	return 0;
+}
+
+static
+int
+futex_wake(struct addrspace *as, userptr_t uaddr, int val, int32_t *retval)
+{
+	struct futex_bucket *b;
+	struct futex_waiter **pp, *w;
+	int n;
+
+	if (val <= 0) {
+		return EINVAL;
+	}
+
+	b = futex_bucket(as, (vaddr_t)uaddr);
+	n = 0;
+
+	lock_acquire(b->fb_lock);
+	pp = &b->fb_waiters;
+	while (*pp != NULL && n < val) {
+		w = *pp;
+		if (w->fw_as == as && w->fw_addr == (vaddr_t)uaddr) {
+			*pp = w->fw_next;
+			w->fw_woken = true;
+			n++;
+		}
+		else {
+			pp = &w->fw_next;
+		}
+	}
+	if (n > 0) {
+		cv_broadcast(b->fb_cv, b->fb_lock);
+	}
+	lock_release(b->fb_lock);
+
+	*retval = n;
+	return 0;
+}
+
+void
+futex_wakeall(void)
+{
+	unsigned i;
+
+	for (i = 0; i < FUTEX_HASHSIZE; i++) {
+		lock_acquire(futex_table[i].fb_lock);
+		if (futex_table[i].fb_waiters != NULL) {
+			cv_broadcast(futex_table[i].fb_cv,
+				     futex_table[i].fb_lock);
+		}
+		lock_release(futex_table[i].fb_lock);
+	}
+}
+
+/*
+ * futex(addr, op, val). FUTEX_WAIT returns EAGAIN at once if *addr is
+ * not VAL; FUTEX_WAKE returns the number of sleepers woken.
+ */
+int
+sys_futex(userptr_t uaddr, int op, int val, int32_t *retval)
+{
+	struct addrspace *as;
+
+	if ((vaddr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	as = proc_getas();
+	*retval = 0;
+
+	switch (op) {
+	    case FUTEX_WAIT:
+		return futex_wait(as, uaddr, val);
+	    case FUTEX_WAKE:
+		return futex_wake(as, uaddr, val, retval);
+	}
+	return EINVAL;
+}
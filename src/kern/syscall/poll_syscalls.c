@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * poll() and select().
+ *
+ * Both come down to poll_wait, which looks at each descriptor with
+ * VOP_POLL and, if nothing is ready, sleeps until one of the objects
+ * wakes its pollq (see <poll.h>) or the timeout goes off, and then
+ * looks again.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/limits.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <clock.h>
+#include <timeout.h>
+#include <wchan.h>
+#include <copyinout.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <poll.h>
+#include <syscall.h>
+
+/*
+ * Timeout function: give up waiting.
+ */
+static
+void
+poll_timedout(void *vctx)
+{
+	struct pollctx *ctx = vctx;
+
+	spinlock_acquire(&ctx->pc_lock);
+	ctx->pc_timedout = true;
+	wchan_wakeall(ctx->pc_wchan, &ctx->pc_lock);
+	spinlock_release(&ctx->pc_lock);
+}
+
+/*
+ * Fill in revents for each of FDS and return how many have any set.
+ * If PES is not NULL, record each entry so we can sleep afterwards.
+ */
+static
+unsigned
+poll_scan(struct pollfd *fds, struct vnode **vns, struct pollent *pes,
+	  unsigned nfds)
+{
+	unsigned i, nready = 0;
+
+	for (i = 0; i < nfds; i++) {
+		if (fds[i].fd < 0) {
+			fds[i].revents = 0;
+			continue;
+		}
+		if (vns[i] == NULL) {
+			fds[i].revents = POLLNVAL;
+		}
+		else {
+			fds[i].revents = VOP_POLL(vns[i], fds[i].events,
+						  pes != NULL ? &pes[i] : NULL);
+		}
+		if (fds[i].revents != 0) {
+			nready++;
+		}
+	}
+	return nready;
+}
+
+/*
+ * Wait up to TIMEOUT_MS milliseconds (forever if negative) for any of
+ * FDS to become ready. Fills in revents and hands back the number of
+ * ready descriptors, which is 0 on timeout.
+ */
+static
+int
+poll_wait(struct pollfd *fds, unsigned nfds, int timeout_ms,
+	  unsigned *ret_nready)
+{
+	struct vnode **vns;
+	struct pollent *pes;
+	struct pollctx ctx;
+	struct timeout to;
+	struct fdesc *fd;
+	uint64_t ticks;
+	unsigned i, nready;
+	bool armed = false;
+	int result = 0;
+
+	vns = kmalloc(nfds * sizeof(*vns) + 1);
+	pes = kmalloc(nfds * sizeof(*pes) + 1);
+	if (vns == NULL || pes == NULL) {
+		if (vns != NULL) {
+			kfree(vns);
+		}
+		if (pes != NULL) {
+			kfree(pes);
+		}
+		return ENOMEM;
+	}
+
+	/*
+	 * Hold the vnodes so they can't be reclaimed while we wait,
+	 * even if another thread closes the descriptors.
+	 */
+	for (i = 0; i < nfds; i++) {
+		vns[i] = NULL;
+		fd = fdesc_get(fds[i].fd);
+		if (fd != NULL) {
+			vns[i] = fd->vn;
+			VOP_INCREF(vns[i]);
+			fdesc_release(fd);
+		}
+	}
+
+	spinlock_init(&ctx.pc_lock);
+	ctx.pc_wchan = NULL;
+	ctx.pc_fired = false;
+	ctx.pc_timedout = false;
+	for (i = 0; i < nfds; i++) {
+		pollent_init(&pes[i], &ctx);
+	}
+
+	nready = poll_scan(fds, vns, NULL, nfds);
+	if (nready > 0 || timeout_ms == 0) {
+		goto done;
+	}
+
+	ctx.pc_wchan = wchan_create("poll");
+	if (ctx.pc_wchan == NULL) {
+		result = ENOMEM;
+		goto done;
+	}
+	if (timeout_ms > 0) {
+		ticks = ((uint64_t)timeout_ms * HZ + 999) / 1000;
+		if (ticks > TIMEOUT_MAXTICKS) {
+			ticks = TIMEOUT_MAXTICKS;
+		}
+		timeout_init(&to, poll_timedout, &ctx);
+		timeout(&to, ticks);
+		armed = true;
+	}
+
+	while (1) {
+		spinlock_acquire(&ctx.pc_lock);
+		ctx.pc_fired = false;
+		spinlock_release(&ctx.pc_lock);
+
+		nready = poll_scan(fds, vns, pes, nfds);
+		if (nready > 0) {
+			break;
+		}
+
+		spinlock_acquire(&ctx.pc_lock);
+		while (!ctx.pc_fired && !ctx.pc_timedout && result == 0) {
+			result = wchan_sleep_intr(ctx.pc_wchan, &ctx.pc_lock);
+		}
+		spinlock_release(&ctx.pc_lock);
+		if (ctx.pc_timedout || result) {
+			break;
+		}
+	}
+
+	for (i = 0; i < nfds; i++) {
+		pollent_remove(&pes[i]);
+	}
+	if (armed && !untimeout(&to)) {
+		/* It's firing; wait for it to finish with ctx. */
+		spinlock_acquire(&ctx.pc_lock);
+		while (!ctx.pc_timedout) {
+			wchan_sleep(ctx.pc_wchan, &ctx.pc_lock);
+		}
+		spinlock_release(&ctx.pc_lock);
+	}
+	wchan_destroy(ctx.pc_wchan);
+
+ done:
+	spinlock_cleanup(&ctx.pc_lock);
+	for (i = 0; i < nfds; i++) {
+		if (vns[i] != NULL) {
+			vfs_close(vns[i]);
+		}
+	}
+	kfree(pes);
+	kfree(vns);
+
+	*ret_nready = nready;
+	return result;
+}
+
+/*
+ * poll(): wait for any of the NFDS descriptors in USER_FDS.
+ */
+int
+sys_poll(userptr_t user_fds, unsigned nfds, int timeout_ms, int32_t *retval)
+{
+	struct pollfd *fds;
+	unsigned nready;
+	int result;
+
+	if (nfds > OPEN_MAX) {
+		return EINVAL;
+	}
+
+	fds = kmalloc(nfds * sizeof(*fds) + 1);
+	if (fds == NULL) {
+		return ENOMEM;
+	}
+	result = copyin(user_fds, fds, nfds * sizeof(*fds));
+	if (result) {
+		kfree(fds);
+		return result;
+	}
+
+	result = poll_wait(fds, nfds, timeout_ms, &nready);
+	if (result == 0) {
+		result = copyout(fds, user_fds, nfds * sizeof(*fds));
+	}
+	kfree(fds);
+	if (result) {
+		return result;
+	}
+	*retval = nready;
+	return 0;
+}
+
+/*
+ * select(): the same thing with bitmaps. Unlike poll(), a descriptor
+ * that isn't open is an error.
+ */
+int
+sys_select(int nfds, userptr_t user_rd, userptr_t user_wr, userptr_t user_ex,
+	   userptr_t user_tv, int32_t *retval)
+{
+	fd_set sets[3];
+	userptr_t usets[3] = { user_rd, user_wr, user_ex };
+	struct pollfd *fds;
+	struct fdesc *fdesc;
+	struct timeval tv;
+	unsigned n, nready, i;
+	int fd, timeout_ms, result;
+
+	if (nfds < 0 || nfds > FD_SETSIZE) {
+		return EINVAL;
+	}
+
+	for (i = 0; i < 3; i++) {
+		FD_ZERO(&sets[i]);
+		if (usets[i] != NULL) {
+			result = copyin(usets[i], &sets[i], sizeof(sets[i]));
+			if (result) {
+				return result;
+			}
+		}
+	}
+
+	timeout_ms = -1;
+	if (user_tv != NULL) {
+		result = copyin(user_tv, &tv, sizeof(tv));
+		if (result) {
+			return result;
+		}
+		if (tv.tv_sec < 0 || tv.tv_usec < 0 || tv.tv_usec >= 1000000) {
+			return EINVAL;
+		}
+		if (tv.tv_sec > 0x7fffffff / 1000 - 1) {
+			timeout_ms = 0x7fffffff;
+		}
+		else {
+			timeout_ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+		}
+	}
+
+	fds = kmalloc(nfds * sizeof(*fds) + 1);
+	if (fds == NULL) {
+		return ENOMEM;
+	}
+	n = 0;
+	for (fd = 0; fd < nfds; fd++) {
+		if (!FD_ISSET(fd, &sets[0]) && !FD_ISSET(fd, &sets[1]) &&
+		    !FD_ISSET(fd, &sets[2])) {
+			continue;
+		}
+		fdesc = fdesc_get(fd);
+		if (fdesc == NULL) {
+			kfree(fds);
+			return EBADF;
+		}
+		fdesc_release(fdesc);
+		fds[n].fd = fd;
+		fds[n].events = 0;
+		if (FD_ISSET(fd, &sets[0])) {
+			fds[n].events |= POLLIN;
+		}
+		if (FD_ISSET(fd, &sets[1])) {
+			fds[n].events |= POLLOUT;
+		}
+		if (FD_ISSET(fd, &sets[2])) {
+			fds[n].events |= POLLPRI;
+		}
+		n++;
+	}
+
+	result = poll_wait(fds, n, timeout_ms, &nready);
+	if (result) {
+		kfree(fds);
+		return result;
+	}
+
+	/*
+	 * A descriptor closed by another thread since we checked it
+	 * comes back POLLNVAL; that's still EBADF, not "not ready".
+	 */
+	for (i = 0; i < n; i++) {
+		if (fds[i].revents & POLLNVAL) {
+			kfree(fds);
+			return EBADF;
+		}
+	}
+
+	/* Hung-up and errored descriptors count as ready, as usual. */
+	nready = 0;
+	for (i = 0; i < 3; i++) {
+		FD_ZERO(&sets[i]);
+	}
+	for (i = 0; i < n; i++) {
+		fd = fds[i].fd;
+		if ((fds[i].events & POLLIN) &&
+		    (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+			FD_SET(fd, &sets[0]);
+			nready++;
+		}
+		if ((fds[i].events & POLLOUT) &&
+		    (fds[i].revents & (POLLOUT | POLLERR))) {
+			FD_SET(fd, &sets[1]);
+			nready++;
+		}
+		if (fds[i].revents & POLLPRI) {
+			FD_SET(fd, &sets[2]);
+			nready++;
+		}
+	}
+	kfree(fds);
+
+	for (i = 0; i < 3; i++) {
+		if (usets[i] != NULL) {
+			result = copyout(&sets[i], usets[i], sizeof(sets[i]));
+			if (result) {
+				return result;
+			}
+		}
+	}
+	*retval = nready;
+	return 0;
+}
@@ -45,6 +45,7 @@
 #include <syscall.h>
 #include <test.h>
 #include <proc_array.h>
+#include <kmem_cache.h>
 
 /*
  * Load program "progname" and start running it in usermode.
@@ -72,11 +73,6 @@ runprogram(char *progname)
 	vaddr_t entrypoint, stackptr;
 	int result;
 
-	if(proc_Lock == NULL){
-		proc_Lock = lock_create("proc_Lock");
-	}
-	lock_acquire(proc_Lock);
-
 	/* Open the file. */
 	result = vfs_open(progname, O_RDONLY, 0, &v);
 	if (result) {
@@ -107,54 +103,54 @@ runprogram(char *progname)
 
 	//set up stdin stdout and stderr
 
-	fin = (struct fdesc*) kmalloc(sizeof(struct fdesc));
+	fin = kmem_cache_alloc(&fdesc_cache);
 	vfs_open(in, O_RDONLY, 0664, &vin);
-	curthread->t_fdtable[0] = fin;
+	curproc->p_fdtable[0] = fin;
 
 
 
 	//set variables in file table
-	curthread->t_fdtable[0]->fname = sin;
-	curthread->t_fdtable[0]->flags = O_RDONLY;
-	curthread->t_fdtable[0]->vn = vin;
-	curthread->t_fdtable[0]->fdlock = lock_create(sin);
-	curthread->t_fdtable[0]->refcount = 1;
-	if(curthread->t_fdtable[0]->vn == NULL){
+	curproc->p_fdtable[0]->fname = sin;
+	curproc->p_fdtable[0]->flags = O_RDONLY;
+	curproc->p_fdtable[0]->vn = vin;
+	curproc->p_fdtable[0]->fdlock = lock_create(sin);
+	curproc->p_fdtable[0]->refcount = 1;
+	if(curproc->p_fdtable[0]->vn == NULL){
 		kprintf("vin is null\n");
 	}
 
-	fout = (struct fdesc*) kmalloc(sizeof(struct fdesc));
+	fout = kmem_cache_alloc(&fdesc_cache);
 	vfs_open(out, O_WRONLY, 0664, &vout);
-	curthread->t_fdtable[1] = fout;
+	curproc->p_fdtable[1] = fout;
 	if(vout == NULL){
 		//kprintf("vout1 is null\n");
 	}
 
 	//set variables in file table
-	curthread->t_fdtable[1]->fname = sout;
-	curthread->t_fdtable[1]->flags = O_WRONLY;
-	curthread->t_fdtable[1]->vn = vout;
-	curthread->t_fdtable[1]->fdlock = lock_create(sout);
-	curthread->t_fdtable[1]->refcount = 1;
-	if(curthread->t_fdtable[1]->vn == NULL){
+	curproc->p_fdtable[1]->fname = sout;
+	curproc->p_fdtable[1]->flags = O_WRONLY;
+	curproc->p_fdtable[1]->vn = vout;
+	curproc->p_fdtable[1]->fdlock = lock_create(sout);
+	curproc->p_fdtable[1]->refcount = 1;
+	if(curproc->p_fdtable[1]->vn == NULL){
 		kprintf("vout is null\n");
 	}
 
 
-	ferr = (struct fdesc*) kmalloc(sizeof(struct fdesc));
+	ferr = kmem_cache_alloc(&fdesc_cache);
 	vfs_open(err, O_WRONLY, 0664, &verr);
-	curthread->t_fdtable[2] = ferr;
+	curproc->p_fdtable[2] = ferr;
 	if(verr == NULL){
 		//kprintf("verr1 is null\n");
 	}
 
 	//set variables in file table
-	curthread->t_fdtable[2]->fname = serr;
-	curthread->t_fdtable[2]->flags = O_WRONLY;
-	curthread->t_fdtable[2]->vn = verr;
-	curthread->t_fdtable[2]->fdlock = lock_create(serr);
-	curthread->t_fdtable[2]->refcount = 1;
-	if(curthread->t_fdtable[2]->vn == NULL){
+	curproc->p_fdtable[2]->fname = serr;
+	curproc->p_fdtable[2]->flags = O_WRONLY;
+	curproc->p_fdtable[2]->vn = verr;
+	curproc->p_fdtable[2]->fdlock = lock_create(serr);
+	curproc->p_fdtable[2]->refcount = 1;
+	if(curproc->p_fdtable[2]->vn == NULL){
 		//kprintf("verr is null\n");
 	}
 
@@ -168,36 +164,6 @@ runprogram(char *progname)
 		return result;
 	}
 
-
-	//proc_Array[1] = curthread->t_proc;
-	//curthread->t_proc->p_id = 1;
-	//kprintf("something\n");
-	/*
-	//get and set pid
-	for(pid = 1; pid < __PID_MAX; pid++){
-		if(proc_Array[pid] == NULL) break;
-	}
-	kprintf("runprogram pid to be %d\n", pid);
-
-	curthread->t_proc->p_id = pid;
-	proc_Array[pid] = curthread->t_proc;
-	kprintf("set runprogram pid\n");
-	*/
-
-
-	//assign parents sems
-	curthread->t_proc->p_parsem = kmalloc(sizeof(struct semaphore));
-	curthread->t_proc->p_childsem = kmalloc(sizeof(struct semaphore));
-
-	curthread->t_proc->p_parsem = sem_create("parent", 1);
-	curthread->t_proc->p_childsem = sem_create("child", 0);
-
-	memset(curthread->t_proc->p_children, -1, __PID_MAX);
-
-
-	lock_release(proc_Lock);
-	
-
 	/* Warp to user mode. */
 	enter_new_process(0 /*argc*/, NULL /*userspace addr of argv*/,
 			  NULL /*userspace addr of environment*/,
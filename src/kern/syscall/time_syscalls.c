@@ -28,6 +28,8 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <thread.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -56,3 +58,54 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the time given in *USER_REQ, rounded up to whole
+ * hardclocks. There are no signals to interrupt us, so if USER_REM
+ * is given the time remaining is always zero. The only interruption
+ * is another thread calling _exit, and then nobody will look at it.
+ */
+int
+sys_nanosleep(userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec ts;
+	uint64_t ticks;
+	int result;
+
+	result = copyin(user_req, &ts, sizeof(ts));
+	if (result) {
+		return result;
+	}
+	if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	ticks = (uint64_t)ts.tv_sec * HZ +
+		(ts.tv_nsec + 1000000000/HZ - 1) / (1000000000/HZ);
+	if (ticks == 0) {
+		thread_yield();
+	}
+	while (ticks > 0) {
+		if (ticks > 0xffffffff) {
+			result = clocksleep_ticks_intr(0xffffffff);
+			ticks -= 0xffffffff;
+		}
+		else {
+			result = clocksleep_ticks_intr(ticks);
+			ticks = 0;
+		}
+		if (result) {
+			return result;
+		}
+	}
+
+	if (user_rem != NULL) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+		result = copyout(&ts, user_rem, sizeof(ts));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
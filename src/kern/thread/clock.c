@@ -30,17 +30,20 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
+#include <timeout.h>
+#include <mainbus.h>
 #include <thread.h>
 #include <current.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * Callbacks at specific points in the future are handled by the
+ * timeouts in timeout.c, with a resolution of one hardclock. Timed
+ * sleeps are built on those.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -51,13 +54,30 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Threads in clocksleep_ticks wait on one of these wait channels,
+ * picked by hashing the address of their struct clocksleeper, until
+ * their timeout goes off. Hashing keeps each wakeup from waking
+ * every sleeper in the system.
  */
-static struct wchan *lbolt;
-static struct spinlock lbolt_lock;
+#define CLOCK_NSLEEPQ	16
+static struct wchan *clock_sleepq[CLOCK_NSLEEPQ];
+static struct spinlock clock_sleeplock;
+
+struct clocksleeper {
+	struct timeout cs_timeout;
+	bool cs_done;
+};
+
+static
+struct wchan *
+clock_sleepq_for(struct clocksleeper *cs)
+{
+	vaddr_t a = (vaddr_t)cs >> 4;
+
+	return clock_sleepq[(a ^ (a >> 7) ^ (a >> 13)) % CLOCK_NSLEEPQ];
+}
 
 /*
  * Setup.
@@ -65,24 +85,25 @@ static struct spinlock lbolt_lock;
 void
 hardclock_bootstrap(void)
 {
-	spinlock_init(&lbolt_lock);
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	unsigned i;
+
+	spinlock_init(&clock_sleeplock);
+	for (i=0; i<CLOCK_NSLEEPQ; i++) {
+		clock_sleepq[i] = wchan_create("clocksleep");
+		if (clock_sleepq[i] == NULL) {
+			panic("Couldn't create clocksleep wchans\n");
+		}
 	}
 }
 
 /*
  * This is called once per second, on one processor, by the timer
- * code.
+ * code. Timed waits go through the timer wheels now, so there's
+ * nothing to do.
  */
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
-	spinlock_acquire(&lbolt_lock);
-	wchan_wakeall(lbolt, &lbolt_lock);
-	spinlock_release(&lbolt_lock);
 }
 
 /*
@@ -97,13 +118,107 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
-	}
+	timerwheel_tick();
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	thread_tick();
+}
+
+/*
+ * Count TICKS hardclocks that didn't happen while the cpu was idle.
+ * Nothing else needs doing for them: the cpu had nothing to schedule,
+ * and the next timerwheel_tick catches the wheel up.
+ */
+void
+hardclock_skipped(unsigned ticks)
+{
+	curcpu->c_hardclocks += ticks;
+}
+
+/*
+ * Idle until the next timeout on this cpu is due, or until an
+ * interrupt, without taking hardclocks in between. Called from the
+ * idle loop with interrupts off.
+ */
+void
+clock_idle(void)
+{
+	unsigned skipped;
+
+	skipped = mainbus_idle(timerwheel_nextdue());
+	if (skipped > 0) {
+		hardclock_skipped(skipped);
+		timerwheel_tick();
+	}
+}
+
+/*
+ * Timeout function for clocksleep_ticks.
+ */
+static
+void
+clocksleep_wakeup(void *vcs)
+{
+	struct clocksleeper *cs = vcs;
+	struct wchan *wc = clock_sleepq_for(cs);
+
+	spinlock_acquire(&clock_sleeplock);
+	cs->cs_done = true;
+	wchan_wakeall(wc, &clock_sleeplock);
+	spinlock_release(&clock_sleeplock);
+}
+
+/*
+ * Suspend execution for at least TICKS full hardclock periods, or
+ * with INTR until interrupted.
+ */
+static
+int
+clocksleep_common(unsigned ticks, bool intr)
+{
+	struct clocksleeper cs;
+	struct wchan *wc = clock_sleepq_for(&cs);
+	unsigned chunk;
+	int result = 0;
+
+	timeout_init(&cs.cs_timeout, clocksleep_wakeup, &cs);
+	while (ticks > 0 && result == 0) {
+		chunk = ticks < TIMEOUT_MAXTICKS ? ticks : TIMEOUT_MAXTICKS;
+		ticks -= chunk;
+
+		cs.cs_done = false;
+		spinlock_acquire(&clock_sleeplock);
+		timeout(&cs.cs_timeout, chunk);
+		while (!cs.cs_done && result == 0) {
+			if (intr) {
+				result = wchan_sleep_intr(wc, &clock_sleeplock);
+			}
+			else {
+				wchan_sleep(wc, &clock_sleeplock);
+			}
+		}
+		if (!cs.cs_done && !untimeout(&cs.cs_timeout)) {
+			/* It's firing; wait for it to finish with cs. */
+			while (!cs.cs_done) {
+				wchan_sleep(wc, &clock_sleeplock);
+			}
+		}
+		spinlock_release(&clock_sleeplock);
+	}
+	return result;
+}
+
+void
+clocksleep_ticks(unsigned ticks)
+{
+	clocksleep_common(ticks, false);
+}
+
+int
+clocksleep_ticks_intr(unsigned ticks)
+{
+	return clocksleep_common(ticks, true);
 }
 
 /*
@@ -112,10 +227,7 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	spinlock_acquire(&lbolt_lock);
-	while (num_secs > 0) {
-		wchan_sleep(lbolt, &lbolt_lock);
-		num_secs--;
+	if (num_secs > 0) {
+		clocksleep_ticks((unsigned)num_secs * HZ);
 	}
-	spinlock_release(&lbolt_lock);
 }
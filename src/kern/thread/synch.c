@@ -33,6 +33,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
@@ -40,6 +41,46 @@
 #include <current.h>
 #include <synch.h>
 #include <cpu.h>
+#include <kmem_cache.h>
+
+/*
+ * Semaphores, locks, and CVs come from object caches. While one is in
+ * the cache it keeps its wchan and spinlock; only the name is
+ * per-use. The wchan is renamed to match, and back to a constant
+ * before the name is freed.
+ */
+#define SYNCH_CACHE(type, wcfield, lkfield)				\
+	static								\
+	int								\
+	type##_ctor(void *obj)						\
+	{								\
+		struct type *p = obj;					\
+									\
+		p->wcfield = wchan_create(#type);			\
+		if (p->wcfield == NULL) {				\
+			return ENOMEM;					\
+		}							\
+		spinlock_init(&p->lkfield);				\
+		return 0;						\
+	}								\
+									\
+	static								\
+	void								\
+	type##_dtor(void *obj)						\
+	{								\
+		struct type *p = obj;					\
+									\
+		spinlock_cleanup(&p->lkfield);				\
+		wchan_destroy(p->wcfield);				\
+	}								\
+									\
+	static struct kmem_cache type##_cache =				\
+		KMEM_CACHE_INITIALIZER(#type, sizeof(struct type),	\
+				       type##_ctor, type##_dtor)
+
+SYNCH_CACHE(semaphore, sem_wchan, sem_lock);
+SYNCH_CACHE(lock, lock_wchan, lock_lock);
+SYNCH_CACHE(cv, cv_wchan, cv_lock);
 
 ////////////////////////////////////////////////////////////
 //
@@ -50,25 +91,18 @@ sem_create(const char *name, unsigned initial_count)
 {
         struct semaphore *sem;
 
-        sem = kmalloc(sizeof(*sem));
+        sem = kmem_cache_alloc(&semaphore_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+                kmem_cache_free(&semaphore_cache, sem);
                 return NULL;
         }
+	wchan_setname(sem->sem_wchan, sem->sem_name);
 
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
-	}
-
-	spinlock_init(&sem->sem_lock);
         sem->sem_count = initial_count;
 
         return sem;
@@ -79,11 +113,14 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
+	/* Nobody should be waiting on it */
+	spinlock_acquire(&sem->sem_lock);
+	KASSERT(wchan_isempty(sem->sem_wchan, &sem->sem_lock));
+	spinlock_release(&sem->sem_lock);
+
+	wchan_setname(sem->sem_wchan, "semaphore");
         kfree(sem->sem_name);
-        kfree(sem);
+        kmem_cache_free(&semaphore_cache, sem);
 }
 
 void
@@ -121,6 +158,28 @@ P(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+int
+P_intr(struct semaphore *sem)
+{
+	int result;
+
+	KASSERT(sem != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&sem->sem_lock);
+	while (sem->sem_count == 0) {
+		result = wchan_sleep_intr(sem->sem_wchan, &sem->sem_lock);
+		if (result) {
+			spinlock_release(&sem->sem_lock);
+			return result;
+		}
+	}
+	KASSERT(sem->sem_count > 0);
+	sem->sem_count--;
+	spinlock_release(&sem->sem_lock);
+	return 0;
+}
+
 void
 V(struct semaphore *sem)
 {
@@ -144,27 +203,22 @@ lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(*lock));
+        lock = kmem_cache_alloc(&lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(&lock_cache, lock);
                 return NULL;
         }
+	wchan_setname(lock->lock_wchan, lock->lk_name);
 
-	lock->lock_wchan = wchan_create(lock->lk_name);
-	if (lock->lock_wchan == NULL) {
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
-
-	spinlock_init(&lock->lock_lock);
-        lock->lock_count = 1;
-		lock->lock_holder = NULL;
+	lock->lock_holder = NULL;
+	lock->lock_acquires = 0;
+	lock->lock_contended = 0;
+	lock->lock_sleeps = 0;
         return lock;
 }
 
@@ -172,29 +226,73 @@ void
 lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
+	KASSERT(lock->lock_holder == NULL);
 
-        // add stuff here as needed
-    	spinlock_cleanup(&lock->lock_lock);
-	    wchan_destroy(lock->lock_wchan);
+	DEBUG(DB_THREADS, "lock %s: %u acquires, %u contended, %u slept\n",
+	      lock->lk_name, lock->lock_acquires, lock->lock_contended,
+	      lock->lock_sleeps);
 
+	wchan_setname(lock->lock_wchan, "lock");
         kfree(lock->lk_name);
-        kfree(lock);
+        kmem_cache_free(&lock_cache, lock);
+}
+
+/*
+ * How many times to poll a held lock before giving up and sleeping.
+ * This should be roughly the cost of the two context switches that
+ * sleeping and being woken up would take.
+ */
+#define LOCK_SPIN_MAX	1000
+
+/*
+ * Check if HOLDER is currently running on some other cpu, in which
+ * case it's worth spinning. This is done without any lock held;
+ * HOLDER may have released the lock and even exited by the time we
+ * look, but thread structures live in kseg0 so the read is harmless
+ * and at worst we spin or sleep once for nothing.
+ */
+static
+bool
+lock_holder_running(volatile struct thread *holder)
+{
+	return holder->t_state == S_RUN && holder->t_cpu != curcpu->c_self;
 }
 
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	unsigned spins;
+
         KASSERT(lock != NULL);
         KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(lock->lock_holder != curthread);
 
 	/* Use the lock spinlock to protect the wchan as well. */
 	spinlock_acquire(&lock->lock_lock);
-        while (lock->lock_count == 0) {
-		    wchan_sleep(lock->lock_wchan, &lock->lock_lock);
+	lock->lock_acquires++;
+	if (lock->lock_holder != NULL) {
+		lock->lock_contended++;
+	}
+	spins = 0;
+        while ((holder = lock->lock_holder) != NULL) {
+		if (spins < LOCK_SPIN_MAX && lock_holder_running(holder)) {
+			/* Spin with the spinlock dropped so it can release. */
+			spinlock_release(&lock->lock_lock);
+			while (lock->lock_holder == holder &&
+			       spins < LOCK_SPIN_MAX &&
+			       lock_holder_running(holder)) {
+				spins++;
+			}
+			spinlock_acquire(&lock->lock_lock);
+			continue;
+		}
+		lock->lock_sleeps++;
+		wchan_sleep(lock->lock_wchan, &lock->lock_lock);
+		/* Woken by a release; the holder changed, so spin anew. */
+		spins = 0;
         }
-        KASSERT(lock->lock_count > 0);
-        lock->lock_count--;
-		lock->lock_holder = curcpu->c_self;
+	lock->lock_holder = curthread;
 	spinlock_release(&lock->lock_lock);
 }
 
@@ -205,12 +303,8 @@ lock_release(struct lock *lock)
         KASSERT(lock_do_i_hold(lock));
 
 	spinlock_acquire(&lock->lock_lock);
-
-        lock->lock_count++;
-        KASSERT(lock->lock_count > 0);
-		lock->lock_holder = NULL;
+	lock->lock_holder = NULL;
 	wchan_wakeone(lock->lock_wchan, &lock->lock_lock);
-
 	spinlock_release(&lock->lock_lock);
 }
 
@@ -221,7 +315,7 @@ lock_do_i_hold(struct lock *lock)
 			return true;
 		}
 
-		return (lock->lock_holder == curcpu->c_self);
+	return (lock->lock_holder == curthread);
 }
 
 ////////////////////////////////////////////////////////////
@@ -234,25 +328,18 @@ cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(*cv));
+        cv = kmem_cache_alloc(&cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
+                kmem_cache_free(&cv_cache, cv);
                 return NULL;
         }
+	wchan_setname(cv->cv_wchan, cv->cv_name);
 
-    cv->cv_wchan = wchan_create(cv->cv_name);
-	if (cv->cv_wchan == NULL) {
-		kfree(cv->cv_name);
-		kfree(cv);
-		return NULL;
-	}
-
-	spinlock_init(&cv->cv_lock);
         cv->cv_count = 0;
 
         return cv;
@@ -263,158 +350,246 @@ cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
 
-    spinlock_cleanup(&cv->cv_lock);
-	wchan_destroy(cv->cv_wchan);
+	KASSERT(cv->cv_count == 0);
+
+	wchan_setname(cv->cv_wchan, "cv");
         kfree(cv->cv_name);
-        kfree(cv);
+        kmem_cache_free(&cv_cache, cv);
 }
 
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
-	//kprintf("Check if hold lock.\n");
-    KASSERT(lock_do_i_hold(lock));
-    spinlock_acquire(&cv->cv_lock);
+	KASSERT(lock_do_i_hold(lock));
+
+	/*
+	 * Hold the CV spinlock across releasing the lock and going to
+	 * sleep, so a signal in between can't be lost.
+	 */
+	spinlock_acquire(&cv->cv_lock);
+	lock_release(lock);
+	cv->cv_count++;
+	/* whoever moves us off cv_wchan takes us out of cv_count */
+	wchan_sleep(cv->cv_wchan, &cv->cv_lock);
+	spinlock_release(&cv->cv_lock);
+
+	lock_acquire(lock);
+}
+
+int
+cv_wait_intr(struct cv *cv, struct lock *lock)
+{
+	int result;
 
-    lock_release(lock);
-	//kprintf("Passed lock_do_i_hold. Checking acquire\n");
-    cv->cv_count++;
+	KASSERT(lock_do_i_hold(lock));
 
-	//kprintf("I'm sleeping.\n");
-    wchan_sleep(cv->cv_wchan, &cv->cv_lock);
-	//kprintf("I woke up.\n");
+	spinlock_acquire(&cv->cv_lock);
+	lock_release(lock);
+	cv->cv_count++;
+	result = wchan_sleep_intr(cv->cv_wchan, &cv->cv_lock);
+	if (result) {
+		/*
+		 * Either we never slept, or we were taken off cv_wchan
+		 * by thread_interrupt rather than moved by a signal;
+		 * both ways we're still counted.
+		 */
+		cv->cv_count--;
+	}
+	spinlock_release(&cv->cv_lock);
 
-    cv->cv_count--;
-    spinlock_release(&cv->cv_lock);
-    lock_acquire(lock);
+	lock_acquire(lock);
+	return result;
 }
 
+/*
+ * Since the caller holds LOCK, a waiter we woke up would only go back
+ * to sleep in lock_acquire until the caller lets go. So instead of
+ * waking waiters, move them straight onto the lock's wait channel and
+ * let lock_release wake them one at a time. This avoids both the
+ * wasted context switches and, for broadcast, the herd all fighting
+ * over the lock at once.
+ *
+ * Moved waiters come off cv_count here rather than when they run, so
+ * the CV can be destroyed as soon as nobody is left sleeping on it.
+ */
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-	KASSERT(lock_do_i_hold(lock)); 
-	lock_release(lock);
+	KASSERT(lock_do_i_hold(lock));
+
 	spinlock_acquire(&cv->cv_lock);
-	//kprintf("Signalling now.\n");
-	wchan_wakeone(cv->cv_wchan, &cv->cv_lock);
+	if (cv->cv_count > 0) {
+		spinlock_acquire(&lock->lock_lock);
+		cv->cv_count -= wchan_requeueone(cv->cv_wchan, &cv->cv_lock,
+						lock->lock_wchan,
+						&lock->lock_lock);
+		spinlock_release(&lock->lock_lock);
+	}
 	spinlock_release(&cv->cv_lock);
-	lock_acquire(lock);
-    
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-    //unsigned int i;
-    KASSERT(lock_do_i_hold(lock));
-    lock_release(lock);
+	KASSERT(lock_do_i_hold(lock));
 
-    spinlock_acquire(&cv->cv_lock);
-	wchan_wakeall(cv->cv_wchan, &cv->cv_lock);
-    
-	/*for(i = 0; i < cv->cv_count; i++) {
-        wchan_wakeone(cv->cv_wchan, &cv->cv_lock);
-    }*/
+	spinlock_acquire(&cv->cv_lock);
+	if (cv->cv_count > 0) {
+		spinlock_acquire(&lock->lock_lock);
+		cv->cv_count -= wchan_requeueall(cv->cv_wchan, &cv->cv_lock,
+						lock->lock_wchan,
+						&lock->lock_lock);
+		spinlock_release(&lock->lock_lock);
+	}
+	spinlock_release(&cv->cv_lock);
+}
 
-    spinlock_release(&cv->cv_lock);
 
-    lock_acquire(lock);
-}
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
 
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rwlock;
 
-struct rwlock* rwlock_create(const char *name) {
-        struct rwlock* rwlock;
+	rwlock = kmalloc(sizeof(*rwlock));
+	if (rwlock == NULL) {
+		return NULL;
+	}
 
-        rwlock = kmalloc(sizeof(*rwlock));
-        if (rwlock == NULL) {
-                return NULL;
-        }
+	rwlock->rwlk_name = kstrdup(name);
+	if (rwlock->rwlk_name == NULL) {
+		kfree(rwlock);
+		return NULL;
+	}
 
-        rwlock->rwlk_name = kstrdup(name);
-        if (rwlock->rwlk_name == NULL) {
-                kfree(rwlock);
-                return NULL;
-        }
+	rwlock->rwlock_rwchan = wchan_create(rwlock->rwlk_name);
+	if (rwlock->rwlock_rwchan == NULL) {
+		kfree(rwlock->rwlk_name);
+		kfree(rwlock);
+		return NULL;
+	}
 
-	rwlock->rwlock_wchan = wchan_create(rwlock->rwlk_name);
-	if (rwlock->rwlock_wchan == NULL) {
+	rwlock->rwlock_wwchan = wchan_create(rwlock->rwlk_name);
+	if (rwlock->rwlock_wwchan == NULL) {
+		wchan_destroy(rwlock->rwlock_rwchan);
 		kfree(rwlock->rwlk_name);
 		kfree(rwlock);
 		return NULL;
 	}
 
-	    spinlock_init(&rwlock->rwlock_lock);
-        rwlock->reader_count =0;
-        rwlock->writer_in = false;
-        rwlock->writer_waiting = 0;
-        rwlock->writer_holder = NULL;
-        memset(rwlock->reader_holders, 0x0, sizeof(struct cpu) * 1000);
-        return rwlock;
+	spinlock_init(&rwlock->rwlock_lock);
+	rwlock->rwlock_readers = 0;
+	rwlock->rwlock_writer = NULL;
+	rwlock->rwlock_rwaiting = 0;
+	rwlock->rwlock_rgen = 0;
+	rwlock->rwlock_wwaiting = 0;
+	return rwlock;
 }
 
-void rwlock_destroy(struct rwlock *rwlock)
+void
+rwlock_destroy(struct rwlock *rwlock)
 {
-        KASSERT(rwlock != NULL);
+	KASSERT(rwlock != NULL);
+	KASSERT(rwlock->rwlock_readers == 0);
+	KASSERT(rwlock->rwlock_writer == NULL);
 
-        // add stuff here as needed
-    	spinlock_cleanup(&rwlock->rwlock_lock);
-	    wchan_destroy(rwlock->rwlock_wchan);
+	spinlock_cleanup(&rwlock->rwlock_lock);
+	wchan_destroy(rwlock->rwlock_wwchan);
+	wchan_destroy(rwlock->rwlock_rwchan);
 
-        kfree(rwlock->rwlk_name);
-        kfree(rwlock);
-}
-void rwlock_acquire(struct rwlock* rwlock, int mode) {
-    int i;
-    if(mode == READ) {
-        spinlock_acquire(&rwlock->rwlock_lock);
-        while(rwlock->writer_in || (rwlock->writer_waiting != 0 && rwlock->reader_count != 0)) {
-            wchan_sleep(rwlock->rwlock_wchan, &rwlock->rwlock_lock);
-        }
-        rwlock->reader_count++;
-        for(i = 0; rwlock->reader_holders[i] != NULL; i++) {}
-        rwlock->reader_holders[i] = curcpu->c_self;
-        spinlock_release(&rwlock->rwlock_lock);
-    } else if(mode == WRITE) {
-        spinlock_acquire(&rwlock->rwlock_lock);
-        rwlock->writer_waiting++;
-        while(rwlock->reader_count != 0 || rwlock->writer_in) {
-            wchan_sleep(rwlock->rwlock_wchan, &rwlock->rwlock_lock);
-        }
-        rwlock->writer_in = true;
-        rwlock->writer_waiting--;
-        rwlock->writer_holder = curcpu->c_self;
-        spinlock_release(&rwlock->rwlock_lock);
-    } else {
-        kprintf("Improper mode!!!!!\n");
-    }
+	kfree(rwlock->rwlk_name);
+	kfree(rwlock);
 }
-void rwlock_release(struct rwlock* rwlock, int mode) {
-    bool match = false;
-    int i;
-    KASSERT(rwlock != NULL);
+
+void
+rwlock_acquire(struct rwlock *rwlock, int mode)
+{
+	unsigned gen;
+
+	KASSERT(rwlock != NULL);
+	KASSERT(mode == READ || mode == WRITE);
+	KASSERT(curthread->t_in_interrupt == false);
 
 	spinlock_acquire(&rwlock->rwlock_lock);
-    if(mode == READ) {
-        for (i = 0; i < 1000; i++) {
-            if(rwlock->reader_holders[i] == curcpu->c_self) {
-                match = true;
-                break;
-            }
-        }
-        KASSERT(match);
-        rwlock->reader_holders[i] = NULL;
-        rwlock->reader_count--;
-    } else if(mode == WRITE) {
-        KASSERT(rwlock->writer_holder == curcpu->c_self);
-        rwlock->writer_holder = NULL;
-        rwlock->writer_in = false;
-    } else {
-        kprintf("Improper mode!!!!!\n");
-    }
-
-	wchan_wakeall(rwlock->rwlock_wchan, &rwlock->rwlock_lock);
+	KASSERT(rwlock->rwlock_writer != curthread);
+	if (mode == READ) {
+		if (rwlock->rwlock_writer != NULL ||
+		    rwlock->rwlock_wwaiting > 0) {
+			/*
+			 * Wait for a writer to let our batch in. It
+			 * counts us in rwlock_readers on our behalf.
+			 */
+			gen = rwlock->rwlock_rgen;
+			rwlock->rwlock_rwaiting++;
+			while (rwlock->rwlock_rgen == gen) {
+				wchan_sleep(rwlock->rwlock_rwchan,
+					    &rwlock->rwlock_lock);
+			}
+		}
+		else {
+			rwlock->rwlock_readers++;
+		}
+	}
+	else {
+		while (rwlock->rwlock_writer != NULL ||
+		       rwlock->rwlock_readers > 0) {
+			rwlock->rwlock_wwaiting++;
+			wchan_sleep(rwlock->rwlock_wwchan,
+				    &rwlock->rwlock_lock);
+			rwlock->rwlock_wwaiting--;
+		}
+		rwlock->rwlock_writer = curthread;
+	}
 	spinlock_release(&rwlock->rwlock_lock);
 }
 
+void
+rwlock_release(struct rwlock *rwlock, int mode)
+{
+	KASSERT(rwlock != NULL);
+	KASSERT(mode == READ || mode == WRITE);
 
+	spinlock_acquire(&rwlock->rwlock_lock);
+	if (mode == READ) {
+		KASSERT(rwlock->rwlock_readers > 0);
+		rwlock->rwlock_readers--;
+		if (rwlock->rwlock_readers == 0) {
+			wchan_wakeone(rwlock->rwlock_wwchan,
+				      &rwlock->rwlock_lock);
+		}
+	}
+	else {
+		KASSERT(rwlock->rwlock_writer == curthread);
+		rwlock->rwlock_writer = NULL;
+		/*
+		 * Let the readers that queued up behind us in first, so
+		 * a stream of writers can't starve them either. They
+		 * hold off any further writers until they're done.
+		 */
+		if (rwlock->rwlock_rwaiting > 0) {
+			rwlock->rwlock_readers += rwlock->rwlock_rwaiting;
+			rwlock->rwlock_rwaiting = 0;
+			rwlock->rwlock_rgen++;
+			wchan_wakeall(rwlock->rwlock_rwchan,
+				      &rwlock->rwlock_lock);
+		}
+		else {
+			wchan_wakeone(rwlock->rwlock_wwchan,
+				      &rwlock->rwlock_lock);
+		}
+	}
+	spinlock_release(&rwlock->rwlock_lock);
+}
 
+bool
+rwlock_do_i_hold(struct rwlock *rwlock)
+{
+	if (!CURCPU_EXISTS()) {
+		return true;
+	}
+	return rwlock->rwlock_writer == curthread ||
+		rwlock->rwlock_readers > 0;
+}
@@ -37,9 +37,11 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <kmem_cache.h>
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <atomic.h>
 #include <wchan.h>
 #include <thread.h>
 #include <threadlist.h>
@@ -49,9 +51,11 @@
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
+#include <clock.h>
 #include <vnode.h>
 #include <limits.h>
 #include <proc_array.h>
+#include "opt-mlfq.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -71,6 +75,10 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Load balancing; see "Thread migration" below. */
+static bool thread_steal(void);
+static void thread_kick_idle(struct cpu *busy);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -110,9 +118,84 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Per-cpu cache of dead threads.
+ *
+ * Instead of freeing a dead thread and its stack, thread_destroy puts
+ * it here (up to THREAD_CACHE_MAX per cpu) and thread_create takes it
+ * back out, saving three kmallocs and kfrees per fork. The stack
+ * magic only needs to be set up when a stack is first allocated; a
+ * recycled stack is checked instead.
+ *
+ * Each cpu only touches its own cache, with interrupts off, so no
+ * lock is needed.
+ */
+#define THREAD_CACHE_MAX	16
+
+static
+struct thread *
+thread_cache_get(void)
+{
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	splx(spl);
+	return thread;
+}
+
+/*
+ * Cache THREAD if there's room; otherwise free it.
+ */
+static
+void
+thread_cache_put(struct thread *thread)
+{
+	int spl;
+
+	if (thread->t_stack != NULL && CURCPU_EXISTS()) {
+		thread_checkstack(thread);
+		spl = splhigh();
+		if (curcpu->c_threadcache.tl_count < THREAD_CACHE_MAX) {
+			threadlist_addhead(&curcpu->c_threadcache, thread);
+			splx(spl);
+			return;
+		}
+		splx(spl);
+	}
+
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
+	kfree(thread);
+}
+
+/*
+ * Set a thread's name, using the inline buffer if it fits.
+ */
+static
+int
+thread_setname(struct thread *thread, const char *name)
+{
+	if (strlen(name) < sizeof(thread->t_namebuf)) {
+		strcpy(thread->t_namebuf, name);
+		thread->t_name = thread->t_namebuf;
+		return 0;
+	}
+	thread->t_name = kstrdup(name);
+	if (thread->t_name == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
+ *
+ * The thread may come from the cache, in which case it already has a
+ * stack.
  */
 static
 struct thread *
@@ -122,14 +205,20 @@ thread_create(const char *name)
 	
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = NULL;
+	if (CURCPU_EXISTS()) {
+		thread = thread_cache_get();
+	}
 	if (thread == NULL) {
-		return NULL;
+		thread = kmalloc(sizeof(*thread));
+		if (thread == NULL) {
+			return NULL;
+		}
+		thread->t_stack = NULL;
 	}
 
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
-		kfree(thread);
+	if (thread_setname(thread, name)) {
+		thread_cache_put(thread);
 		return NULL;
 	}
 
@@ -139,10 +228,20 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_uthread = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_lastrun = 0;
+	thread->t_inboxnext = NULL;
+	thread->t_intrwc = NULL;
+	thread->t_intrlk = NULL;
+	thread->t_intrnext = NULL;
+	thread->t_intrbusy = false;
+	thread->t_intrseen = false;
+	thread->t_intrwoken = false;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -169,6 +268,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -180,12 +280,19 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadcache);
 	c->c_hardclocks = 0;
+	c->c_idleticks = 0;
 	c->c_spinlocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<CPU_NRUNQUEUES; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runqueue_count = 0;
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_inbox = NULL;
+	timerwheel_init(&c->c_timerwheel);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -212,7 +319,7 @@ cpu_create(unsigned hardware_number)
 		 */
 		/*c->c_curthread->t_stack = ... */
 	}
-	else {
+	else if (c->c_curthread->t_stack == NULL) {
 		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
@@ -275,17 +382,19 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread->t_name);
-	kfree(thread);
+	if (thread->t_name != thread->t_namebuf) {
+		kfree(thread->t_name);
+	}
+	thread->t_name = NULL;
+
+	/* This keeps the stack for reuse, or frees it. */
+	thread_cache_put(thread);
 }
 
 /*
@@ -315,6 +424,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -329,9 +440,15 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<CPU_NRUNQUEUES; i++) {
+		struct threadlist *rq = &curcpu->c_runqueue[i];
+
+		rq->tl_count = 0;
+		rq->tl_head.tln_next = &rq->tl_tail;
+		rq->tl_tail.tln_prev = &rq->tl_head;
+	}
+	curcpu->c_runqueue_count = 0;
+	curcpu->c_inbox = NULL;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -443,6 +560,83 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue manipulation. The caller must hold the cpu's run queue
+ * lock. Threads are queued at the level given by t_priority; without
+ * options mlfq that is always 0, so there is only one queue in use
+ * and this degenerates to plain round-robin.
+ */
+static
+void
+thread_runq_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < CPU_NRUNQUEUES);
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	c->c_runqueue_count++;
+}
+
+/*
+ * Take the next thread to run: the head of the highest-priority
+ * nonempty queue.
+ */
+static
+struct thread *
+thread_runq_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	if (c->c_runqueue_count == 0) {
+		return NULL;
+	}
+	for (i=0; i<CPU_NRUNQUEUES; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runqueue_count--;
+			return t;
+		}
+	}
+	panic("cpu%u: run queue count is %u but queues are empty\n",
+	      c->c_number, c->c_runqueue_count);
+}
+
+/*
+ * Put TARGET on the run queue of cpu C, whose run queue lock must be
+ * held. Returns true if it's new work for C (rather than curthread
+ * yielding).
+ */
+static
+bool
+thread_make_ready(struct cpu *c, struct thread *target)
+{
+	bool newwork;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+#if OPT_MLFQ
+	/*
+	 * A thread that is waking up blocked before using up its time
+	 * slice; treat it as interactive and move it up a level.
+	 */
+	if (target->t_state == S_SLEEP) {
+		if (target->t_priority > 0) {
+			target->t_priority--;
+		}
+		target->t_ticks = 0;
+	}
+#endif
+
+	/*
+	 * Target thread is now ready to run; put it on the run queue.
+	 * It's new work (rather than curthread yielding) unless it was
+	 * running.
+	 */
+	newwork = target->t_state != S_RUN;
+	target->t_state = S_READY;
+	thread_runq_add(c, target);
+	return newwork;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -453,6 +647,7 @@ void
 thread_make_runnable(struct thread *target, bool already_have_lock)
 {
 	struct cpu *targetcpu;
+	bool newwork;
 
 	/* Lock the run queue of the target thread's cpu. */
 	targetcpu = target->t_cpu;
@@ -465,9 +660,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
-	/* Target thread is now ready to run; put it on the run queue. */
-	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	newwork = thread_make_ready(targetcpu, target);
 
 	if (targetcpu->c_isidle) {
 		/*
@@ -476,12 +669,130 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (newwork) {
+		/*
+		 * It's busy; if some other processor is idle, poke it
+		 * so it comes and steals the work.
+		 */
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
 	}
 }
 
+/*
+ * Wake up TARGET, which was sleeping, as part of a wakeup that may
+ * wake several threads.
+ *
+ * If TARGET belongs to another cpu, it goes on that cpu's inbox
+ * rather than its run queue, so we don't take (or fight over) the
+ * other cpu's run queue lock. If that cpu is idle, its number is
+ * added to *KICK, a cpu mask; once all the threads are woken the
+ * caller passes the mask to thread_kick, so each idle cpu gets one
+ * interrupt no matter how many threads it was sent.
+ *
+ * We check c_isidle after the push, and the idle loop checks the
+ * inbox after setting c_isidle, so one side or the other always
+ * notices.
+ */
+static
+void
+thread_wakeup(struct thread *target, uint32_t *kick)
+{
+	struct cpu *c;
+	struct thread *head;
+
+	c = target->t_cpu;
+	if (!CURCPU_EXISTS() || c == curcpu->c_self || c->c_number >= 32) {
+		thread_make_runnable(target, false);
+		return;
+	}
+
+	do {
+		head = c->c_inbox;
+		target->t_inboxnext = head;
+	} while (!atomic_cas_ptr((void *volatile *)&c->c_inbox,
+				 head, target));
+
+	if (c->c_isidle) {
+		*kick |= (uint32_t)1 << c->c_number;
+	}
+}
+
+/*
+ * Send IPI_UNIDLE to each cpu in the mask KICK.
+ */
+static
+void
+thread_kick(uint32_t kick)
+{
+	unsigned i, numcpus;
+	struct cpu *c;
+
+	if (kick == 0) {
+		return;
+	}
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c->c_number < 32 &&
+		    (kick & ((uint32_t)1 << c->c_number)) != 0) {
+			ipi_send(c, IPI_UNIDLE);
+		}
+	}
+}
+
+/*
+ * Move the threads other cpus have woken for us from our inbox onto
+ * the run queue, in the order they were woken. The run queue lock
+ * must be held.
+ *
+ * Until this runs they aren't on any run queue, so nobody can steal
+ * them; and their t_state is still whatever it was when they went
+ * to sleep, which we might not have finished recording when they
+ * were pushed. Both are sorted out here.
+ */
+static
+void
+thread_inbox_drain(void)
+{
+	struct cpu *c = curcpu->c_self;
+	struct thread *t, *next, *fifo;
+	bool newwork;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (c->c_inbox == NULL) {
+		return;
+	}
+	t = atomic_swap_ptr((void *volatile *)&c->c_inbox, NULL);
+
+	/* The inbox is a stack, newest first; reverse it. */
+	fifo = NULL;
+	while (t != NULL) {
+		next = t->t_inboxnext;
+		t->t_inboxnext = fifo;
+		fifo = t;
+		t = next;
+	}
+
+	newwork = false;
+	while (fifo != NULL) {
+		t = fifo;
+		fifo = t->t_inboxnext;
+		t->t_inboxnext = NULL;
+		KASSERT(t->t_cpu == c);
+		newwork = thread_make_ready(c, t) || newwork;
+	}
+
+	if (newwork && !c->c_isidle) {
+		/* As in thread_make_runnable. */
+		thread_kick_idle(c);
+	}
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -509,13 +820,15 @@ thread_fork(const char *name,
 	}
 	//kprintf("done with thread_create\n");
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	/* Allocate a stack, unless we got a recycled thread with one */
 	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 	//kprintf("init stack\n");
 
 	/*
@@ -605,11 +918,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
-	/* Lock the run queue. */
+	/* Lock the run queue, and collect any remote wakeups. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
+	thread_inbox_drain();
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runqueue_count == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -641,9 +955,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		break;
 	}
 	cur->t_state = newstate;
+	cur->t_lastrun = curcpu->c_hardclocks;
 
 	/*
-	 * Get the next thread. While there isn't one, call cpu_idle().
+	 * Get the next thread. While there isn't one, try to steal one
+	 * from another cpu, and if that fails call clock_idle(), which
+	 * is cpu_idle() with the clock stopped until the next timeout.
 	 * curcpu->c_isidle must be true when cpu_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -661,11 +978,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+	membar_any_any();
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		thread_inbox_drain();
+		next = thread_runq_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				clock_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -804,10 +1125,12 @@ thread_exit(void)
 	cur = curthread;
 
 	/*
-	 * Detach from our process. You might need to move this action
-	 * around, depending on how your wait/exit works.
+	 * Detach from our process. User processes have already done
+	 * this in proc_exit, before their parent could reap them.
 	 */
-	proc_remthread(cur);
+	if (cur->t_proc != NULL) {
+		proc_remthread(cur);
+	}
 
 	/* Make sure we *are* detached (move this only if you're sure!) */
 	KASSERT(cur->t_proc == NULL);
@@ -835,81 +1158,157 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Without options mlfq, threads run in round-robin fashion: every
+ * hardclock the current thread goes to the back of the single run
+ * queue.
+ *
+ * With options mlfq, there are CPU_NRUNQUEUES levels. A thread gets a
+ * time slice of MLFQ_QUANTUM(level) hardclocks; if it uses the whole
+ * slice it drops a level, and if it blocks and is woken up it rises a
+ * level (see thread_make_runnable). Threads at a higher level always
+ * run first. To keep CPU-bound threads from starving, schedule()
+ * periodically ages every queued thread up one level.
+ */
+
+#if OPT_MLFQ
+/* Time slice, in hardclocks, at each level: 1, 2, 4, 8. */
+#define MLFQ_QUANTUM(level) (1U << (level))
+
+/* How often, in hardclocks, schedule() ages the run queues. */
+#define MLFQ_AGE_HARDCLOCKS 48
+#endif
+
+/*
+ * Called from hardclock() on every tick to charge it to curthread.
  */
+void
+thread_tick(void)
+{
+#if OPT_MLFQ
+	struct thread *cur = curthread;
+	bool yield;
+	unsigned i;
+
+	if (curcpu->c_isidle) {
+		return;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	thread_inbox_drain();
+	cur->t_ticks++;
+	if (cur->t_ticks >= MLFQ_QUANTUM(cur->t_priority)) {
+		/* Used its whole slice: demote. */
+		if (cur->t_priority < CPU_NRUNQUEUES - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		yield = true;
+	}
+	else {
+		/* Otherwise only give way to something more important. */
+		yield = false;
+		for (i=0; i<cur->t_priority; i++) {
+			if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+				yield = true;
+				break;
+			}
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (yield) {
+		thread_yield();
+	}
+#else
+	thread_yield();
+#endif
+}
 
+/*
+ * This is called periodically from hardclock(). It reshuffles the
+ * current CPU's run queue by job priority.
+ */
 void
 schedule(void)
 {
+#if OPT_MLFQ
+	struct thread *t;
+	unsigned i;
+
+	if (curcpu->c_hardclocks % MLFQ_AGE_HARDCLOCKS != 0) {
+		return;
+	}
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * Move everything up one level, preserving order within each
+	 * level. Going from the top down means each thread moves once.
 	 */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<CPU_NRUNQUEUES; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+		       != NULL) {
+			t->t_priority = i - 1;
+			t->t_ticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[i - 1], t);
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+#endif
 }
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Load is balanced by work stealing: a cpu that runs out of work
+ * takes a thread from the busiest other cpu before going idle (see
+ * thread_switch), and a cpu that gets new work while it's busy pokes
+ * an idle peer to come and take it (see thread_make_runnable). An
+ * idle cpu also retries whenever it takes an interrupt, so at worst
+ * it notices queued work on the next hardclock.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * which is fairly slow. So a thread that ran within the last
+ * STEAL_HOT_HARDCLOCKS ticks is left where it is unless its cpu has
+ * at least STEAL_HOT_BACKLOG threads waiting.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * The run queue counts are read without holding the run queue locks.
+ * They're only hints for picking a victim; the actual theft happens
+ * with the victim's lock held.
  */
-void
-thread_consider_migration(void)
-{
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
-
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
+#define STEAL_HOT_HARDCLOCKS	2
+#define STEAL_HOT_BACKLOG	2
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
-	}
+/*
+ * Check if T probably still has cache state on cpu C. The hardclock
+ * counters of different cpus aren't synchronized, but they tick at
+ * the same rate, which is close enough for a hint.
+ */
+static
+bool
+thread_cache_hot(struct cpu *c, struct thread *t)
+{
+	return c->c_hardclocks - t->t_lastrun < STEAL_HOT_HARDCLOCKS;
+}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
-	spinlock_release(&curcpu->c_runqueue_lock);
+/*
+ * Pick a thread to steal from cpu C, whose run queue lock must be
+ * held, and take it off C's run queue. Prefers the thread that would
+ * run last on C.
+ */
+static
+struct thread *
+thread_steal_from(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+	bool allowhot;
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
+	allowhot = c->c_runqueue_count >= STEAL_HOT_BACKLOG;
+	for (i=CPU_NRUNQUEUES; i-- > 0; ) {
+		THREADLIST_FORALL_REV(t, c->c_runqueue[i]) {
 			/*
-			 * Ordinarily, curthread will not appear on
+			 * Ordinarily, C's curthread will not appear on
 			 * the run queue. However, it can under the
 			 * following circumstances:
 			 *   - it went to sleep;
@@ -920,54 +1319,95 @@ thread_consider_migration(void)
 			 *   - and the processor hasn't fully unidled
 			 *     yet, so all these things are still true.
 			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
+			 * Migrating it then would be bad, so skip it.
 			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
+			if (t == c->c_curthread) {
 				continue;
 			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
+			if (!allowhot && thread_cache_hot(c, t)) {
+				continue;
 			}
+			threadlist_remove(&c->c_runqueue[i], t);
+			c->c_runqueue_count--;
+			return t;
 		}
-		spinlock_release(&c->c_runqueue_lock);
+	}
+	return NULL;
+}
+
+/*
+ * Called by a cpu that has nothing to run, with no spinlocks held.
+ * Move a thread from the busiest other cpu onto our run queue.
+ * Returns true if we got one.
+ */
+static
+bool
+thread_steal(void)
+{
+	unsigned i, numcpus, count, best;
+	struct cpu *c, *victim;
+	struct thread *t;
+
+	victim = NULL;
+	best = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		count = c->c_runqueue_count;
+		if (count > best) {
+			best = count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = thread_steal_from(victim);
+	spinlock_release(&victim->c_runqueue_lock);
+	if (t == NULL) {
+		return false;
 	}
 
 	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
+	 * Nobody else touches a ready thread that's on no run queue,
+	 * so it's safe to move it across without holding both locks.
 	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	t->t_cpu = curcpu->c_self;
+	thread_runq_add(curcpu, t);
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	return true;
+}
+
+/*
+ * Cpu BUSY just got more work. If another cpu is idle, send it an
+ * interrupt so it wakes up and steals it. The idle flags are read
+ * without locking; a stale answer just costs a wasted interrupt or a
+ * tick's delay.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	unsigned i, numcpus;
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
 	}
-
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
 }
 
 ////////////////////////////////////////////////////////////
@@ -976,6 +1416,33 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Wait channels come from an object cache; the thread list stays
+ * initialized while a wchan sits in the cache.
+ */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_init(&wc->wc_threads);
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_cleanup(&wc->wc_threads);
+}
+
+static struct kmem_cache wchan_cache =
+	KMEM_CACHE_INITIALIZER("wchan", sizeof(struct wchan),
+			       wchan_ctor, wchan_dtor);
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -989,16 +1456,24 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 
 	return wc;
 }
 
+/*
+ * Change a wait channel's name.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
+}
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  * (The corresponding cleanup functions require this.)
@@ -1006,8 +1481,9 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	wc->wc_name = "DESTROYED";
+	kmem_cache_free(&wchan_cache, wc);
 }
 
 /*
@@ -1033,6 +1509,129 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(lk);
 }
 
+/*
+ * Interruptible sleeps.
+ *
+ * A thread in wchan_sleep_intr sits on intr_sleepers along with the
+ * channel and spinlock it sleeps on, so thread_interrupt can find it
+ * and take it off that channel. Sleepers take the channel's spinlock
+ * before intr_lock, so the interrupter can't hold intr_lock while it
+ * takes the channel's. Instead it marks the sleeper t_intrbusy and
+ * lets go; the sleeper doesn't return until that clears, so the
+ * channel can't go away in the meantime.
+ *
+ * Whether to interrupt is decided by p_exiting, which is read here
+ * without proc_Lock. That's safe because proc_setexit sets it before
+ * calling thread_interrupt, which takes intr_lock: either the sleeper
+ * sees it when it checks, or thread_interrupt sees the sleeper.
+ */
+static struct spinlock intr_lock = SPINLOCK_INITIALIZER;
+static struct thread *intr_sleepers;
+
+static
+bool
+thread_intr_pending(struct thread *t)
+{
+	return t->t_proc != NULL && t->t_proc->p_exiting;
+}
+
+int
+wchan_sleep_intr(struct wchan *wc, struct spinlock *lk)
+{
+	struct thread *cur = curthread;
+	struct thread **tp;
+	bool woken;
+
+	KASSERT(!cur->t_in_interrupt);
+	KASSERT(spinlock_do_i_hold(lk));
+	KASSERT(curcpu->c_spinlocks == 1);
+
+	spinlock_acquire(&intr_lock);
+	if (thread_intr_pending(cur)) {
+		spinlock_release(&intr_lock);
+		return EINTR;
+	}
+	cur->t_intrwc = wc;
+	cur->t_intrlk = lk;
+	cur->t_intrnext = intr_sleepers;
+	intr_sleepers = cur;
+	spinlock_release(&intr_lock);
+
+	thread_switch(S_SLEEP, wc, lk);
+
+	/* Get off the list, once any interrupter is done with wc. */
+	spinlock_acquire(&intr_lock);
+	while (cur->t_intrbusy) {
+		spinlock_release(&intr_lock);
+		thread_yield();
+		spinlock_acquire(&intr_lock);
+	}
+	for (tp = &intr_sleepers; *tp != cur; tp = &(*tp)->t_intrnext) {
+		KASSERT(*tp != NULL);
+	}
+	*tp = cur->t_intrnext;
+	cur->t_intrnext = NULL;
+	cur->t_intrwc = NULL;
+	cur->t_intrlk = NULL;
+	cur->t_intrseen = false;
+	woken = cur->t_intrwoken;
+	cur->t_intrwoken = false;
+	spinlock_release(&intr_lock);
+
+	spinlock_acquire(lk);
+	return woken ? EINTR : 0;
+}
+
+void
+thread_interrupt(struct proc *proc)
+{
+	struct thread *t, *t2;
+	struct wchan *wc;
+	struct spinlock *lk;
+	uint32_t kick;
+	bool found;
+
+	spinlock_acquire(&intr_lock);
+ again:
+	for (t = intr_sleepers; t != NULL; t = t->t_intrnext) {
+		if (t->t_proc != proc || t->t_intrseen) {
+			continue;
+		}
+		t->t_intrbusy = true;
+		t->t_intrseen = true;
+		wc = t->t_intrwc;
+		lk = t->t_intrlk;
+		spinlock_release(&intr_lock);
+
+		/*
+		 * It may already have been woken, or moved to another
+		 * channel (by cv_signal), in which case leave it be.
+		 */
+		spinlock_acquire(lk);
+		found = false;
+		THREADLIST_FORALL(t2, wc->wc_threads) {
+			if (t2 == t) {
+				found = true;
+				break;
+			}
+		}
+		if (found) {
+			threadlist_remove(&wc->wc_threads, t);
+			kick = 0;
+			thread_wakeup(t, &kick);
+			thread_kick(kick);
+		}
+		spinlock_release(lk);
+
+		spinlock_acquire(&intr_lock);
+		t->t_intrwoken = found;
+		t->t_intrbusy = false;
+		/* the list may have changed while we weren't looking */
+		goto again;
+	}
+	spinlock_release(&intr_lock);
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1040,6 +1639,7 @@ void
 wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *target;
+	uint32_t kick;
 
 	KASSERT(spinlock_do_i_hold(lk));
 
@@ -1052,14 +1652,16 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	}
 
 	/*
-	 * Note that thread_make_runnable acquires a runqueue lock
+	 * Note that thread_wakeup may acquire a runqueue lock
 	 * while we're holding LK. This is ok; all spinlocks
 	 * associated with wchans must come before the runqueue locks,
 	 * as we also bridge from the wchan lock to the runqueue lock
 	 * in thread_switch.
 	 */
 
-	thread_make_runnable(target, false);
+	kick = 0;
+	thread_wakeup(target, &kick);
+	thread_kick(kick);
 }
 
 /*
@@ -1070,6 +1672,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *target;
 	struct threadlist list;
+	uint32_t kick;
 
 	KASSERT(spinlock_do_i_hold(lk));
 
@@ -1084,17 +1687,60 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	}
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Make each thread runnable. Threads for other cpus go in
+	 * their inboxes without locking, and each idle cpu gets one
+	 * IPI at the end however many threads it was sent.
 	 */
+	kick = 0;
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		thread_wakeup(target, &kick);
 	}
+	thread_kick(kick);
 
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Move sleeping threads from one wait channel to another. A sleeping
+ * thread doesn't care which channel it's on; it just waits to be made
+ * runnable. Only the name shown in the debugger needs updating.
+ */
+static
+unsigned
+wchan_requeue(struct wchan *from, struct spinlock *fromlk,
+	      struct wchan *to, struct spinlock *tolk, bool all)
+{
+	struct thread *target;
+	unsigned moved = 0;
+
+	KASSERT(spinlock_do_i_hold(fromlk));
+	KASSERT(spinlock_do_i_hold(tolk));
+
+	while ((target = threadlist_remhead(&from->wc_threads)) != NULL) {
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+		moved++;
+		if (!all) {
+			break;
+		}
+	}
+	return moved;
+}
+
+unsigned
+wchan_requeueone(struct wchan *from, struct spinlock *fromlk,
+		 struct wchan *to, struct spinlock *tolk)
+{
+	return wchan_requeue(from, fromlk, to, tolk, false);
+}
+
+unsigned
+wchan_requeueall(struct wchan *from, struct spinlock *fromlk,
+		 struct wchan *to, struct spinlock *tolk)
+{
+	return wchan_requeue(from, fromlk, to, tolk, true);
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Timeouts and the per-cpu timer wheel. See <timeout.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <current.h>
+#include <timeout.h>
+
+#define TW_ROOTMASK	(TW_ROOTSLOTS - 1)
+#define TW_MASK		(TW_SLOTS - 1)
+
+/* Shift giving the slot number on wheel LEVEL above the root. */
+#define TW_SHIFT(level)	(TW_ROOTBITS + (level)*TW_BITS)
+
+/*
+ * Set up a timer wheel. The cpu's first hardclock is tick 1.
+ */
+void
+timerwheel_init(struct timerwheel *tw)
+{
+	unsigned i, j;
+
+	spinlock_init(&tw->tw_lock);
+	tw->tw_now = 1;
+	tw->tw_firing = NULL;
+	for (i=0; i<TW_ROOTSLOTS; i++) {
+		tw->tw_root[i] = NULL;
+	}
+	for (i=0; i<TW_LEVELS; i++) {
+		for (j=0; j<TW_SLOTS; j++) {
+			tw->tw_level[i][j] = NULL;
+		}
+	}
+}
+
+/*
+ * Slot list manipulation.
+ */
+static
+void
+tw_link(struct timeout **slot, struct timeout *to)
+{
+	to->to_next = *slot;
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = &to->to_next;
+	}
+	to->to_prevp = slot;
+	*slot = to;
+}
+
+static
+void
+tw_unlink(struct timeout *to)
+{
+	*to->to_prevp = to->to_next;
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = to->to_prevp;
+	}
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+}
+
+/*
+ * Put TO in the right slot for its expiry time.
+ */
+static
+void
+tw_add(struct timerwheel *tw, struct timeout *to)
+{
+	unsigned delta, level;
+	struct timeout **slot;
+
+	KASSERT(spinlock_do_i_hold(&tw->tw_lock));
+
+	delta = to->to_expires - tw->tw_now;
+	if ((int)delta < 0) {
+		/* Overdue (can't happen, but be safe): do it next. */
+		slot = &tw->tw_root[tw->tw_now & TW_ROOTMASK];
+	}
+	else if (delta < TW_ROOTSLOTS) {
+		slot = &tw->tw_root[to->to_expires & TW_ROOTMASK];
+	}
+	else {
+		KASSERT(delta <= TIMEOUT_MAXTICKS);
+		for (level = 0; level < TW_LEVELS - 1; level++) {
+			if (delta < (1U << TW_SHIFT(level + 1))) {
+				break;
+			}
+		}
+		slot = &tw->tw_level[level][(to->to_expires >> TW_SHIFT(level))
+					    & TW_MASK];
+	}
+	tw_link(slot, to);
+}
+
+/*
+ * Redistribute the timeouts in slot INDEX of wheel LEVEL.
+ */
+static
+void
+tw_cascade(struct timerwheel *tw, unsigned level, unsigned index)
+{
+	struct timeout *list, *to;
+
+	list = tw->tw_level[level][index];
+	tw->tw_level[level][index] = NULL;
+	while (list != NULL) {
+		to = list;
+		list = to->to_next;
+		tw_add(tw, to);
+	}
+}
+
+/*
+ * Process the current cpu's wheel up to and including tick
+ * c_hardclocks. Normally that's one tick, but it may be more if
+ * hardclocks were skipped.
+ *
+ * Timeout functions are called without the wheel lock held, so they
+ * can take other locks and arm or cancel timeouts. To keep that
+ * safe, the tick's timeouts are moved to tw_firing and taken off one
+ * at a time; untimeout can still find and cancel the ones not yet
+ * called.
+ */
+void
+timerwheel_tick(void)
+{
+	struct timerwheel *tw = &curcpu->c_timerwheel;
+	struct timeout *to;
+	unsigned index, level, up;
+
+	spinlock_acquire(&tw->tw_lock);
+	while ((int)(curcpu->c_hardclocks - tw->tw_now) >= 0) {
+		index = tw->tw_now & TW_ROOTMASK;
+		if (index == 0) {
+			/* The root wheel came round; cascade. */
+			for (level = 0; level < TW_LEVELS; level++) {
+				up = (tw->tw_now >> TW_SHIFT(level)) & TW_MASK;
+				tw_cascade(tw, level, up);
+				if (up != 0) {
+					break;
+				}
+			}
+		}
+
+		KASSERT(tw->tw_firing == NULL);
+		to = tw->tw_root[index];
+		tw->tw_root[index] = NULL;
+		if (to != NULL) {
+			to->to_prevp = &tw->tw_firing;
+			tw->tw_firing = to;
+		}
+		tw->tw_now++;
+
+		while ((to = tw->tw_firing) != NULL) {
+			tw_unlink(to);
+			to->to_cpu = NULL;
+			spinlock_release(&tw->tw_lock);
+			to->to_func(to->to_arg);
+			spinlock_acquire(&tw->tw_lock);
+		}
+	}
+	spinlock_release(&tw->tw_lock);
+}
+
+/*
+ * Work out how many hardclocks until the wheel next needs attention:
+ * the next nonempty slot on the root wheel, or the next time the root
+ * wheel comes round, if there are timeouts further out to cascade and
+ * that comes first. (A level-0 timeout cascaded then may be due well
+ * before anything already on the root wheel past the wrap.) Returns 0
+ * if there are no timeouts at all.
+ */
+unsigned
+timerwheel_nextdue(void)
+{
+	struct timerwheel *tw = &curcpu->c_timerwheel;
+	unsigned i, j, ret, limit;
+
+	spinlock_acquire(&tw->tw_lock);
+
+	/* If anything is waiting to cascade, look no further than that. */
+	ret = 0;
+	limit = TW_ROOTSLOTS;
+	for (i=0; i<TW_LEVELS && ret == 0; i++) {
+		for (j=0; j<TW_SLOTS; j++) {
+			if (tw->tw_level[i][j] != NULL) {
+				ret = ((0 - tw->tw_now) & TW_ROOTMASK) + 1;
+				limit = ret;
+				break;
+			}
+		}
+	}
+
+	for (i=0; i<limit; i++) {
+		if (tw->tw_root[(tw->tw_now + i) & TW_ROOTMASK] != NULL) {
+			ret = i + 1;
+			break;
+		}
+	}
+
+	spinlock_release(&tw->tw_lock);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *arg)
+{
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+	to->to_func = func;
+	to->to_arg = arg;
+	to->to_expires = 0;
+	to->to_cpu = NULL;
+}
+
+void
+timeout(struct timeout *to, unsigned ticks)
+{
+	struct cpu *c;
+	struct timerwheel *tw;
+
+	KASSERT(to->to_cpu == NULL);
+
+	if (ticks == 0) {
+		ticks = 1;
+	}
+	if (ticks > TIMEOUT_MAXTICKS) {
+		ticks = TIMEOUT_MAXTICKS;
+	}
+
+	/*
+	 * If we get moved to another cpu after looking at curcpu,
+	 * that's harmless; the timeout just fires on the old one.
+	 */
+	c = curcpu->c_self;
+	tw = &c->c_timerwheel;
+
+	/*
+	 * tw_now is the next hardclock, which may be only moments
+	 * away, so it doesn't count as a whole tick: fire on the one
+	 * after TICKS more.
+	 */
+	spinlock_acquire(&tw->tw_lock);
+	to->to_expires = tw->tw_now + ticks;
+	to->to_cpu = c;
+	tw_add(tw, to);
+	spinlock_release(&tw->tw_lock);
+}
+
+bool
+untimeout(struct timeout *to)
+{
+	struct cpu *c;
+	struct timerwheel *tw;
+
+	while (1) {
+		c = to->to_cpu;
+		if (c == NULL) {
+			return false;
+		}
+		tw = &c->c_timerwheel;
+		spinlock_acquire(&tw->tw_lock);
+		if (to->to_cpu == c) {
+			break;
+		}
+		/* It fired while we were getting the lock; look again. */
+		spinlock_release(&tw->tw_lock);
+	}
+
+	tw_unlink(to);
+	to->to_cpu = NULL;
+	spinlock_release(&tw->tw_lock);
+	return true;
+}
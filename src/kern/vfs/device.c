@@ -150,6 +150,22 @@ dev_ioctl(struct vnode *v, int op, userptr_t data)
 	return DEVOP_IOCTL(d, op, data);
 }
 
+/*
+ * Called for poll() and select(). Pass through if the device cares;
+ * otherwise it never blocks.
+ */
+static
+int
+dev_poll(struct vnode *v, int events, struct pollent *pe)
+{
+	struct device *d = v->vn_data;
+
+	if (d->d_ops->devop_poll == NULL) {
+		return vnode_poll_ready(v, events, pe);
+	}
+	return DEVOP_POLL(d, events, pe);
+}
+
 /*
  * Called for stat().
  * Set the type and the size (block devices only).
@@ -339,6 +355,7 @@ static const struct vnode_ops dev_vnode_ops = {
 	.vop_mmap = dev_mmap,
 	.vop_truncate = dev_truncate,
 	.vop_namefile = dev_namefile,
+	.vop_poll = dev_poll,
 	.vop_creat = vopfail_creat_notdir,
 	.vop_symlink = vopfail_symlink_notdir,
 	.vop_mkdir = vopfail_mkdir_notdir,
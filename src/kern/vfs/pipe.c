@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Anonymous pipes.
+ *
+ * A pipe is a fixed-size ring buffer shared by two vnodes, one per
+ * end. Readers sleep on pp_rcv until there is data or no writers are
+ * left; writers sleep on pp_wcv until there is room or no readers are
+ * left. Everything is protected by pp_lock. poll() waits on pp_rpq
+ * and pp_wpq, which are woken along with the CVs.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/ioctl.h>
+#include <stat.h>
+#include <lib.h>
+#include <limits.h>
+#include <uio.h>
+#include <synch.h>
+#include <copyinout.h>
+#include <vm.h>
+#include <vnode.h>
+#include <poll.h>
+#include <pipe.h>
+
+struct pipe {
+	struct lock *pp_lock;
+	struct cv *pp_rcv;		/* readers wait here for data */
+	struct cv *pp_wcv;		/* writers wait here for room */
+	struct pollq pp_rpq;		/* poll()ers on the read end */
+	struct pollq pp_wpq;		/* poll()ers on the write end */
+	char *pp_buf;			/* ring, PIPE_BUFSIZE bytes */
+	unsigned pp_head;		/* offset of the oldest byte */
+	unsigned pp_count;		/* bytes in the ring */
+	bool pp_rclosed;		/* read end reclaimed */
+	bool pp_wclosed;		/* write end reclaimed */
+	bool pp_rnbio;			/* read end is non-blocking */
+	bool pp_wnbio;			/* write end is non-blocking */
+	struct vnode pp_rvn;
+	struct vnode pp_wvn;
+};
+
+static const struct vnode_ops pipe_vnode_ops;
+
+static
+void
+pipe_destroy(struct pipe *pp)
+{
+	kfree(pp->pp_buf);
+	pollq_cleanup(&pp->pp_wpq);
+	pollq_cleanup(&pp->pp_rpq);
+	cv_destroy(pp->pp_wcv);
+	cv_destroy(pp->pp_rcv);
+	lock_destroy(pp->pp_lock);
+	kfree(pp);
+}
+
+/*
+ * Create a pipe and hand back its two ends.
+ */
+int
+pipe_create(struct vnode **ret_rd, struct vnode **ret_wr)
+{
+	struct pipe *pp;
+
+	pp = kmalloc(sizeof(*pp));
+	if (pp == NULL) {
+		return ENOMEM;
+	}
+	pp->pp_lock = lock_create("pipe");
+	pp->pp_rcv = cv_create("pipe-r");
+	pp->pp_wcv = cv_create("pipe-w");
+	pp->pp_buf = kmalloc(PIPE_BUFSIZE);
+	if (pp->pp_lock == NULL || pp->pp_rcv == NULL ||
+	    pp->pp_wcv == NULL || pp->pp_buf == NULL) {
+		if (pp->pp_buf != NULL) {
+			kfree(pp->pp_buf);
+		}
+		if (pp->pp_wcv != NULL) {
+			cv_destroy(pp->pp_wcv);
+		}
+		if (pp->pp_rcv != NULL) {
+			cv_destroy(pp->pp_rcv);
+		}
+		if (pp->pp_lock != NULL) {
+			lock_destroy(pp->pp_lock);
+		}
+		kfree(pp);
+		return ENOMEM;
+	}
+	pollq_init(&pp->pp_rpq);
+	pollq_init(&pp->pp_wpq);
+	pp->pp_head = 0;
+	pp->pp_count = 0;
+	pp->pp_rclosed = false;
+	pp->pp_wclosed = false;
+	pp->pp_rnbio = false;
+	pp->pp_wnbio = false;
+	vnode_init(&pp->pp_rvn, &pipe_vnode_ops, NULL, pp);
+	vnode_init(&pp->pp_wvn, &pipe_vnode_ops, NULL, pp);
+
+	*ret_rd = &pp->pp_rvn;
+	*ret_wr = &pp->pp_wvn;
+	return 0;
+}
+
+/*
+ * Wake everyone waiting to read, or to write. Call with pp_lock held.
+ */
+static
+void
+pipe_wakereaders(struct pipe *pp)
+{
+	cv_broadcast(pp->pp_rcv, pp->pp_lock);
+	pollq_wakeup(&pp->pp_rpq);
+}
+
+static
+void
+pipe_wakewriters(struct pipe *pp)
+{
+	cv_broadcast(pp->pp_wcv, pp->pp_lock);
+	pollq_wakeup(&pp->pp_wpq);
+}
+
+/*
+ * Move bytes from the ring out to UIO. Call with pp_lock held.
+ */
+static
+int
+pipe_copyout(struct pipe *pp, struct uio *uio)
+{
+	size_t n;
+	int result;
+
+	while (pp->pp_count > 0 && uio->uio_resid > 0) {
+		n = PIPE_BUFSIZE - pp->pp_head;
+		if (n > pp->pp_count) {
+			n = pp->pp_count;
+		}
+		if (n > uio->uio_resid) {
+			n = uio->uio_resid;
+		}
+		result = uiomove(pp->pp_buf + pp->pp_head, n, uio);
+		if (result) {
+			return result;
+		}
+		pp->pp_head = (pp->pp_head + n) % PIPE_BUFSIZE;
+		pp->pp_count -= n;
+	}
+	if (pp->pp_count == 0) {
+		/* Keep the next write contiguous. */
+		pp->pp_head = 0;
+	}
+	return 0;
+}
+
+/*
+ * Move bytes from UIO into whatever room the ring has. Call with
+ * pp_lock held.
+ */
+static
+int
+pipe_copyin(struct pipe *pp, struct uio *uio)
+{
+	unsigned tail;
+	size_t n;
+	int result;
+
+	while (pp->pp_count < PIPE_BUFSIZE && uio->uio_resid > 0) {
+		tail = (pp->pp_head + pp->pp_count) % PIPE_BUFSIZE;
+		n = PIPE_BUFSIZE - pp->pp_count;
+		if (n > PIPE_BUFSIZE - tail) {
+			n = PIPE_BUFSIZE - tail;
+		}
+		if (n > uio->uio_resid) {
+			n = uio->uio_resid;
+		}
+		result = uiomove(pp->pp_buf + tail, n, uio);
+		if (result) {
+			return result;
+		}
+		pp->pp_count += n;
+	}
+	return 0;
+}
+
+/*
+ * Called when the last reference to one end goes away.
+ */
+static
+int
+pipe_reclaim(struct vnode *v)
+{
+	struct pipe *pp = v->vn_data;
+	bool last;
+
+	lock_acquire(pp->pp_lock);
+	if (v == &pp->pp_rvn) {
+		pp->pp_rclosed = true;
+		pipe_wakewriters(pp);
+	}
+	else {
+		pp->pp_wclosed = true;
+		pipe_wakereaders(pp);
+	}
+	vnode_cleanup(v);
+	last = pp->pp_rclosed && pp->pp_wclosed;
+	lock_release(pp->pp_lock);
+
+	if (last) {
+		pipe_destroy(pp);
+	}
+	return 0;
+}
+
+static
+int
+pipe_read(struct vnode *v, struct uio *uio)
+{
+	struct pipe *pp = v->vn_data;
+	size_t orig = uio->uio_resid;
+	int result = 0;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	if (v != &pp->pp_rvn) {
+		return EBADF;
+	}
+	if (orig == 0) {
+		return 0;
+	}
+
+	lock_acquire(pp->pp_lock);
+	while (uio->uio_resid == orig) {
+		while (pp->pp_count == 0) {
+			if (pp->pp_wclosed) {
+				goto out;
+			}
+			if (pp->pp_rnbio) {
+				result = EAGAIN;
+				goto out;
+			}
+			result = cv_wait_intr(pp->pp_rcv, pp->pp_lock);
+			if (result) {
+				goto out;
+			}
+		}
+		result = pipe_copyout(pp, uio);
+		pipe_wakewriters(pp);
+		if (result) {
+			break;
+		}
+	}
+ out:
+	lock_release(pp->pp_lock);
+	return result;
+}
+
+static
+int
+pipe_write(struct vnode *v, struct uio *uio)
+{
+	struct pipe *pp = v->vn_data;
+	size_t orig = uio->uio_resid;
+	size_t need;
+	int result = 0;
+
+	KASSERT(uio->uio_rw == UIO_WRITE);
+
+	if (v != &pp->pp_wvn) {
+		return EBADF;
+	}
+
+	lock_acquire(pp->pp_lock);
+	while (result == 0 && uio->uio_resid > 0) {
+		if (pp->pp_rclosed) {
+			result = EPIPE;
+			break;
+		}
+		/* Small writes go in all at once or not at all. */
+		need = uio->uio_resid <= PIPE_BUF ? uio->uio_resid : 1;
+		if (PIPE_BUFSIZE - pp->pp_count < need) {
+			if (pp->pp_wnbio) {
+				result = EAGAIN;
+				break;
+			}
+			result = cv_wait_intr(pp->pp_wcv, pp->pp_lock);
+			continue;
+		}
+		result = pipe_copyin(pp, uio);
+		pipe_wakereaders(pp);
+	}
+	lock_release(pp->pp_lock);
+
+	/* A short write is a success; report the error next time. */
+	if (result && uio->uio_resid < orig) {
+		result = 0;
+	}
+	return result;
+}
+
+static
+int
+pipe_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	struct pipe *pp = v->vn_data;
+	int on, result;
+
+	if (op != FIONBIO) {
+		return EIOCTL;
+	}
+	result = copyin(data, &on, sizeof(on));
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(pp->pp_lock);
+	if (v == &pp->pp_rvn) {
+		pp->pp_rnbio = on != 0;
+	}
+	else {
+		pp->pp_wnbio = on != 0;
+	}
+	lock_release(pp->pp_lock);
+	return 0;
+}
+
+/*
+ * The read end is ready when there's data to read, and hung up once
+ * the writers are gone. The write end is ready when a PIPE_BUF-sized
+ * write would go straight in, and in error once the readers are gone.
+ */
+static
+int
+pipe_poll(struct vnode *v, int events, struct pollent *pe)
+{
+	struct pipe *pp = v->vn_data;
+	int revents = 0;
+
+	lock_acquire(pp->pp_lock);
+	if (v == &pp->pp_rvn) {
+		pollq_record(&pp->pp_rpq, pe);
+		if (pp->pp_count > 0) {
+			revents |= (POLLIN | POLLRDNORM) & events;
+		}
+		if (pp->pp_wclosed) {
+			revents |= POLLHUP;
+		}
+	}
+	else {
+		pollq_record(&pp->pp_wpq, pe);
+		if (PIPE_BUFSIZE - pp->pp_count >= PIPE_BUF) {
+			revents |= POLLOUT & events;
+		}
+		if (pp->pp_rclosed) {
+			revents |= POLLERR;
+		}
+	}
+	lock_release(pp->pp_lock);
+	return revents;
+}
+
+static
+int
+pipe_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct pipe *pp = v->vn_data;
+
+	bzero(statbuf, sizeof(struct stat));
+	statbuf->st_mode = S_IFIFO | 0600;
+	statbuf->st_nlink = 1;
+	statbuf->st_size = pp->pp_count;
+	statbuf->st_blksize = PIPE_BUFSIZE;
+	return 0;
+}
+
+static
+int
+pipe_gettype(struct vnode *v, mode_t *ret)
+{
+	(void)v;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+static
+bool
+pipe_isseekable(struct vnode *v)
+{
+	(void)v;
+	return false;
+}
+
+/*
+ * Pipes are never opened by name, so eachopen is never called; fsync
+ * has nothing to do; and they can't be truncated.
+ */
+static
+int
+pipe_eachopen(struct vnode *v, int openflags)
+{
+	(void)v;
+	(void)openflags;
+	return 0;
+}
+
+static
+int
+pipe_fsync(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+static
+int
+pipe_truncate(struct vnode *v, off_t len)
+{
+	(void)v;
+	(void)len;
+	return EINVAL;
+}
+
+static const struct vnode_ops pipe_vnode_ops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = pipe_eachopen,
+	.vop_reclaim = pipe_reclaim,
+	.vop_read = pipe_read,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_write = pipe_write,
+	.vop_ioctl = pipe_ioctl,
+	.vop_stat = pipe_stat,
+	.vop_gettype = pipe_gettype,
+	.vop_isseekable = pipe_isseekable,
+	.vop_fsync = pipe_fsync,
+	.vop_mmap = vopfail_mmap_nosys,
+	.vop_truncate = pipe_truncate,
+	.vop_namefile = vopfail_uio_notdir,
+	.vop_poll = pipe_poll,
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
@@ -39,6 +39,8 @@
 #include <lib.h>
 #include <array.h>
 #include <synch.h>
+#include <thread.h>
+#include <clock.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
@@ -170,6 +172,38 @@ vfs_sync(void)
 	return 0;
 }
 
+/*
+ * Background syncer. Filesystems only mark metadata dirty; this
+ * thread pushes it out every VFS_SYNCER_INTERVAL seconds so the
+ * writes get batched instead of going out one at a time.
+ */
+#define VFS_SYNCER_INTERVAL 5
+
+static
+void
+vfs_syncer(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		clocksleep(VFS_SYNCER_INTERVAL);
+		vfs_sync();
+	}
+}
+
+void
+vfs_syncer_start(void)
+{
+	int result;
+
+	result = thread_fork("syncer", NULL, vfs_syncer, NULL, 0);
+	if (result) {
+		panic("vfs_syncer_start: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
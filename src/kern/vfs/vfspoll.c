@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Wait queues for poll() and select(). See <poll.h>.
+ */
+#include <types.h>
+#include <lib.h>
+#include <wchan.h>
+#include <poll.h>
+
+void
+pollq_init(struct pollq *pq)
+{
+	spinlock_init(&pq->pq_lock);
+	pq->pq_first = NULL;
+}
+
+void
+pollq_cleanup(struct pollq *pq)
+{
+	KASSERT(pq->pq_first == NULL);
+	spinlock_cleanup(&pq->pq_lock);
+}
+
+/*
+ * Put PE on PQ, if it isn't there already. PE may be NULL, meaning
+ * the caller isn't going to wait, in which case do nothing.
+ */
+void
+pollq_record(struct pollq *pq, struct pollent *pe)
+{
+	if (pe == NULL || pe->pe_q == pq) {
+		return;
+	}
+	KASSERT(pe->pe_q == NULL);
+
+	spinlock_acquire(&pq->pq_lock);
+	pe->pe_next = pq->pq_first;
+	pe->pe_prevp = &pq->pq_first;
+	if (pe->pe_next != NULL) {
+		pe->pe_next->pe_prevp = &pe->pe_next;
+	}
+	pq->pq_first = pe;
+	pe->pe_q = pq;
+	spinlock_release(&pq->pq_lock);
+}
+
+/*
+ * Wake every poll() with an entry on PQ. May be called from an
+ * interrupt handler.
+ */
+void
+pollq_wakeup(struct pollq *pq)
+{
+	struct pollent *pe;
+	struct pollctx *ctx;
+
+	spinlock_acquire(&pq->pq_lock);
+	for (pe = pq->pq_first; pe != NULL; pe = pe->pe_next) {
+		ctx = pe->pe_ctx;
+		spinlock_acquire(&ctx->pc_lock);
+		ctx->pc_fired = true;
+		wchan_wakeall(ctx->pc_wchan, &ctx->pc_lock);
+		spinlock_release(&ctx->pc_lock);
+	}
+	spinlock_release(&pq->pq_lock);
+}
+
+void
+pollent_init(struct pollent *pe, struct pollctx *ctx)
+{
+	pe->pe_ctx = ctx;
+	pe->pe_q = NULL;
+	pe->pe_next = NULL;
+	pe->pe_prevp = NULL;
+}
+
+/*
+ * Take PE off whatever queue it is on. Once this returns, nothing
+ * will touch PE or its pollctx on that queue's behalf.
+ */
+void
+pollent_remove(struct pollent *pe)
+{
+	struct pollq *pq = pe->pe_q;
+
+	if (pq == NULL) {
+		return;
+	}
+	spinlock_acquire(&pq->pq_lock);
+	*pe->pe_prevp = pe->pe_next;
+	if (pe->pe_next != NULL) {
+		pe->pe_next->pe_prevp = pe->pe_prevp;
+	}
+	spinlock_release(&pq->pq_lock);
+	pe->pe_q = NULL;
+	pe->pe_next = NULL;
+	pe->pe_prevp = NULL;
+}
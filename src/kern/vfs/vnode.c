@@ -32,6 +32,7 @@
  */
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/poll.h>
 #include <lib.h>
 #include <synch.h>
 #include <vfs.h>
@@ -122,6 +123,18 @@ vnode_decref(struct vnode *vn)
 	}
 }
 
+/*
+ * vop_poll for objects that never block, such as regular files and
+ * directories: whatever is asked for is ready.
+ */
+int
+vnode_poll_ready(struct vnode *vn, int events, struct pollent *pe)
+{
+	(void)vn;
+	(void)pe;
+	return events & (POLLIN | POLLRDNORM | POLLOUT);
+}
+
 /*
  * Check for various things being valid.
  * Called before all VOP_* calls.
@@ -192,3 +192,27 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+
+int
+as_alloc_threadstack(struct addrspace *as, int *slot, vaddr_t *stackptr)
+{
+	/*
+	 * Write this.
+	 */
+
+	(void)as;
+	(void)slot;
+	(void)stackptr;
+	return ENOSYS;
+}
+
+void
+as_free_threadstack(struct addrspace *as, int slot)
+{
+	/*
+	 * Write this.
+	 */
+
+	(void)as;
+	(void)slot;
+}
@@ -30,8 +30,12 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
 #include <proc_array.h>
+#include <kmem_cache.h>
 
 /*
  * Kernel malloc.
@@ -122,12 +126,31 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * The per-cpu magazine layer (see below) hands out blocks without
+ * going through the code that sets up and checks guard bands, labels
+ * and deadbeef, so turn it off when any of the debugging options are
+ * on.
+ */
+#if !defined(SLOW) && !defined(SLOWER) && !defined(GUARDS) && \
+    !defined(LABELS) && !defined(CHECKBEEF)
+#define MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+/*
+ * Block sizes. Between the powers of two there are intermediate
+ * sizes (roughly 1.5x) so a request never wastes more than about a
+ * third of its block; 1360 packs three to a page. All are multiples
+ * of 16, so blocks stay suitably aligned.
+ */
+#define NSIZES 14
+static const size_t sizes[NSIZES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1360, 2048
+};
 
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
@@ -161,10 +184,9 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole subpage allocator. Most allocations
+ * don't get this far, though; they're satisfied from the per-cpu
+ * magazines further down, which don't need it.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -346,6 +368,67 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Allocation counts and requested bytes for each block size, for
+ * working out how much is lost to rounding up. Protected by
+ * kmalloc_spinlock; allocations served from the magazines are
+ * counted per-cpu there instead.
+ */
+static unsigned subpage_nallocs[NSIZES];
+static uint64_t subpage_reqbytes[NSIZES];
+
+/*
+ * Tables indexed by physical page number are sized for System/161's
+ * 16M of RAM, like the pageref pages.
+ */
+#define KHEAP_MAPPAGES (16*1024*1024 / PAGE_SIZE)
+
+#ifdef MAGAZINES
+/*
+ * The block type of each kernel heap page, plus one, or 0 if the page
+ * doesn't belong to the subpage allocator. This lets kfree find the
+ * size of a block without searching allbase. Entries only change
+ * when a page is added or removed, under kmalloc_spinlock, and while
+ * a block is allocated its page can't be removed, so kfree can read
+ * the entry for the block it's freeing without the lock.
+ *
+ * Blocks on pages beyond KHEAP_MAPPAGES just bypass the magazines.
+ */
+static uint8_t kheap_pageclass[KHEAP_MAPPAGES];
+
+static
+void
+kheap_setclass(vaddr_t prpage, unsigned val)
+{
+	paddr_t pn = KVADDR_TO_PADDR(prpage) / PAGE_SIZE;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	if (pn < KHEAP_MAPPAGES) {
+		kheap_pageclass[pn] = val;
+	}
+}
+
+/*
+ * Return the block type of PTR, or -1 if it isn't a known subpage
+ * block.
+ */
+static
+int
+kheap_getclass(const void *ptr)
+{
+	paddr_t pn = KVADDR_TO_PADDR((vaddr_t)ptr) / PAGE_SIZE;
+
+	if (pn >= KHEAP_MAPPAGES) {
+		return -1;
+	}
+	return (int)kheap_pageclass[pn] - 1;
+}
+
+static void kmag_printstats(void);
+#endif /* MAGAZINES */
+
+static void kheap_printwaste(void);
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -813,6 +896,11 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+#ifdef MAGAZINES
+	kmag_printstats();
+#endif
+	kheap_printwaste();
 }
 
 ////////////////////////////////////////
@@ -880,6 +968,7 @@ subpage_kmalloc(size_t sz
 	)
 {
 	unsigned blktype;	// index into sizes[] that we're using
+	size_t reqsz;		// size the caller asked for
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
@@ -892,6 +981,7 @@ subpage_kmalloc(size_t sz
 	size_t clientsz;
 #endif
 
+	reqsz = sz;
 #ifdef GUARDS
 	clientsz = sz;
 	sz += GUARD_OVERHEAD;
@@ -947,6 +1037,8 @@ subpage_kmalloc(size_t sz
 #ifdef LABELS
 			retptr = establishlabel(retptr, label);
 #endif
+			subpage_nallocs[blktype]++;
+			subpage_reqbytes[blktype] += reqsz;
 
 			checksubpages();
 
@@ -988,6 +1080,9 @@ subpage_kmalloc(size_t sz
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
+#ifdef MAGAZINES
+	kheap_setclass(prpage, blktype + 1);
+#endif
 	pr->nfree = PAGE_SIZE / sizes[blktype];
 
 	/*
@@ -1138,6 +1233,9 @@ subpage_kfree(void *ptr)
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
+#ifdef MAGAZINES
+		kheap_setclass(prpage, 0);
+#endif
 		freepageref(pr);
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
@@ -1156,17 +1254,606 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+// Each cpu keeps, for each block size, two magazines (small stacks)
+// of free blocks: a loaded one it allocates from and frees into, and
+// the previous one. When the loaded magazine runs out (or fills up)
+// and the previous one is full (or empty), the two are swapped; only
+// when neither will do does the cpu go to the depot, a shared pool of
+// full and empty magazines, to trade. So most kmallocs and kfrees
+// touch only the current cpu's magazines, with interrupts off to
+// keep us on the cpu, and take no lock at all. Only the depot trade
+// takes kmag_depot_lock, and only when the depot has nothing to
+// trade do we fall back to the subpage allocator and
+// kmalloc_spinlock.
+//
+// The loaded and previous magazines are always each either NULL,
+// full, or empty, except that the loaded one may be partly full. (And
+// if the loaded one is NULL, so is the previous one.)
+//
+// Blocks sitting in magazines count as allocated as far as the
+// subpage allocator is concerned, so their pages stay in the heap.
+// KMAG_DEPOT_MAX limits how many full magazines pile up in the depot;
+// beyond that they're emptied back into the subpage allocator.
+//
+// This is the magazine design from Bonwick and Adams, "Magazines and
+// Vmem", USENIX 2001.
+
+#ifdef MAGAZINES
+
+/* Sized so a magazine is exactly 64 bytes. */
+#define KMAG_ROUNDS	14
+
+/* At most this many full magazines per size in the depot. */
+#define KMAG_DEPOT_MAX	8
+
+/* System/161 supports at most 32 cpus; any others skip the magazines. */
+#define KMAG_MAXCPUS	32
+
+struct kmag {
+	struct kmag *km_next;		/* link on depot list */
+	unsigned km_rounds;		/* number of blocks held */
+	void *km_objs[KMAG_ROUNDS];	/* the blocks */
+};
+
+struct kmag_cpu {
+	struct kmag *kc_loaded;		/* magazine in use */
+	struct kmag *kc_prev;		/* previous magazine */
+	unsigned kc_nallocs;		/* blocks handed out (stats) */
+	uint64_t kc_reqbytes;		/* bytes asked for (stats) */
+};
+
+struct kmag_depot {
+	struct kmag *kd_full;		/* list of full magazines */
+	struct kmag *kd_empty;		/* list of empty magazines */
+	unsigned kd_nfull;		/* length of kd_full */
+};
+
+static struct kmag_cpu kmag_cpus[KMAG_MAXCPUS][NSIZES];
+static struct kmag_depot kmag_depots[NSIZES];
+static struct spinlock kmag_depot_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Return a magazine's blocks to the subpage allocator and free it.
+ */
+static
+void
+kmag_drain(struct kmag *m)
+{
+	unsigned i;
+	int result;
+
+	for (i=0; i<m->km_rounds; i++) {
+		result = subpage_kfree(m->km_objs[i]);
+		KASSERT(result == 0);
+	}
+	result = subpage_kfree(m);
+	KASSERT(result == 0);
+}
+
+/*
+ * Get a block of type BLKTYPE from the current cpu's magazines to
+ * satisfy a request for SZ bytes. Returns NULL if there isn't one
+ * handy.
+ */
+static
+void *
+kmag_alloc(unsigned blktype, size_t sz)
+{
+	struct kmag_cpu *kc;
+	struct kmag_depot *kd;
+	struct kmag *m;
+	void *ret;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	ret = NULL;
+	spl = splhigh();
+	if (curcpu->c_number >= KMAG_MAXCPUS) {
+		goto done;
+	}
+	kc = &kmag_cpus[curcpu->c_number][blktype];
+
+	m = kc->kc_loaded;
+	if (m == NULL || m->km_rounds == 0) {
+		if (kc->kc_prev != NULL && kc->kc_prev->km_rounds > 0) {
+			/* The previous one is full; swap. */
+			kc->kc_loaded = kc->kc_prev;
+			kc->kc_prev = m;
+		}
+		else {
+			/* Trade the empty previous one for a full one. */
+			kd = &kmag_depots[blktype];
+			spinlock_acquire(&kmag_depot_lock);
+			m = kd->kd_full;
+			if (m != NULL) {
+				kd->kd_full = m->km_next;
+				kd->kd_nfull--;
+				if (kc->kc_prev != NULL) {
+					kc->kc_prev->km_next = kd->kd_empty;
+					kd->kd_empty = kc->kc_prev;
+				}
+				kc->kc_prev = kc->kc_loaded;
+				kc->kc_loaded = m;
+			}
+			spinlock_release(&kmag_depot_lock);
+			if (m == NULL) {
+				goto done;
+			}
+		}
+	}
+
+	m = kc->kc_loaded;
+	KASSERT(m->km_rounds > 0);
+	ret = m->km_objs[--m->km_rounds];
+	kc->kc_nallocs++;
+	kc->kc_reqbytes += sz;
+ done:
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Put PTR, a block of type BLKTYPE, in the current cpu's magazines.
+ * Returns false if it couldn't, in which case the caller should free
+ * it the ordinary way.
+ */
+static
+bool
+kmag_free(void *ptr, unsigned blktype)
+{
+	struct kmag_cpu *kc;
+	struct kmag_depot *kd;
+	struct kmag *m, *spill;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return false;
+	}
+
+	kd = &kmag_depots[blktype];
+	spill = NULL;
+	spl = splhigh();
+	while (1) {
+		if (curcpu->c_number >= KMAG_MAXCPUS) {
+			splx(spl);
+			return false;
+		}
+		kc = &kmag_cpus[curcpu->c_number][blktype];
+
+		m = kc->kc_loaded;
+		if (m != NULL && m->km_rounds < KMAG_ROUNDS) {
+			break;
+		}
+		if (kc->kc_prev != NULL && kc->kc_prev->km_rounds == 0) {
+			/* The previous one is empty; swap. */
+			kc->kc_loaded = kc->kc_prev;
+			kc->kc_prev = m;
+			break;
+		}
+
+		/* Trade the full previous one for an empty one. */
+		spinlock_acquire(&kmag_depot_lock);
+		m = kd->kd_empty;
+		if (m != NULL) {
+			kd->kd_empty = m->km_next;
+			if (kc->kc_prev == NULL) {
+				/* nothing */
+			}
+			else if (kd->kd_nfull < KMAG_DEPOT_MAX) {
+				kc->kc_prev->km_next = kd->kd_full;
+				kd->kd_full = kc->kc_prev;
+				kd->kd_nfull++;
+			}
+			else {
+				spill = kc->kc_prev;
+			}
+			kc->kc_prev = kc->kc_loaded;
+			kc->kc_loaded = m;
+		}
+		spinlock_release(&kmag_depot_lock);
+		if (m != NULL) {
+			break;
+		}
+
+		/*
+		 * No empty magazines anywhere; make one. This can
+		 * sleep, so let go of the cpu first; we'll need to
+		 * look again when we come back.
+		 */
+		splx(spl);
+		m = subpage_kmalloc(sizeof(*m));
+		if (m == NULL) {
+			return false;
+		}
+		m->km_rounds = 0;
+		spl = splhigh();
+		spinlock_acquire(&kmag_depot_lock);
+		m->km_next = kd->kd_empty;
+		kd->kd_empty = m;
+		spinlock_release(&kmag_depot_lock);
+	}
+
+	m = kc->kc_loaded;
+	KASSERT(m->km_rounds < KMAG_ROUNDS);
+	m->km_objs[m->km_rounds++] = ptr;
+	splx(spl);
+
+	if (spill != NULL) {
+		kmag_drain(spill);
+	}
+	return true;
+}
+
+/*
+ * Print how many free blocks are sitting in magazines. The per-cpu
+ * counts are read without stopping the other cpus, so they're only
+ * approximate.
+ */
+static
+void
+kmag_printstats(void)
+{
+	unsigned i, j, incpus, indepot;
+	struct kmag_cpu *kc;
+	struct kmag *m;
+
+	kprintf("Magazines:\n");
+	for (i=0; i<NSIZES; i++) {
+		incpus = 0;
+		for (j=0; j<KMAG_MAXCPUS; j++) {
+			kc = &kmag_cpus[j][i];
+			if (kc->kc_loaded != NULL) {
+				incpus += kc->kc_loaded->km_rounds;
+			}
+			if (kc->kc_prev != NULL) {
+				incpus += kc->kc_prev->km_rounds;
+			}
+		}
+		indepot = 0;
+		spinlock_acquire(&kmag_depot_lock);
+		for (m = kmag_depots[i].kd_full; m != NULL; m = m->km_next) {
+			indepot += m->km_rounds;
+		}
+		spinlock_release(&kmag_depot_lock);
+		kprintf("   size %-4lu  %u cached on cpus, %u in depot\n",
+			(unsigned long) sizes[i], incpus, indepot);
+	}
+}
+
+#endif /* MAGAZINES */
+
+//
+////////////////////////////////////////////////////////////
+//
+// Large-object allocator.
+//
+// Blocks too big for the subpage allocator get whole runs of pages
+// from alloc_kpages, which has to scan the coremap for a long enough
+// free run every time. To save that, freed runs are kept, up to
+// KLARGE_CACHE_PAGES pages in all, in a tree ordered by length, and
+// handed out again best-fit. Runs are never split or merged; each
+// stays exactly what alloc_kpages returned, so it can still go back
+// through free_kpages. To bound the waste, a cached run is only
+// reused for a request that needs at least 3/4 of it.
+//
+// The tree is a plain binary search tree with one node per distinct
+// run length; further runs of a length already present hang off that
+// node's kr_same list. There are only ever a handful of distinct
+// lengths, so it doesn't need balancing. The nodes live in the free
+// runs themselves.
+//
+// The length of each run handed out is recorded in klarge_npages[],
+// indexed by physical page number, so kfree can tell how big it is.
+
+#define KLARGE_CACHE_PAGES	64
+
+struct klarge_run {
+	struct klarge_run *kr_left;	/* shorter runs */
+	struct klarge_run *kr_right;	/* longer runs */
+	struct klarge_run *kr_same;	/* more runs of this length */
+	unsigned kr_npages;		/* length of run */
+};
+
+static struct spinlock klarge_lock = SPINLOCK_INITIALIZER;
+static struct klarge_run *klarge_tree;
+static unsigned klarge_cachedpages;
+static uint16_t klarge_npages[KHEAP_MAPPAGES];
+
+/* Statistics, also protected by klarge_lock. */
+static unsigned klarge_nallocs, klarge_hits;
+static uint64_t klarge_reqbytes, klarge_gotbytes;
+
+/*
+ * Add a free run to the tree.
+ */
+static
+void
+klarge_insert(struct klarge_run *r)
+{
+	struct klarge_run **pp;
+
+	KASSERT(spinlock_do_i_hold(&klarge_lock));
+
+	r->kr_left = r->kr_right = r->kr_same = NULL;
+	pp = &klarge_tree;
+	while (*pp != NULL) {
+		if (r->kr_npages == (*pp)->kr_npages) {
+			r->kr_same = (*pp)->kr_same;
+			(*pp)->kr_same = r;
+			return;
+		}
+		if (r->kr_npages < (*pp)->kr_npages) {
+			pp = &(*pp)->kr_left;
+		}
+		else {
+			pp = &(*pp)->kr_right;
+		}
+	}
+	*pp = r;
+}
+
+/*
+ * Remove and return the shortest free run of at least NPAGES pages,
+ * provided it's no longer than MAXPAGES; otherwise return NULL.
+ */
+static
+struct klarge_run *
+klarge_take(unsigned npages, unsigned maxpages)
+{
+	struct klarge_run **pp, **best, **sp;
+	struct klarge_run *r, *s;
+
+	KASSERT(spinlock_do_i_hold(&klarge_lock));
+
+	best = NULL;
+	pp = &klarge_tree;
+	while (*pp != NULL) {
+		if ((*pp)->kr_npages >= npages) {
+			best = pp;
+			pp = &(*pp)->kr_left;
+		}
+		else {
+			pp = &(*pp)->kr_right;
+		}
+	}
+	if (best == NULL || (*best)->kr_npages > maxpages) {
+		return NULL;
+	}
+
+	r = *best;
+	if (r->kr_same != NULL) {
+		/* Take one of the extras; the tree doesn't change. */
+		s = r->kr_same;
+		r->kr_same = s->kr_same;
+		return s;
+	}
+
+	if (r->kr_left == NULL) {
+		*best = r->kr_right;
+	}
+	else if (r->kr_right == NULL) {
+		*best = r->kr_left;
+	}
+	else {
+		/* Replace it with the shortest run longer than it. */
+		sp = &r->kr_right;
+		while ((*sp)->kr_left != NULL) {
+			sp = &(*sp)->kr_left;
+		}
+		s = *sp;
+		*sp = s->kr_right;
+		s->kr_left = r->kr_left;
+		s->kr_right = r->kr_right;
+		*best = s;
+	}
+	return r;
+}
+
+/*
+ * Allocate SZ bytes as a run of whole pages.
+ */
+static
+vaddr_t
+klarge_alloc(size_t sz)
+{
+	struct klarge_run *r;
+	unsigned npages, runpages;
+	vaddr_t addr;
+	paddr_t pn;
+
+	npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
+
+	spinlock_acquire(&klarge_lock);
+	r = klarge_take(npages, npages + npages/3);
+	if (r != NULL) {
+		klarge_cachedpages -= r->kr_npages;
+		klarge_hits++;
+	}
+	spinlock_release(&klarge_lock);
+
+	if (r != NULL) {
+		runpages = r->kr_npages;
+		addr = (vaddr_t)r;
+	}
+	else {
+		runpages = npages;
+		addr = alloc_kpages(npages);
+		if (addr == 0) {
+			return 0;
+		}
+	}
+	KASSERT(addr % PAGE_SIZE == 0);
+
+	pn = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	spinlock_acquire(&klarge_lock);
+	if (pn < KHEAP_MAPPAGES) {
+		klarge_npages[pn] = runpages;
+	}
+	klarge_nallocs++;
+	klarge_reqbytes += sz;
+	klarge_gotbytes += runpages * PAGE_SIZE;
+	spinlock_release(&klarge_lock);
+
+	return addr;
+}
+
+/*
+ * Free a run of pages from klarge_alloc, keeping it for reuse if
+ * there's room.
+ */
+static
+void
+klarge_free(vaddr_t addr)
+{
+	struct klarge_run *r;
+	unsigned npages;
+	paddr_t pn;
+
+	KASSERT(addr % PAGE_SIZE == 0);
+
+	pn = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	if (pn >= KHEAP_MAPPAGES) {
+		free_kpages(addr);
+		return;
+	}
+
+	spinlock_acquire(&klarge_lock);
+	npages = klarge_npages[pn];
+	klarge_npages[pn] = 0;
+	if (npages > 0 && klarge_cachedpages + npages <= KLARGE_CACHE_PAGES) {
+		r = (struct klarge_run *)addr;
+		r->kr_npages = npages;
+		klarge_insert(r);
+		klarge_cachedpages += npages;
+		spinlock_release(&klarge_lock);
+		return;
+	}
+	spinlock_release(&klarge_lock);
+
+	free_kpages(addr);
+}
+
+/*
+ * Give every cached run back to the page allocator. Returns the
+ * number of pages freed.
+ */
+static
+unsigned
+klarge_drain(void)
+{
+	struct klarge_run *r;
+	unsigned npages;
+
+	npages = 0;
+	spinlock_acquire(&klarge_lock);
+	while ((r = klarge_take(1, KHEAP_MAPPAGES)) != NULL) {
+		klarge_cachedpages -= r->kr_npages;
+		npages += r->kr_npages;
+		/* free_kpages can sleep */
+		spinlock_release(&klarge_lock);
+		free_kpages((vaddr_t)r);
+		spinlock_acquire(&klarge_lock);
+	}
+	spinlock_release(&klarge_lock);
+	return npages;
+}
+
+/*
+ * Print large-object allocator statistics.
+ */
+static
+void
+klarge_printstats(void)
+{
+	spinlock_acquire(&klarge_lock);
+	kprintf("   large %8u %12llu %12llu %3u%%\n",
+		klarge_nallocs,
+		(unsigned long long) klarge_reqbytes,
+		(unsigned long long) (klarge_gotbytes - klarge_reqbytes),
+		klarge_gotbytes ? (unsigned)((klarge_gotbytes -
+					       klarge_reqbytes) * 100 /
+					      klarge_gotbytes) : 0);
+	kprintf("   (%u reused from cache, %u pages cached)\n",
+		klarge_hits, klarge_cachedpages);
+	spinlock_release(&klarge_lock);
+}
+
+/*
+ * Print, for each block size and for the large-object allocator, how
+ * many bytes were asked for and how many were lost to rounding up
+ * to the block size. These are totals since boot, not what's
+ * currently allocated.
+ */
+static
+void
+kheap_printwaste(void)
+{
+	unsigned i, nallocs;
+	uint64_t req, got;
+#ifdef MAGAZINES
+	unsigned j;
+#endif
+
+	kprintf("Size classes:\n");
+	kprintf("   size    allocs    requested       wasted\n");
+	for (i=0; i<NSIZES; i++) {
+		spinlock_acquire(&kmalloc_spinlock);
+		nallocs = subpage_nallocs[i];
+		req = subpage_reqbytes[i];
+		spinlock_release(&kmalloc_spinlock);
+#ifdef MAGAZINES
+		/* approximate, as in kmag_printstats */
+		for (j=0; j<KMAG_MAXCPUS; j++) {
+			nallocs += kmag_cpus[j][i].kc_nallocs;
+			req += kmag_cpus[j][i].kc_reqbytes;
+		}
+#endif
+		got = (uint64_t)nallocs * sizes[i];
+		kprintf("   %-5lu %8u %12llu %12llu %3u%%\n",
+			(unsigned long) sizes[i], nallocs,
+			(unsigned long long) req,
+			(unsigned long long) (got - req),
+			got ? (unsigned)((got - req) * 100 / got) : 0);
+	}
+	klarge_printstats();
+}
+
 //
 ////////////////////////////////////////////////////////////
 
+/*
+ * Out of pages: make the object caches and the large-run cache give
+ * back what they're holding. Returns true if anything was freed and
+ * the allocation is worth retrying.
+ */
+static
+bool
+kmalloc_reclaim(void)
+{
+	unsigned n;
+
+	n = kmem_cache_reclaim();
+	n += klarge_drain();
+	return n > 0;
+}
+
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
- * alloc_kpages depending on how big SZ is.
+ * klarge_alloc depending on how big SZ is. If that fails, reclaim
+ * cached memory and try once more.
  */
 void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
+	void *ptr;
 #ifdef LABELS
 	vaddr_t label;
 #endif
@@ -1181,12 +1868,12 @@ kmalloc(size_t sz)
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
 	if (checksz >= LARGEST_SUBPAGE_SIZE) {
-		unsigned long npages;
 		vaddr_t address;
 
-		/* Round up to a whole number of pages. */
-		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
+		address = klarge_alloc(sz);
+		if (address == 0 && kmalloc_reclaim()) {
+			address = klarge_alloc(sz);
+		}
 		if (address==0) {
 			printThisPlease[0] = 'a';
 			printThisPlease[1] = 'd';
@@ -1206,11 +1893,25 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#ifdef MAGAZINES
+	ptr = kmag_alloc(blocktype(sz), sz);
+	if (ptr != NULL) {
+		return ptr;
+	}
+#endif
+
 #ifdef LABELS
-	return subpage_kmalloc(sz, label);
+	ptr = subpage_kmalloc(sz, label);
+	if (ptr == NULL && kmalloc_reclaim()) {
+		ptr = subpage_kmalloc(sz, label);
+	}
 #else
-	return subpage_kmalloc(sz);
+	ptr = subpage_kmalloc(sz);
+	if (ptr == NULL && kmalloc_reclaim()) {
+		ptr = subpage_kmalloc(sz);
+	}
 #endif
+	return ptr;
 }
 
 /*
@@ -1222,11 +1923,22 @@ kfree(void *ptr)
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
+#ifdef MAGAZINES
+	int blktype;
+#endif
+
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef MAGAZINES
+	blktype = kheap_getclass(ptr);
+	if (blktype >= 0 && kmag_free(ptr, blktype)) {
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
-		free_kpages((vaddr_t)ptr);
+		klarge_free((vaddr_t)ptr);
 	}
 }
 
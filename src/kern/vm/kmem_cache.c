@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches. See <kmem_cache.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kmem_cache.h>
+
+/* List of all caches that have been used, for kmem_cache_printstats. */
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Put a cache on the list the first time it's used.
+ */
+static
+void
+kmem_cache_register(struct kmem_cache *kc)
+{
+	KASSERT(kc->kc_depth >= 1 && kc->kc_depth <= KMEM_CACHE_DEPTH);
+
+	spinlock_acquire(&kmem_caches_lock);
+	if (!kc->kc_listed) {
+		kc->kc_next = kmem_caches;
+		kmem_caches = kc;
+		kc->kc_listed = true;
+	}
+	spinlock_release(&kmem_caches_lock);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+	int result;
+
+	if (!kc->kc_listed) {
+		kmem_cache_register(kc);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_allocs++;
+	if (kc->kc_nfree > 0) {
+		obj = kc->kc_free[--kc->kc_nfree];
+		kc->kc_hits++;
+		kc->kc_inuse++;
+		if (kc->kc_inuse > kc->kc_peak) {
+			kc->kc_peak = kc->kc_inuse;
+		}
+		spinlock_release(&kc->kc_lock);
+		return obj;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	/* Make a new one. */
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL) {
+		result = kc->kc_ctor(obj);
+		if (result) {
+			kfree(obj);
+			return NULL;
+		}
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_inuse++;
+	if (kc->kc_inuse > kc->kc_peak) {
+		kc->kc_peak = kc->kc_inuse;
+	}
+	spinlock_release(&kc->kc_lock);
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	if (obj == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(kc->kc_inuse > 0);
+	kc->kc_frees++;
+	kc->kc_inuse--;
+	if (kc->kc_nfree < kc->kc_depth) {
+		kc->kc_free[kc->kc_nfree++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	kc->kc_destroyed++;
+	spinlock_release(&kc->kc_lock);
+
+	/* Cache is full; really free it. */
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+/*
+ * Empty one cache, running the destructor on each object. The objects
+ * are taken off under the spinlock but destroyed after dropping it,
+ * since kfree of a large object can sleep.
+ */
+static
+unsigned
+kmem_cache_drain(struct kmem_cache *kc)
+{
+	void *objs[KMEM_CACHE_DEPTH];
+	unsigned i, n;
+
+	spinlock_acquire(&kc->kc_lock);
+	n = kc->kc_nfree;
+	for (i = 0; i < n; i++) {
+		objs[i] = kc->kc_free[i];
+	}
+	kc->kc_nfree = 0;
+	kc->kc_destroyed += n;
+	spinlock_release(&kc->kc_lock);
+
+	for (i = 0; i < n; i++) {
+		if (kc->kc_dtor != NULL) {
+			kc->kc_dtor(objs[i]);
+		}
+		kfree(objs[i]);
+	}
+	return n;
+}
+
+unsigned
+kmem_cache_reclaim(void)
+{
+	struct kmem_cache *kc;
+	unsigned n;
+
+	/*
+	 * Caches are only ever added at the head of the list and never
+	 * removed, so once we have the head the rest can be walked
+	 * without the list lock.
+	 */
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_caches_lock);
+
+	n = 0;
+	for (; kc != NULL; kc = kc->kc_next) {
+		n += kmem_cache_drain(kc);
+	}
+	return n;
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	kprintf("Object caches:\n");
+	kprintf("   %-12s %5s %5s %8s %8s %6s %6s %6s %6s\n", "name",
+		"size", "depth", "allocs", "hits", "inuse", "peak", "cached",
+		"freed");
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kprintf("   %-12s %5lu %5u %8u %8u %6u %6u %6u %6u\n",
+			kc->kc_name, (unsigned long)kc->kc_size, kc->kc_depth,
+			kc->kc_allocs, kc->kc_hits, kc->kc_inuse,
+			kc->kc_peak, kc->kc_nfree, kc->kc_destroyed);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
@@ -73,18 +73,21 @@ static int timing = 0;
 #define MAXBG 128
 static pid_t bgpids[MAXBG];
 
+/* most commands in one pipeline */
+#define MAXPIPE 16
+
 /*
  * can_bg
- * just checks for an open slot.
+ * just checks for N open slots.
  */
 static
 int
-can_bg(void)
+can_bg(int n)
 {
 	int i;
 
 	for (i = 0; i < MAXBG; i++) {
-		if (bgpids[i] == 0) {
+		if (bgpids[i] == 0 && --n == 0) {
 			return 1;
 		}
 	}
@@ -360,14 +363,20 @@ static struct {
  * tokenizes the command line using strtok.  if there aren't any commands,
  * simply returns.  checks to see if it's a builtin, running it if it is.
  * otherwise, it's a standard command.  check for the '&', try to background
- * the job if possible, otherwise just run it and wait on it.
+ * the job if possible, otherwise just run it and wait on it.  a '|' token
+ * splits the line into a pipeline; each command runs in its own process
+ * with its output piped to the next one's input, and we wait for all of
+ * them.
  */
 static
 void
 docommand(char *buf, struct exitinfo *ei)
 {
 	char *args[NARG_MAX + 1];
-	int nargs, i;
+	char **cmds[MAXPIPE];
+	pid_t pids[MAXPIPE];
+	int nargs, ncmds, i;
+	int pfd[2], infd, failed;
 	char *s;
 	pid_t pid;
 	int status;
@@ -394,18 +403,44 @@ docommand(char *buf, struct exitinfo *ei)
 		return;
 	}
 
-	for (i=0; builtins[i].name; i++) {
-		if (!strcmp(builtins[i].name, args[0])) {
-			builtins[i].func(nargs, args, ei);
+	/* split into pipeline stages */
+	ncmds = 0;
+	cmds[ncmds++] = args;
+	for (i=0; i<nargs; i++) {
+		if (strcmp(args[i], "|")) {
+			continue;
+		}
+		if (ncmds >= MAXPIPE) {
+			printf("Too many commands in pipeline\n");
+			exitinfo_exit(ei, 1);
+			return;
+		}
+		args[i] = NULL;
+		cmds[ncmds++] = &args[i+1];
+	}
+	for (i=0; i<ncmds; i++) {
+		if (cmds[i][0] == NULL || !strcmp(cmds[i][0], "&")) {
+			printf("Syntax error: empty command in pipeline\n");
+			exitinfo_exit(ei, 1);
 			return;
 		}
 	}
 
+	if (ncmds == 1) {
+		for (i=0; builtins[i].name; i++) {
+			if (!strcmp(builtins[i].name, args[0])) {
+				builtins[i].func(nargs, args, ei);
+				return;
+			}
+		}
+	}
+
 	/* Not a builtin; run it */
 
-	if (nargs > 0 && !strcmp(args[nargs-1], "&")) {
+	if (nargs > 0 && args[nargs-1] != NULL &&
+	    !strcmp(args[nargs-1], "&")) {
 		/* background */
-		if (!can_bg()) {
+		if (!can_bg(ncmds)) {
 			printf("%s: Too many background jobs; wait for "
 			       "some to finish before starting more\n",
 			       args[0]);
@@ -421,17 +456,41 @@ docommand(char *buf, struct exitinfo *ei)
 		__time(&startsecs, &startnsecs);
 	}
 
-	pid = fork();
-	switch (pid) {
-		case -1:
+	infd = -1;
+	for (i=0; i<ncmds; i++) {
+		if (i < ncmds-1 && pipe(pfd) < 0) {
+			warn("pipe");
+			break;
+		}
+		/*
+		 * The child only rearranges file handles and execs,
+		 * so it can run in our memory instead of a copy. It
+		 * must not return or touch anything of ours that we
+		 * care about.
+		 */
+		pid = vfork();
+		switch (pid) {
+		    case -1:
 			/* error */
-			warn("fork");
-			exitinfo_exit(ei, 255);
-			return;
-		case 0:
+			warn("vfork");
+			if (i < ncmds-1) {
+				close(pfd[0]);
+				close(pfd[1]);
+			}
+			break;
+		    case 0:
 			/* child */
-			execvp(args[0], args);
-			warn("%s", args[0]);
+			if (infd >= 0) {
+				dup2(infd, STDIN_FILENO);
+				close(infd);
+			}
+			if (i < ncmds-1) {
+				close(pfd[0]);
+				dup2(pfd[1], STDOUT_FILENO);
+				close(pfd[1]);
+			}
+			execvp(cmds[i][0], cmds[i]);
+			warn("%s", cmds[i][0]);
 			/*
 			 * Use _exit() instead of exit() in the child
 			 * process to avoid calling atexit() functions,
@@ -440,25 +499,54 @@ docommand(char *buf, struct exitinfo *ei)
 			 * handling.
 			 */
 			_exit(1);
-		default:
+		    default:
+			break;
+		}
+		if (pid < 0) {
 			break;
+		}
+
+		/* parent */
+		pids[i] = pid;
+		if (infd >= 0) {
+			close(infd);
+			infd = -1;
+		}
+		if (i < ncmds-1) {
+			close(pfd[1]);
+			infd = pfd[0];
+		}
+	}
+	if (infd >= 0) {
+		close(infd);
+	}
+	failed = i < ncmds;
+	if (failed) {
+		/* couldn't start the whole pipeline; reap what we did */
+		ncmds = i;
+		bg = 0;
+		exitinfo_exit(ei, 255);
 	}
 
-	/* parent */
 	if (bg) {
 		/* background this command */
-		remember_bg(pid);
-		printf("[%d] %s ... &\n", pid, args[0]);
+		for (i=0; i<ncmds; i++) {
+			remember_bg(pids[i]);
+			printf("[%d] %s ... &\n", pids[i], cmds[i][0]);
+		}
 		exitinfo_exit(ei, 0);
 		return;
 	}
 
-	if (waitpid(pid, &status, 0) < 0) {
-		warn("waitpid");
-		exitinfo_exit(ei, 255);
-	}
-	else {
-		readstatus(status, ei);
+	/* the pipeline's status is the last command's */
+	for (i=0; i<ncmds; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			warn("waitpid");
+			exitinfo_exit(ei, 255);
+		}
+		else if (i == ncmds-1 && !failed) {
+			readstatus(status, ei);
+		}
 	}
 
 	if (timing) {
@@ -39,7 +39,9 @@
  * about the kern/ headers.
  */
 #include <kern/fcntl.h>
+#include <kern/futex.h>
 #include <kern/ioctl.h>
+#include <kern/poll.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
@@ -140,6 +142,7 @@ int link(const char *oldfile, const char *newfile);
 int chdir(const char *path);
 
 /* Optional. */
+pid_t vfork(void);		/* child shares memory until execv/_exit */
 void *sbrk(__intptr_t change);
 ssize_t getdirentry(int filehandle, char *buf, size_t buflen);
 int symlink(const char *target, const char *linkname);
@@ -147,7 +150,16 @@ ssize_t readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
+int poll(struct pollfd *fds, unsigned nfds, int timeout_ms);
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+	   struct timeval *timeout);
 ssize_t __getcwd(char *buf, size_t buflen);
+int __thread_create(void (*start)(void (*)(void *), void *),
+		    void (*func)(void *), void *arg);
+__DEAD void thread_exit(int code);
+int thread_join(int tid, int *code);
+int futex(volatile int *addr, int op, int val);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -158,5 +170,37 @@ ssize_t __getcwd(char *buf, size_t buflen);
 int execvp(const char *prog, char *const *args); /* calls execv */
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+int thread_create(void (*func)(void *), void *arg); /* calls __thread_create */
+
+/*
+ * Mutexes and condition variables for user threads, in libc.
+ *
+ * Both live entirely in user memory: taking a free mutex, or
+ * releasing one nobody is waiting for, doesn't enter the kernel.
+ * Only contended paths sleep and wake through futex(). Initialize
+ * with the initializers or the init functions; there is nothing to
+ * destroy.
+ */
+
+struct mutex {
+	volatile int m_state;	/* 0 free, 1 held, 2 held and contended */
+};
+
+struct cond {
+	volatile int c_seq;	/* bumped by every signal and broadcast */
+};
+
+#define MUTEX_INITIALIZER	{ 0 }
+#define COND_INITIALIZER	{ 0 }
+
+void mutex_init(struct mutex *m);
+void mutex_lock(struct mutex *m);
+int mutex_trylock(struct mutex *m);	/* -1 (EBUSY) if held */
+void mutex_unlock(struct mutex *m);
+
+void cond_init(struct cond *c);
+void cond_wait(struct cond *c, struct mutex *m);
+void cond_signal(struct cond *c);
+void cond_broadcast(struct cond *c);
 
 #endif /* _UNISTD_H_ */
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * Mutexes and condition variables for user threads, built on futex().
+ *
+ * The mutex word is 0 when free, 1 when held, and 2 when held with
+ * (possibly) someone asleep on it. Lock tries 0->1 and is done if
+ * that works. Otherwise it sets the word to 2 and sleeps until it
+ * sees 0 go by. Unlock sets 0 and only calls into the kernel if the
+ * word was 2.
+ *
+ * A condvar is a sequence number. Waiters note it, drop the mutex and
+ * sleep as long as it hasn't changed; signal and broadcast bump it
+ * and wake one or all.
+ */
+
+/* wake count that means "everyone" */
+#define WAKE_ALL	0x7fffffff
+
+/*
+ * Compare-and-swap with LL/SC: if *P is OLD make it NEW. Returns what
+ * *P was. See the kernel's spinlock_data_testandset for the rules
+ * about LL/SC.
+ *
+ * It is a full barrier: the leading sync keeps earlier stores from
+ * being seen after the swap, which is what makes mutex_unlock a
+ * release, and the trailing one keeps later accesses from moving up
+ * before it, which makes mutex_lock an acquire.
+ */
+static
+int
+atomic_cas(volatile int *p, int old, int new)
+{
+	int prev, tmp;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set noreorder;"	/* we fill the delay slots */
+		"sync;"			/* order earlier memory accesses */
+		"1: ll %0, 0(%2);"	/*   prev = *p */
+		"bne %0, %3, 2f;"	/*   if (prev != old) done */
+		"move %1, %4;"		/*   tmp = new (delay slot) */
+		"sc %1, 0(%2);"		/*   *p = tmp; tmp = success? */
+		"beqz %1, 1b;"		/*   retry if the store failed */
+		"nop;"
+		"2: sync;"		/* order later memory accesses */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (prev), "=&r" (tmp)
+		: "r" (p), "r" (old), "r" (new)
+		: "memory");
+	return prev;
+}
+
+static
+int
+atomic_xchg(volatile int *p, int new)
+{
+	int old;
+
+	do {
+		old = *p;
+	} while (atomic_cas(p, old, new) != old);
+	return old;
+}
+
+static
+void
+atomic_inc(volatile int *p)
+{
+	int old;
+
+	do {
+		old = *p;
+	} while (atomic_cas(p, old, old + 1) != old);
+}
+
+////////////////////////////////////////////////////////////
+
+void
+mutex_init(struct mutex *m)
+{
+	m->m_state = 0;
+}
+
+/*
+ * Slow path: mark the mutex contended and sleep until we're the one
+ * who changes it from free. Since we can't tell whether others are
+ * still asleep, we always leave it marked contended.
+ */
+static
+void
+mutex_lock_contended(struct mutex *m)
+{
+	int saved_errno = errno;
+
+	while (atomic_xchg(&m->m_state, 2) != 0) {
+		/* EAGAIN just means it changed before we slept */
+		futex(&m->m_state, FUTEX_WAIT, 2);
+	}
+	errno = saved_errno;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+	if (atomic_cas(&m->m_state, 0, 1) != 0) {
+		mutex_lock_contended(m);
+	}
+}
+
+int
+mutex_trylock(struct mutex *m)
+{
+	if (atomic_cas(&m->m_state, 0, 1) != 0) {
+		errno = EBUSY;
+		return -1;
+	}
+	return 0;
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	int saved_errno;
+
+	if (atomic_xchg(&m->m_state, 0) == 2) {
+		saved_errno = errno;
+		futex(&m->m_state, FUTEX_WAKE, 1);
+		errno = saved_errno;
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+void
+cond_init(struct cond *c)
+{
+	c->c_seq = 0;
+}
+
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+	int saved_errno = errno;
+	int seq;
+
+	seq = c->c_seq;
+	mutex_unlock(m);
+	futex(&c->c_seq, FUTEX_WAIT, seq);
+	errno = saved_errno;
+
+	/* others may have been woken with us */
+	mutex_lock_contended(m);
+}
+
+void
+cond_signal(struct cond *c)
+{
+	int saved_errno = errno;
+
+	atomic_inc(&c->c_seq);
+	futex(&c->c_seq, FUTEX_WAKE, 1);
+	errno = saved_errno;
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+	int saved_errno = errno;
+
+	atomic_inc(&c->c_seq);
+	futex(&c->c_seq, FUTEX_WAKE, WAKE_ALL);
+	errno = saved_errno;
+}
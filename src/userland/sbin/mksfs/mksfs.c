@@ -73,6 +73,8 @@ check(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jdesc)==SFS_BLOCKSIZE);
 }
 
 /*
@@ -94,7 +96,7 @@ allocblock(uint32_t block)
  */
 static
 void
-initfreemap(uint32_t fsblocks)
+initfreemap(uint32_t fsblocks, uint32_t jstart, uint32_t jblocks)
 {
 	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks);
 	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
@@ -114,6 +116,11 @@ initfreemap(uint32_t fsblocks)
 		allocblock(SFS_FREEMAP_START + i);
 	}
 
+	/* so is the journal, if any */
+	for (i=0; i<jblocks; i++) {
+		allocblock(jstart + i);
+	}
+
 	/* all blocks in the freemap but past the volume end are "in use" */
 	for (i=fsblocks; i<freemapbits; i++) {
 		allocblock(i);
@@ -125,7 +132,8 @@ initfreemap(uint32_t fsblocks)
  */
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+writesuper(const char *volname, uint32_t nblocks, uint32_t features,
+	   uint32_t jstart, uint32_t jblocks)
 {
 	struct sfs_superblock sb;
 
@@ -140,6 +148,9 @@ writesuper(const char *volname, uint32_t nblocks)
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
 	strcpy(sb.sb_volname, volname);
+	sb.sb_features = SWAP32(features);
+	sb.sb_journalstart = SWAP32(jstart);
+	sb.sb_journalblocks = SWAP32(jblocks);
 
 	/* and write it out. */
 	diskwrite(&sb, SFS_SUPER_BLOCK);
@@ -164,6 +175,27 @@ writefreemap(uint32_t fsblocks)
 	}
 }
 
+/*
+ * Write out an empty journal: a header saying nothing is pending,
+ * and a blank descriptor so no stale transaction can match.
+ */
+static
+void
+writejournal(uint32_t jstart)
+{
+	struct sfs_jheader jh;
+	struct sfs_jdesc jd;
+
+	bzero((void *)&jh, sizeof(jh));
+	jh.jh_magic = SWAP32(SFS_JMAGIC_HEADER);
+	jh.jh_seq = SWAP32(0);
+	jh.jh_clean = SWAP32(1);
+	diskwrite(&jh, jstart);
+
+	bzero((void *)&jd, sizeof(jd));
+	diskwrite(&jd, jstart + 1);
+}
+
 /*
  * Write out the root directory inode.
  */
@@ -189,15 +221,36 @@ writerootdir(void)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, blocksize, features;
+	uint32_t jstart, jblocks;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	/*
+	 * -b turns on the 2x/3x indirect blocks for large files.
+	 * -j adds a metadata journal. Both are off by default so the
+	 * volume stays readable by older tools.
+	 */
+	features = 0;
+	while (argc > 3 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-b")) {
+			features |= SFS_FEATURE_BIGFILES;
+		}
+		else if (!strcmp(argv[1], "-j")) {
+			features |= SFS_FEATURE_JOURNAL;
+		}
+		else {
+			break;
+		}
+		argc--;
+		argv++;
+	}
+
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-b] [-j] device/diskfile volume-name");
 	}
 
 	check();
@@ -228,10 +281,23 @@ main(int argc, char **argv)
 	}
 	size = diskblocks();
 
+	/* The journal, if any, goes right after the freemap */
+	jstart = jblocks = 0;
+	if (features & SFS_FEATURE_JOURNAL) {
+		jstart = SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(size);
+		jblocks = SFS_JOURNAL_BLOCKS;
+		if (jstart + jblocks >= size) {
+			errx(1, "Device too small for a journal");
+		}
+	}
+
 	/* Write out the on-disk structures */
-	initfreemap(size);
-	writesuper(volname, size);
+	initfreemap(size, jstart, jblocks);
+	writesuper(volname, size, features, jstart, jblocks);
 	writefreemap(size);
+	if (jblocks > 0) {
+		writejournal(jstart);
+	}
 	writerootdir();
 
 	closedisk();
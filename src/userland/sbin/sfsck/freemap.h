@@ -45,6 +45,7 @@ typedef enum {
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
 	B_DATA,		/* Data block */
+	B_JOURNAL,	/* Block of the metadata journal */
 	B_PASTEND,	/* Block off the end of the fs */
 } blockusage_t;
 
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2009, 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "disk.h"
+#include "sfs.h"
+#include "sb.h"
+#include "journal.h"
+#include "main.h"
+
+/*
+ * Checksum over a logged block image, as defined in <kern/sfs.h>.
+ * The words are summed in on-disk byte order.
+ */
+static
+uint32_t
+journal_checksum(uint32_t sum, const uint32_t *words)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE/sizeof(uint32_t); i++) {
+		sum = ((sum << 1) | (sum >> 31)) + SWAP32(words[i]);
+	}
+	return sum;
+}
+
+/*
+ * Rewrite the journal header.
+ */
+static
+void
+journal_writeheader(uint32_t seq, int clean)
+{
+	struct sfs_jheader jh;
+	unsigned i;
+
+	jh.jh_magic = SFS_JMAGIC_HEADER;
+	jh.jh_seq = seq;
+	jh.jh_clean = clean ? 1 : 0;
+	for (i=0; i<sizeof(jh.reserved)/sizeof(jh.reserved[0]); i++) {
+		jh.reserved[i] = 0;
+	}
+	sfs_writejheader(sb_journalstart(), &jh);
+}
+
+/*
+ * Look at the transaction after the last applied one (the journal
+ * tail). If it was committed, copy its blocks home. Returns 1 if a
+ * transaction was replayed; *COMPLETE gets whether it ended at a
+ * sync.
+ */
+static
+int
+journal_replay(uint32_t seq, int *complete)
+{
+	static uint32_t images[SFS_JMAXBLOCKS][SFS_BLOCKSIZE/sizeof(uint32_t)];
+	struct sfs_jdesc jd;
+	struct sfs_jcommit jc;
+	uint32_t start, max, n, i, block, sum;
+
+	start = sb_journalstart();
+	max = sb_journalblocks() - 3;
+	if (max > SFS_JMAXBLOCKS) {
+		max = SFS_JMAXBLOCKS;
+	}
+
+	sfs_readjdesc(start + 1, &jd);
+	if (jd.jd_magic != SFS_JMAGIC_DESC || jd.jd_seq != seq) {
+		return 0;
+	}
+	n = jd.jd_nblocks;
+	if (n == 0 || n > max) {
+		warnx("Journal transaction %lu has bad length %lu (ignored)",
+		      (unsigned long)seq, (unsigned long)n);
+		return 0;
+	}
+	for (i=0; i<n; i++) {
+		block = jd.jd_blocks[i];
+		if (block == SFS_SUPER_BLOCK || block >= sb_totalblocks() ||
+		    (block >= start && block < start + sb_journalblocks())) {
+			warnx("Journal transaction %lu logs bad block %lu "
+			      "(ignored)", (unsigned long)seq,
+			      (unsigned long)block);
+			return 0;
+		}
+	}
+
+	sfs_readjcommit(start + 2 + n, &jc);
+	if (jc.jc_magic != SFS_JMAGIC_COMMIT || jc.jc_seq != seq) {
+		/* never committed */
+		return 0;
+	}
+
+	sum = 0;
+	for (i=0; i<n; i++) {
+		diskread(images[i], start + 2 + i);
+		sum = journal_checksum(sum, images[i]);
+	}
+	if (sum != jc.jc_checksum) {
+		warnx("Journal transaction %lu has bad checksum (ignored)",
+		      (unsigned long)seq);
+		return 0;
+	}
+
+	for (i=0; i<n; i++) {
+		diskwrite(images[i], jd.jd_blocks[i]);
+	}
+	warnx("Replayed journal transaction %lu (%lu blocks)",
+	      (unsigned long)seq, (unsigned long)n);
+	*complete = jc.jc_complete != 0;
+	return 1;
+}
+
+int
+journal_check(void)
+{
+	struct sfs_jheader jh;
+	int complete;
+
+	if (sb_journalblocks() == 0) {
+		return 0;
+	}
+
+	sfs_readjheader(sb_journalstart(), &jh);
+	if (jh.jh_magic != SFS_JMAGIC_HEADER) {
+		static uint32_t zeros[SFS_BLOCKSIZE/sizeof(uint32_t)];
+
+		warnx("Journal header invalid (fixed)");
+		setbadness(EXIT_RECOV);
+		/* Wipe the descriptor so nothing stale can match seq 1 */
+		diskwrite(zeros, sb_journalstart() + 1);
+		journal_writeheader(0, 0);
+		return 0;
+	}
+
+	if (journal_replay(jh.jh_seq + 1, &complete)) {
+		setbadness(EXIT_RECOV);
+		jh.jh_seq++;
+		jh.jh_clean = complete;
+		journal_writeheader(jh.jh_seq, jh.jh_clean);
+	}
+
+	return jh.jh_clean != 0;
+}
+
+void
+journal_markclean(void)
+{
+	struct sfs_jheader jh;
+
+	if (sb_journalblocks() == 0) {
+		return;
+	}
+	sfs_readjheader(sb_journalstart(), &jh);
+	if (jh.jh_clean == 0) {
+		journal_writeheader(jh.jh_seq, 1);
+	}
+}
@@ -30,6 +30,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <err.h>
 
 #include "compat.h"
@@ -40,6 +41,7 @@
 #include "freemap.h"
 #include "inode.h"
 #include "passes.h"
+#include "journal.h"
 #include "main.h"
 
 static int badness=0;
@@ -64,13 +66,22 @@ setbadness(int code)
 int
 main(int argc, char **argv)
 {
+	int force = 0;
+
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	/* -f forces a full check even if the journal says it's clean */
+	if (argc==3 && !strcmp(argv[1], "-f")) {
+		force = 1;
+		argc--;
+		argv++;
+	}
+
 	/* FUTURE: add -n option */
 	if (argc!=2) {
-		errx(EXIT_USAGE, "Usage: sfsck device/diskfile");
+		errx(EXIT_USAGE, "Usage: sfsck [-f] device/diskfile");
 	}
 
 	opendisk(argv[1]);
@@ -78,6 +89,17 @@ main(int argc, char **argv)
 	sfs_setup();
 	sb_load();
 	sb_check();
+
+	/*
+	 * With a journal, replaying its tail is all that's needed if
+	 * the last transaction ended at a sync point.
+	 */
+	if (journal_check() && !force) {
+		closedisk();
+		warnx("Journal clean; skipping full check (use -f to force)");
+		return badness;
+	}
+
 	freemap_setup();
 
 	printf("Phase 1 -- check blocks and sizes\n");
@@ -91,6 +113,10 @@ main(int argc, char **argv)
 	printf("Phase 3 -- check reference counts\n");
 	inode_adjust_filelinks();
 
+	if (badness < EXIT_UNRECOV) {
+		journal_markclean();
+	}
+
 	closedisk();
 
 	warnx("%lu blocks used (of %lu); %lu directories; %lu files",
@@ -189,6 +189,23 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	int changed;
 	int i;
 
+	changed = 0;
+
+	/*
+	 * On volumes made without large file support the 2x/3x
+	 * indirect blocks can't be used, so nothing past INOMAX_I
+	 * can be part of the file. Anything mapped there is then
+	 * found past EOF below and freed.
+	 */
+	if (!sb_bigfiles() && sfi->sfi_size > INOMAX_I * SFS_BLOCKSIZE) {
+		setbadness(EXIT_RECOV);
+		warnx("Inode %lu: size %lu too large for volume without "
+		      "large files (truncated)", (unsigned long)ino,
+		      (unsigned long)sfi->sfi_size);
+		sfi->sfi_size = INOMAX_I * SFS_BLOCKSIZE;
+		changed = 1;
+	}
+
 	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
 
 	ibs.ino = ino;
@@ -198,8 +215,6 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	ibs.pasteofcount = 0;
 	ibs.usagetype = isdir ? B_DIRDATA : B_DATA;
 
-	changed = 0;
-
 	for (ibs.curfileblock=0; ibs.curfileblock<NUM_D; ibs.curfileblock++) {
 		datablock = GET_D(sfi, ibs.curfileblock);
 		if (datablock >= ibs.volblocks) {
@@ -83,6 +83,40 @@ sb_check(void)
 		setbadness(EXIT_RECOV);
 		schanged = 1;
 	}
+	if ((sb.sb_features & ~SFS_FEATURE_ALL) != 0) {
+		warnx("Unknown feature flags 0x%lx in superblock (cleared)",
+		      (unsigned long)(sb.sb_features & ~SFS_FEATURE_ALL));
+		setbadness(EXIT_RECOV);
+		sb.sb_features &= SFS_FEATURE_ALL;
+		schanged = 1;
+	}
+	if (sb.sb_features & SFS_FEATURE_JOURNAL) {
+		uint32_t mapend;
+
+		mapend = SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(sb.sb_nblocks);
+		if (sb.sb_journalblocks < SFS_JOURNAL_MIN ||
+		    sb.sb_journalstart < mapend ||
+		    sb.sb_journalstart >= sb.sb_nblocks ||
+		    sb.sb_journalblocks > sb.sb_nblocks - sb.sb_journalstart) {
+			warnx("Journal location %lu+%lu invalid "
+			      "(journal removed)",
+			      (unsigned long)sb.sb_journalstart,
+			      (unsigned long)sb.sb_journalblocks);
+			setbadness(EXIT_RECOV);
+			sb.sb_features &= ~SFS_FEATURE_JOURNAL;
+			sb.sb_journalstart = 0;
+			sb.sb_journalblocks = 0;
+			schanged = 1;
+		}
+	}
+	if ((sb.sb_features & SFS_FEATURE_JOURNAL) == 0 &&
+	    (sb.sb_journalstart != 0 || sb.sb_journalblocks != 0)) {
+		warnx("Journal fields set with no journal (fixed)");
+		setbadness(EXIT_RECOV);
+		sb.sb_journalstart = 0;
+		sb.sb_journalblocks = 0;
+		schanged = 1;
+	}
 	if (checkzeroed(sb.reserved, sizeof(sb.reserved))) {
 		warnx("Reserved section of superblock not zeroed (fixed)");
 		setbadness(EXIT_RECOV);
@@ -114,6 +148,33 @@ sb_freemapblocks(void)
 	return SFS_FREEMAPBLOCKS(sb.sb_nblocks);
 }
 
+/*
+ * Return true if the volume may use 2x/3x indirect blocks.
+ */
+int
+sb_bigfiles(void)
+{
+	return (sb.sb_features & SFS_FEATURE_BIGFILES) != 0;
+}
+
+/*
+ * Return the first block of the journal (0 if none).
+ */
+uint32_t
+sb_journalstart(void)
+{
+	return sb.sb_journalstart;
+}
+
+/*
+ * Return the number of journal blocks (0 if none).
+ */
+uint32_t
+sb_journalblocks(void)
+{
+	return sb.sb_journalblocks;
+}
+
 /*
  * Return the volume name.
  */
@@ -46,6 +46,13 @@ uint32_t sb_totalblocks(void);
 /* After the superblock is loaded: return number of freemap blocks. */
 uint32_t sb_freemapblocks(void);
 
+/* After the superblock is loaded: true if 2x/3x indirects are allowed. */
+int sb_bigfiles(void);
+
+/* After the superblock is checked: journal location (0 and 0 if none). */
+uint32_t sb_journalstart(void);
+uint32_t sb_journalblocks(void);
+
 /* After the superblock is loaded: return volume name. */
 const char *sb_volname(void);
 
@@ -51,6 +51,9 @@ sfs_setup(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jdesc)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
 }
 
 ////////////////////////////////////////////////////////////
@@ -62,6 +65,42 @@ swapsb(struct sfs_superblock *sb)
 {
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_features = SWAP32(sb->sb_features);
+	sb->sb_journalstart = SWAP32(sb->sb_journalstart);
+	sb->sb_journalblocks = SWAP32(sb->sb_journalblocks);
+}
+
+static
+void
+swapjheader(struct sfs_jheader *jh)
+{
+	jh->jh_magic = SWAP32(jh->jh_magic);
+	jh->jh_seq = SWAP32(jh->jh_seq);
+	jh->jh_clean = SWAP32(jh->jh_clean);
+}
+
+static
+void
+swapjdesc(struct sfs_jdesc *jd)
+{
+	int i;
+
+	jd->jd_magic = SWAP32(jd->jd_magic);
+	jd->jd_seq = SWAP32(jd->jd_seq);
+	jd->jd_nblocks = SWAP32(jd->jd_nblocks);
+	for (i=0; i<SFS_JMAXBLOCKS; i++) {
+		jd->jd_blocks[i] = SWAP32(jd->jd_blocks[i]);
+	}
+}
+
+static
+void
+swapjcommit(struct sfs_jcommit *jc)
+{
+	jc->jc_magic = SWAP32(jc->jc_magic);
+	jc->jc_seq = SWAP32(jc->jc_seq);
+	jc->jc_checksum = SWAP32(jc->jc_checksum);
+	jc->jc_complete = SWAP32(jc->jc_complete);
 }
 
 static
@@ -206,6 +245,39 @@ sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb)
 	swapsb(sb);
 }
 
+/*
+ *  journal records - blocknum is a disk block number.
+ */
+
+void
+sfs_readjheader(uint32_t blocknum, struct sfs_jheader *jh)
+{
+	diskread(jh, blocknum);
+	swapjheader(jh);
+}
+
+void
+sfs_writejheader(uint32_t blocknum, struct sfs_jheader *jh)
+{
+	swapjheader(jh);
+	diskwrite(jh, blocknum);
+	swapjheader(jh);
+}
+
+void
+sfs_readjdesc(uint32_t blocknum, struct sfs_jdesc *jd)
+{
+	diskread(jd, blocknum);
+	swapjdesc(jd);
+}
+
+void
+sfs_readjcommit(uint32_t blocknum, struct sfs_jcommit *jc)
+{
+	diskread(jc, blocknum);
+	swapjcommit(jc);
+}
+
 /*
  * freemap blocks - whichblock is a block number within the free block
  * bitmap.
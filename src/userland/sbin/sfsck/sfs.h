@@ -41,6 +41,9 @@
 struct sfs_superblock;
 struct sfs_dinode;
 struct sfs_direntry;
+struct sfs_jheader;
+struct sfs_jdesc;
+struct sfs_jcommit;
 
 /* Call this before anything else in this module */
 void sfs_setup(void);
@@ -53,6 +56,12 @@ void sfs_setup(void);
 void sfs_readsb(uint32_t blocknum, struct sfs_superblock *sb);
 void sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb);
 
+/* journal records (the logged block images are read with diskread) */
+void sfs_readjheader(uint32_t blocknum, struct sfs_jheader *jh);
+void sfs_writejheader(uint32_t blocknum, struct sfs_jheader *jh);
+void sfs_readjdesc(uint32_t blocknum, struct sfs_jdesc *jd);
+void sfs_readjcommit(uint32_t blocknum, struct sfs_jcommit *jc);
+
 /* freemap blocks; whichblock is the freemap block number (starts at 0) */
 void sfs_readfreemapblock(uint32_t whichblock, uint8_t *bits);
 void sfs_writefreemapblock(uint32_t whichblock, uint8_t *bits);
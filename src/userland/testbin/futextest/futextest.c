@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * futextest - test futex() and the libc mutexes and condition
+ * variables built on it.
+ *
+ * Runs in four parts:
+ *    1. futex() itself: a WAIT on a word that doesn't hold the
+ *       expected value must fail at once, and a WAKE with nobody
+ *       asleep must wake nobody.
+ *    2. Several threads hammer a counter under a mutex, with
+ *       mutex_trylock mixed in. The final count must come out exact.
+ *    3. A bounded buffer between producer and consumer threads,
+ *       using cond_wait, cond_signal and cond_broadcast. Everything
+ *       produced must be consumed exactly once.
+ *    4. A child process parks threads in cond_wait and in read on
+ *       an empty pipe, then exits from the main thread. The exit
+ *       must not wait for them; if futex waiters aren't released
+ *       when the process exits, this part hangs.
+ *
+ * Needs thread_create, thread_join, futex, fork, waitpid and pipe.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#define NTHREADS	8
+#define NLOOPS		2000
+
+#define NPRODUCERS	3
+#define NCONSUMERS	3
+#define NITEMS		500		/* per producer */
+#define BUFSIZE		4
+
+#define NSLEEPERS	4
+#define EXITCODE	7
+
+////////////////////////////////////////////////////////////
+// futex
+
+static
+void
+futex_basic(void)
+{
+	volatile int word = 0;
+	int result;
+
+	result = futex(&word, FUTEX_WAIT, 1);
+	if (result != -1 || errno != EAGAIN) {
+		errx(1, "futex WAIT on a changed word: result %d, %s",
+		     result, strerror(errno));
+	}
+
+	result = futex(&word, FUTEX_WAKE, 1);
+	if (result != 0) {
+		errx(1, "futex WAKE with no sleepers woke %d", result);
+	}
+
+	result = futex(&word, 12345, 0);
+	if (result != -1 || errno != EINVAL) {
+		errx(1, "futex with a bad op: result %d, %s",
+		     result, strerror(errno));
+	}
+
+	printf("futex: ok\n");
+}
+
+////////////////////////////////////////////////////////////
+// mutex
+
+static struct mutex countlock = MUTEX_INITIALIZER;
+static volatile unsigned count;
+static volatile unsigned trylockfails;
+
+static
+void
+countthread(void *arg)
+{
+	unsigned i;
+
+	(void)arg;
+	for (i=0; i<NLOOPS; i++) {
+		if (i % 4 == 0) {
+			while (mutex_trylock(&countlock) < 0) {
+				if (errno != EBUSY) {
+					err(1, "mutex_trylock");
+				}
+				trylockfails++;
+			}
+		}
+		else {
+			mutex_lock(&countlock);
+		}
+		count++;
+		mutex_unlock(&countlock);
+	}
+}
+
+static
+void
+mutex_contended(void)
+{
+	int tids[NTHREADS];
+	unsigned i;
+
+	/* a held mutex can't be taken again */
+	mutex_lock(&countlock);
+	if (mutex_trylock(&countlock) != -1 || errno != EBUSY) {
+		errx(1, "mutex_trylock succeeded on a held mutex");
+	}
+	mutex_unlock(&countlock);
+
+	count = 0;
+	for (i=0; i<NTHREADS; i++) {
+		tids[i] = thread_create(countthread, NULL);
+		if (tids[i] < 0) {
+			err(1, "thread_create");
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		if (thread_join(tids[i], NULL) < 0) {
+			err(1, "thread_join");
+		}
+	}
+
+	if (count != NTHREADS * NLOOPS) {
+		errx(1, "mutex: count is %u, expected %u",
+		     count, NTHREADS * NLOOPS);
+	}
+	if (countlock.m_state != 0) {
+		errx(1, "mutex: still held after all threads finished");
+	}
+	printf("mutex: ok (%u trylock misses)\n", trylockfails);
+}
+
+////////////////////////////////////////////////////////////
+// cond
+
+static struct mutex buflock = MUTEX_INITIALIZER;
+static struct cond notfull = COND_INITIALIZER;
+static struct cond notempty = COND_INITIALIZER;
+static unsigned buf[BUFSIZE];
+static unsigned bufhead, buflen;
+static unsigned producersleft;
+static unsigned consumed, consumedsum;
+
+static
+void
+producer(void *arg)
+{
+	unsigned i;
+
+	(void)arg;
+	for (i=1; i<=NITEMS; i++) {
+		mutex_lock(&buflock);
+		while (buflen == BUFSIZE) {
+			cond_wait(&notfull, &buflock);
+		}
+		buf[(bufhead + buflen) % BUFSIZE] = i;
+		buflen++;
+		cond_signal(&notempty);
+		mutex_unlock(&buflock);
+	}
+
+	mutex_lock(&buflock);
+	producersleft--;
+	if (producersleft == 0) {
+		/* consumers waiting on an empty buffer must now quit */
+		cond_broadcast(&notempty);
+	}
+	mutex_unlock(&buflock);
+}
+
+static
+void
+consumer(void *arg)
+{
+	unsigned item;
+
+	(void)arg;
+	mutex_lock(&buflock);
+	while (1) {
+		while (buflen == 0 && producersleft > 0) {
+			cond_wait(&notempty, &buflock);
+		}
+		if (buflen == 0) {
+			break;
+		}
+		item = buf[bufhead];
+		bufhead = (bufhead + 1) % BUFSIZE;
+		buflen--;
+		consumed++;
+		consumedsum += item;
+		cond_signal(&notfull);
+	}
+	mutex_unlock(&buflock);
+}
+
+static
+void
+cond_boundedbuffer(void)
+{
+	int tids[NPRODUCERS + NCONSUMERS];
+	unsigned i, expectsum;
+
+	producersleft = NPRODUCERS;
+	for (i=0; i<NCONSUMERS; i++) {
+		tids[i] = thread_create(consumer, NULL);
+		if (tids[i] < 0) {
+			err(1, "thread_create");
+		}
+	}
+	for (i=0; i<NPRODUCERS; i++) {
+		tids[NCONSUMERS + i] = thread_create(producer, NULL);
+		if (tids[NCONSUMERS + i] < 0) {
+			err(1, "thread_create");
+		}
+	}
+	for (i=0; i<NPRODUCERS + NCONSUMERS; i++) {
+		if (thread_join(tids[i], NULL) < 0) {
+			err(1, "thread_join");
+		}
+	}
+
+	expectsum = NPRODUCERS * (NITEMS * (NITEMS + 1) / 2);
+	if (consumed != NPRODUCERS * NITEMS || consumedsum != expectsum) {
+		errx(1, "cond: consumed %u items summing to %u, "
+		     "expected %u summing to %u", consumed, consumedsum,
+		     NPRODUCERS * NITEMS, expectsum);
+	}
+	printf("cond: ok\n");
+}
+
+////////////////////////////////////////////////////////////
+// exit with waiters
+
+static struct mutex parklock = MUTEX_INITIALIZER;
+static struct cond parkcond = COND_INITIALIZER;
+static struct cond parkedcond = COND_INITIALIZER;
+static unsigned parked;
+static int parkfd;
+
+static
+void
+parkthread(void *arg)
+{
+	(void)arg;
+	mutex_lock(&parklock);
+	parked++;
+	cond_signal(&parkedcond);
+	/* nobody ever signals parkcond */
+	while (1) {
+		cond_wait(&parkcond, &parklock);
+	}
+}
+
+static
+void
+readthread(void *arg)
+{
+	char ch;
+
+	(void)arg;
+	mutex_lock(&parklock);
+	parked++;
+	cond_signal(&parkedcond);
+	mutex_unlock(&parklock);
+	/* nobody ever writes the pipe */
+	read(parkfd, &ch, 1);
+	_exit(1);
+}
+
+static
+void
+exit_with_waiters(void)
+{
+	int fds[2];
+	unsigned i;
+	pid_t pid;
+	int status;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		parkfd = fds[0];
+		for (i=0; i<NSLEEPERS; i++) {
+			if (thread_create(parkthread, NULL) < 0) {
+				err(1, "thread_create");
+			}
+		}
+		if (thread_create(readthread, NULL) < 0) {
+			err(1, "thread_create");
+		}
+
+		mutex_lock(&parklock);
+		while (parked < NSLEEPERS + 1) {
+			cond_wait(&parkedcond, &parklock);
+		}
+		mutex_unlock(&parklock);
+
+		/*
+		 * Every parked thread has at least dropped parklock on
+		 * its way into cond_wait (we just took it). Exit out
+		 * from under them.
+		 */
+		exit(EXITCODE);
+	}
+
+	/* the parent keeps the write end open so the reader never sees EOF */
+	close(fds[0]);
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	close(fds[1]);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXITCODE) {
+		errx(1, "exit with waiters: child status 0x%x, "
+		     "expected exit %d", status, EXITCODE);
+	}
+	printf("exit with waiters: ok\n");
+}
+
+////////////////////////////////////////////////////////////
+// main
+
+int
+main(void)
+{
+	futex_basic();
+	mutex_contended();
+	cond_boundedbuffer();
+	exit_with_waiters();
+	printf("futextest: passed\n");
+	return 0;
+}
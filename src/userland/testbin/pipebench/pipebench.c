@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * pipebench.c
+ *
+ * 	Measure pipe throughput. A child writes the same amount of data
+ * 	through a pipe using several different write sizes, and the
+ * 	parent reads it back and reports the transfer rate for each.
+ *
+ * 	Everything goes through the kernel's ring buffer, so the rate
+ * 	should level off once writes reach the size of the ring.
+ *
+ * Usage: pipebench [total-kbytes]
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#define DEFAULT_KBYTES	1024
+#define MAXCHUNK	65536
+
+static const size_t chunks[] = { 64, 512, 4096, 16384, MAXCHUNK };
+#define NCHUNKS (sizeof(chunks) / sizeof(chunks[0]))
+
+static char wbuf[MAXCHUNK];
+static char rbuf[MAXCHUNK];
+
+static
+void
+writer(int fd, size_t chunk, size_t total)
+{
+	size_t done, n;
+	ssize_t r;
+
+	for (done = 0; done < total; done += r) {
+		n = total - done < chunk ? total - done : chunk;
+		r = write(fd, wbuf, n);
+		if (r < 0) {
+			err(1, "write");
+		}
+	}
+}
+
+/*
+ * Returns the number of bytes read before EOF.
+ */
+static
+size_t
+reader(int fd)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while ((r = read(fd, rbuf, sizeof(rbuf))) > 0) {
+		done += r;
+	}
+	if (r < 0) {
+		err(1, "read");
+	}
+	return done;
+}
+
+static
+void
+runone(size_t chunk, size_t total)
+{
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	unsigned long msecs;
+	int fds[2], status;
+	size_t got;
+	pid_t pid;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+
+	__time(&s0, &ns0);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		writer(fds[1], chunk, total);
+		_exit(0);
+	}
+	close(fds[1]);
+	got = reader(fds[0]);
+	close(fds[0]);
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	__time(&s1, &ns1);
+
+	if (got != total) {
+		errx(1, "chunk %lu: got %lu bytes, expected %lu",
+		     (unsigned long)chunk, (unsigned long)got,
+		     (unsigned long)total);
+	}
+
+	msecs = (s1 - s0) * 1000;
+	msecs += ns1 / 1000000;
+	msecs -= ns0 / 1000000;
+	if (msecs == 0) {
+		msecs = 1;
+	}
+	printf("%6lu-byte writes: %lu KB in %lu.%03lu s, %lu KB/s\n",
+	       (unsigned long)chunk, (unsigned long)(total / 1024),
+	       msecs / 1000, msecs % 1000,
+	       (unsigned long)(total / 1024) * 1000 / msecs);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t total;
+	unsigned i;
+
+	total = DEFAULT_KBYTES;
+	if (argc > 1) {
+		total = atoi(argv[1]);
+		if (total == 0) {
+			errx(1, "Usage: pipebench [total-kbytes]");
+		}
+	}
+	total *= 1024;
+
+	memset(wbuf, 'p', sizeof(wbuf));
+
+	for (i = 0; i < NCHUNKS; i++) {
+		runone(chunks[i], total);
+	}
+	return 0;
+}
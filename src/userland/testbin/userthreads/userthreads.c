@@ -29,20 +29,13 @@
 
 /*
  * Test multiple user level threads inside a process. The program
- * forks 3 threads off 2 to functions, each of which displays a string
- * every once in a while.
+ * starts 3 threads running 2 functions, each of which displays a
+ * string every once in a while, then waits for them all.
  *
- * This won't do much of anything unless you implement user-level
- * threads.
- *
- * It also makes various assumptions about the thread API. In
- * particular, it believes (1) that you create a thread by calling
- * "threadfork()" and passing the address for execution of the new
- * thread to begin at, (2) that if the parent thread exits any child
- * threads will keep running, and (3) child threads will exit if they
- * return from the function they started in. If any or all of these
- * assumptions are not met by your user-level threads, you will need
- * to patch this test accordingly.
+ * Threads are made with thread_create(func, arg) and collected with
+ * thread_join(). A thread that returns from its function exits; if
+ * the main thread returned from main() instead of joining, exit()
+ * would take the other threads down with it.
  *
  * This is also a rather basic test and you'll probably want to write
  * some more of your own.
@@ -51,6 +44,7 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <err.h>
 
 #define NTHREADS  3
 #define MAX       1<<25
@@ -61,22 +55,26 @@
 volatile int count = 0;
 
 /* the 2 threads : */
-void ThreadRunner(void);
-void BladeRunner(void);
+void ThreadRunner(void *);
+void BladeRunner(void *);
 
 int
 main(int argc, char *argv[])
 {
-    int i;
+    int i, tids[NTHREADS];
 
     (void)argc;
     (void)argv;
 
     for (i=0; i<NTHREADS; i++) {
-	if (i)
-	    threadfork(ThreadRunner);
-        else
-	    threadfork(BladeRunner);
+	tids[i] = thread_create(i ? ThreadRunner : BladeRunner, NULL);
+	if (tids[i] < 0)
+	    err(1, "thread_create");
+    }
+
+    for (i=0; i<NTHREADS; i++) {
+	if (thread_join(tids[i], NULL) < 0)
+	    err(1, "thread_join");
     }
 
     printf("Parent has left.\n");
@@ -89,8 +87,10 @@ main(int argc, char *argv[])
 */
 
 void
-BladeRunner()
+BladeRunner(void *arg)
 {
+    (void)arg;
+
     while (count < MAX) {
 	if (count % 500 == 0)
 	    printf("Blade ");
@@ -99,8 +99,10 @@ BladeRunner()
 }
 
 void
-ThreadRunner()
+ThreadRunner(void *arg)
 {
+    (void)arg;
+
     while (count < MAX) {
 	if (count % 513 == 0)
 	    printf(" Runner\n");